@@ -31,7 +31,13 @@ typedef std::unordered_map<std::string,
 struct CheckAggregationOptions {
   // Default constructor.
   CheckAggregationOptions()
-      : num_entries(10000), flush_interval_ms(500), expiration_ms(1000) {}
+      : num_entries(10000),
+        flush_interval_ms(500),
+        expiration_ms(1000),
+        num_shards(1),
+        max_coalesced_checks(0),
+        stale_response_ms(0),
+        max_aggregated_tokens(0) {}
 
   // Constructor.
   // cache_entries is the maximum number of cache entries that can be kept in
@@ -41,12 +47,30 @@ struct CheckAggregationOptions {
   // response_expiration_ms is the maximum milliseconds before a cached check
   // response is invalidated. We make sure that it is at least
   // flush_cache_entry_interval_ms + 1.
+  // cache_shards is the number of independently locked partitions the cache
+  // entries are spread across. It is at least 1.
+  // coalesced_checks is the maximum number of cache missed check requests
+  // that wait for an identical in-flight check request instead of sending
+  // their own. Coalescing is disabled when coalesced_checks <= 0.
+  // stale_cached_response_ms is the maximum age of a cached check response
+  // that is still returned while it is being refreshed in the background.
+  // Refreshes block when it is not larger than flush_cache_entry_interval_ms.
+  // aggregated_tokens_limit is the number of tokens a cache entry can
+  // aggregate before they are flushed. No limit when it is <= 0.
   CheckAggregationOptions(int cache_entries, int flush_cache_entry_interval_ms,
-                          int response_expiration_ms)
+                          int response_expiration_ms, int cache_shards = 1,
+                          int coalesced_checks = 0,
+                          int stale_cached_response_ms = 0,
+                          int64_t aggregated_tokens_limit = 0)
       : num_entries(cache_entries),
         flush_interval_ms(flush_cache_entry_interval_ms),
         expiration_ms(std::max(flush_cache_entry_interval_ms + 1,
-                               response_expiration_ms)) {}
+                               response_expiration_ms)),
+        num_shards(std::max(1, cache_shards)),
+        max_coalesced_checks(std::max(0, coalesced_checks)),
+        stale_response_ms(std::max(0, stale_cached_response_ms)),
+        max_aggregated_tokens(
+            std::max(static_cast<int64_t>(0), aggregated_tokens_limit)) {}
 
   // Maximum number of cache entries kept in the aggregation cache.
   // Set to 0 will disable caching and aggregation.
@@ -60,12 +84,60 @@ struct CheckAggregationOptions {
   // deletion is triggered by a timer. This value must be larger than
   // flush_interval_ms.
   const int expiration_ms;
+
+  // Number of shards the cache is split into. Each shard has its own lock and
+  // an equal part of num_entries, so checks for different signatures running
+  // on different threads rarely contend. Set to 1 to use a single cache.
+  const int num_shards;
+
+  // Maximum number of check requests parked on one in-flight check request
+  // with the same signature. When a burst of identical requests misses the
+  // cache, only the first one is sent to the server; the others wait for its
+  // response and are then answered from the cache. Requests beyond this limit
+  // are sent to the server as usual. Set to 0 to disable coalescing. It has
+  // no effect when caching is disabled.
+  const int max_coalesced_checks;
+
+  // Maximum milliseconds since a cached check response was received during
+  // which it is still returned to the check request that triggers its
+  // refresh. That request is then sent to the server in the background and
+  // its response replaces the cached one. Past this age, the triggering
+  // request waits for the server as when it is 0, the default.
+  const int stale_response_ms;
+
+  // Maximum number of tokens, the sum of the int64 values of DELTA metrics,
+  // aggregated in a cache entry. Once it is reached, the next check of the
+  // entry flushes the aggregated check request to the server without waiting
+  // for the entry to be removed, and gets the cached response as usual. It
+  // bounds the usage of a hot consumer that is not reported yet, so
+  // flush_interval_ms can be raised for the others. Set to 0 for no limit.
+  const int64_t max_aggregated_tokens;
+};
+
+// What Report() does with a report request when the queue of requests to
+// aggregate is full.
+enum class ReportQueueFullPolicy {
+  // Waits until there is room in the queue.
+  BLOCK,
+  // Drops the request if all its operations are of low importance, otherwise
+  // aggregates it in the calling thread.
+  DROP_LOW_IMPORTANCE,
+  // Aggregates the request in the calling thread.
+  SYNCHRONOUS,
 };
 
 // Options controlling report aggregation behavior.
 struct ReportAggregationOptions {
   // Default constructor.
-  ReportAggregationOptions() : num_entries(10000), flush_interval_ms(1000) {}
+  ReportAggregationOptions()
+      : num_entries(10000),
+        flush_interval_ms(1000),
+        max_request_bytes(512 * 1024),
+        high_importance_batch_ms(0),
+        max_high_importance_batch_operations(0),
+        thread_buffer_entries(0),
+        queue_size(0),
+        queue_full_policy(ReportQueueFullPolicy::SYNCHRONOUS) {}
 
   // Constructor.
   // cache_entries is the maximum number of cache entries that can be kept in
@@ -73,9 +145,38 @@ struct ReportAggregationOptions {
   // flush_cache_entry_interval_ms is the maximum milliseconds before aggregated
   // report requests are flushed to the server. The cache entry is deleted after
   // the flush.
-  ReportAggregationOptions(int cache_entries, int flush_cache_entry_interval_ms)
+  // max_report_request_bytes is the serialized size that report requests
+  // batching flushed operations are filled up to.
+  // high_importance_batch_window_ms is the maximum milliseconds report
+  // requests of high importance operations wait to be batched. They are sent
+  // right away when it is <= 0.
+  // high_importance_batch_operations is the number of operations that sends
+  // such a batch before the end of the window. No limit when it is <= 0.
+  // thread_buffered_operations is the number of operations each thread
+  // aggregates on its own before merging them into the cache. Disabled when
+  // it is <= 0.
+  // report_queue_size is the number of report requests queued for a
+  // background thread to aggregate. Requests are aggregated in the calling
+  // thread when it is <= 0.
+  // report_queue_full_policy is what happens to a report request when that
+  // queue is full.
+  ReportAggregationOptions(
+      int cache_entries, int flush_cache_entry_interval_ms,
+      int max_report_request_bytes = 512 * 1024,
+      int high_importance_batch_window_ms = 0,
+      int high_importance_batch_operations = 0,
+      int thread_buffered_operations = 0, int report_queue_size = 0,
+      ReportQueueFullPolicy report_queue_full_policy =
+          ReportQueueFullPolicy::SYNCHRONOUS)
       : num_entries(cache_entries),
-        flush_interval_ms(flush_cache_entry_interval_ms) {}
+        flush_interval_ms(flush_cache_entry_interval_ms),
+        max_request_bytes(max_report_request_bytes),
+        high_importance_batch_ms(std::max(0, high_importance_batch_window_ms)),
+        max_high_importance_batch_operations(
+            std::max(0, high_importance_batch_operations)),
+        thread_buffer_entries(std::max(0, thread_buffered_operations)),
+        queue_size(std::max(0, report_queue_size)),
+        queue_full_policy(report_queue_full_policy) {}
 
   // Maximum number of cache entries kept in the aggregation cache.
   // Set to 0 will disable caching and aggregation.
@@ -84,6 +185,48 @@ struct ReportAggregationOptions {
   // Maximum milliseconds before aggregated report requests are flushed to the
   // server. The flush is triggered by a timer.
   const int flush_interval_ms;
+
+  // Maximum serialized size of a report request sent with the operations
+  // flushed together. As many operations as fit are batched in a request, an
+  // operation larger than that is sent alone. The server limits a report
+  // request to 1MB, the default leaves room for operations growing in the
+  // cache.
+  const int max_request_bytes;
+
+  // Maximum milliseconds a report request with only high importance
+  // operations, which is not aggregated, waits to be sent in a batch with
+  // others. Each call still completes with the status of its batch. A few
+  // milliseconds cut the number of requests sent under a steady stream of
+  // such calls. Set to 0, the default, to send each of them right away. It
+  // has no effect when caching is disabled. Each batch is allocated on a
+  // protobuf arena, freed once it is sent. Aggregated operations are not
+  // flushed on arenas.
+  const int high_importance_batch_ms;
+
+  // Maximum number of operations in a batch of high importance report
+  // requests. A full batch is sent without waiting for the end of
+  // high_importance_batch_ms. Set to 0 for no limit other than
+  // max_request_bytes.
+  const int max_high_importance_batch_operations;
+
+  // Maximum number of distinct operations each thread calling Report()
+  // aggregates in a buffer of its own, before merging them into the shared
+  // cache. Buffers are also merged by each flush, so operations may wait up
+  // to twice flush_interval_ms. Reports then rarely contend on the cache
+  // lock, and repeated operations are merged before reaching it. Set to 0,
+  // the default, to aggregate into the cache directly.
+  const int thread_buffer_entries;
+
+  // Maximum number of report requests queued for aggregation. When it is not
+  // 0, Report() only copies the request into a lock-free queue, and a
+  // background thread hashes, merges and flushes its operations. High
+  // importance operations are not queued since they are sent right away, by
+  // the Report() call. It is rounded up to a power of 2, at least 2.
+  // Set to 0, the default, to aggregate in the thread calling Report().
+  const int queue_size;
+
+  // What happens to a report request when the queue is full.
+  const ReportQueueFullPolicy queue_full_policy;
 };
 
 }  // namespace service_control_client
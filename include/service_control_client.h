@@ -125,6 +125,12 @@ struct Statistics {
   // send_report_operations / total_called_reports  will reflect report
   // aggregation rate.  send_report_operations may not reflect aggregation rate.
   uint64_t send_report_operations;
+
+  // The number of report requests queued to be aggregated, when the report
+  // queue is enabled.
+  uint64_t report_queue_depth;
+  // Report requests dropped because the report queue was full.
+  uint64_t dropped_reports;
 };
 
 // Service control client interface. It is thread safe.
@@ -285,6 +291,26 @@ class ServiceControlClient {
       ::google::api::servicecontrol::v1::CheckResponse* check_response,
       DoneCallback on_check_done, TransportCheckFunc check_transport) = 0;
 
+  // Same as the async calls above, but the check request may be moved
+  // instead of copied when it has to be kept past the call, e.g. to cache
+  // the response of a cache miss.
+  virtual void Check(
+      ::google::api::servicecontrol::v1::CheckRequest&& check_request,
+      ::google::api::servicecontrol::v1::CheckResponse* check_response,
+      DoneCallback on_check_done) {
+    Check(static_cast<const ::google::api::servicecontrol::v1::CheckRequest&>(
+              check_request),
+          check_response, on_check_done);
+  }
+  virtual void Check(
+      ::google::api::servicecontrol::v1::CheckRequest&& check_request,
+      ::google::api::servicecontrol::v1::CheckResponse* check_response,
+      DoneCallback on_check_done, TransportCheckFunc check_transport) {
+    Check(static_cast<const ::google::api::servicecontrol::v1::CheckRequest&>(
+              check_request),
+          check_response, on_check_done, check_transport);
+  }
+
   // Reports operations to the Controller service for billing, logging,
   // monitoring, etc.
   // High importance operations are sent directly to the server without any
@@ -319,9 +345,37 @@ class ServiceControlClient {
       ::google::api::servicecontrol::v1::ReportResponse* report_response,
       DoneCallback on_report_done, TransportReportFunc report_transport) = 0;
 
+  // Same as the async calls above, but the operations of the report request
+  // may be moved into the cache or a batch instead of copied.
+  virtual void Report(
+      ::google::api::servicecontrol::v1::ReportRequest&& report_request,
+      ::google::api::servicecontrol::v1::ReportResponse* report_response,
+      DoneCallback on_report_done) {
+    Report(
+        static_cast<const ::google::api::servicecontrol::v1::ReportRequest&>(
+            report_request),
+        report_response, on_report_done);
+  }
+  virtual void Report(
+      ::google::api::servicecontrol::v1::ReportRequest&& report_request,
+      ::google::api::servicecontrol::v1::ReportResponse* report_response,
+      DoneCallback on_report_done, TransportReportFunc report_transport) {
+    Report(
+        static_cast<const ::google::api::servicecontrol::v1::ReportRequest&>(
+            report_request),
+        report_response, on_report_done, report_transport);
+  }
+
   // Get statistics.
   virtual ::google::protobuf::util::Status GetStatistics(
       Statistics* stat) const = 0;
+
+  // Replaces the metric kinds given in the options, e.g. when the service
+  // config is reloaded. The kinds are compiled into a new lookup table which
+  // atomically replaces the current one; operations aggregated after the call
+  // use the new kinds. The default implementation does nothing.
+  virtual void SetMetricKinds(
+      std::shared_ptr<MetricKindMap> /* metric_kinds */) {}
 };
 
 // Creates a ServiceControlClient object.
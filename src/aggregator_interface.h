@@ -23,6 +23,7 @@ limitations under the License.
 #include "google/api/servicecontrol/v1/service_controller.pb.h"
 #include "google/protobuf/stubs/status.h"
 #include "include/aggregation_options.h"
+#include "src/signature.h"
 
 namespace google {
 namespace service_control_client {
@@ -51,6 +52,21 @@ class ReportAggregator {
   virtual ::google::protobuf::util::Status Report(
       const ::google::api::servicecontrol::v1::ReportRequest& request) = 0;
 
+  // Adds a report request to cache, moving its operations out of it instead
+  // of copying them. The request is left untouched unless OK is returned.
+  virtual ::google::protobuf::util::Status Report(
+      ::google::api::servicecontrol::v1::ReportRequest&& request) = 0;
+
+  // Same as above, but when high importance operations are mixed with low
+  // importance ones, the latter are aggregated and the former are added to
+  // high_request, for callers to send to the server.
+  virtual ::google::protobuf::util::Status Report(
+      const ::google::api::servicecontrol::v1::ReportRequest& request,
+      ::google::api::servicecontrol::v1::ReportRequest* high_request) = 0;
+  virtual ::google::protobuf::util::Status Report(
+      ::google::api::servicecontrol::v1::ReportRequest&& request,
+      ::google::api::servicecontrol::v1::ReportRequest* high_request) = 0;
+
   // When the next Flush() should be called.
   // Returns in ms from now, or -1 for never
   virtual int GetNextFlushInterval() = 0;
@@ -59,6 +75,15 @@ class ReportAggregator {
   // Called at time specified by GetNextFlushInterval().
   virtual ::google::protobuf::util::Status Flush() = 0;
 
+  // Gets the number of report requests queued to be aggregated, and the
+  // number of them dropped because the queue was full.
+  virtual void GetQueueStatistics(uint64_t* queue_depth,
+                                  uint64_t* dropped_reports) = 0;
+
+  // Replaces the metric kinds, e.g. on a service config reload. Operations
+  // aggregated after the call use the new kinds.
+  virtual void SetMetricKinds(std::shared_ptr<MetricKindMap> metric_kinds) = 0;
+
   // Flushes out aggregated report requests, clears all cache items.
   // Usually called at destructor.
   virtual ::google::protobuf::util::Status FlushAll() = 0;
@@ -89,16 +114,33 @@ class CheckAggregator {
 
   // If the check could not be handled by the cache, returns NOT_FOUND,
   // caller has to send the request to service control.
+  // If the cached response is due for a refresh but may still be served
+  // stale, returns ALREADY_EXISTS and the cached response; caller has to
+  // send the request to service control in the background and pass its
+  // response to CacheResponse().
   // Otherwise, returns OK and cached response.
   virtual ::google::protobuf::util::Status Check(
       const ::google::api::servicecontrol::v1::CheckRequest& request,
       ::google::api::servicecontrol::v1::CheckResponse* response) = 0;
 
+  // Same as above, for callers which have the signature of the request from
+  // GenerateCheckRequestSignature() already.
+  virtual ::google::protobuf::util::Status Check(
+      const ::google::api::servicecontrol::v1::CheckRequest& request,
+      const Signature& signature,
+      ::google::api::servicecontrol::v1::CheckResponse* response) = 0;
+
   // Caches a response from a remote Service Controller Check call.
   virtual ::google::protobuf::util::Status CacheResponse(
       const ::google::api::servicecontrol::v1::CheckRequest& request,
       const ::google::api::servicecontrol::v1::CheckResponse& response) = 0;
 
+  // Same as above, with the signature of the request.
+  virtual ::google::protobuf::util::Status CacheResponse(
+      const ::google::api::servicecontrol::v1::CheckRequest& request,
+      const Signature& signature,
+      const ::google::api::servicecontrol::v1::CheckResponse& response) = 0;
+
   // When the next Flush() should be called.
   // Returns in ms from now, or -1 for never
   virtual int GetNextFlushInterval() = 0;
@@ -107,6 +149,10 @@ class CheckAggregator {
   // Called at time specified by GetNextFlushInterval().
   virtual ::google::protobuf::util::Status Flush() = 0;
 
+  // Replaces the metric kinds, e.g. on a service config reload. Operations
+  // aggregated after the call use the new kinds.
+  virtual void SetMetricKinds(std::shared_ptr<MetricKindMap> metric_kinds) = 0;
+
   // Flushes out all cached check responses; clears all cache items.
   // Usually called at destructor.
   virtual ::google::protobuf::util::Status FlushAll() = 0;
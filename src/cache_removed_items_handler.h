@@ -16,6 +16,9 @@ limitations under the License.
 #ifndef GOOGLE_SERVICE_CONTROL_CLIENT_CACHE_REMOVED_ITEMS_HANDLER_H
 #define GOOGLE_SERVICE_CONTROL_CLIENT_CACHE_REMOVED_ITEMS_HANDLER_H
 
+#include <memory>
+#include <vector>
+
 #include "src/aggregator_interface.h"
 #include "utils/simple_lru_cache.h"
 #include "utils/simple_lru_cache_inl.h"
@@ -63,19 +66,21 @@ class CacheRemovedItemsHandler {
     flush_callback_ = callback;
   }
 
-  void AddRemovedItem(const RequestType& item) {
+  // Takes ownership of a removed item to flush it out.
+  void AddRemovedItem(std::unique_ptr<RequestType> item) {
     if (stack_buffer_) {
-      stack_buffer_->Add(item);
+      stack_buffer_->Add(std::move(item));
     }
   }
 
-  // Checks if an new item can be merged into an old item.
+  // Merges removed items before they are flushed out, to send fewer
+  // requests. Called outside of cache_mutex lock with all the items removed
+  // by one cache operation.
   // Derived class will implement this: CheckRequest will never merge.
-  // A ReportRequest can carry multiple operations, it can merge many
-  // reuqests until number of operations reaches certain size.
-  virtual bool MergeItem(const RequestType& new_item, RequestType* old_item) {
-    return false;
-  }
+  // A ReportRequest can carry multiple operations, many requests can be
+  // packed into requests up to certain size.
+  virtual void MergeItems(
+      std::vector<std::unique_ptr<RequestType>>* /* items */) {}
 
   // Class StackBuffer is designed to maintain the stack allocated vector which
   // can be used to insert cache removed items. This class has to be
@@ -85,16 +90,16 @@ class CacheRemovedItemsHandler {
     StackBuffer(CacheRemovedItemsHandler* handler) : handler_(handler) {}
 
     virtual ~StackBuffer() {
+      if (items_.size() > 1) {
+        handler_->MergeItems(&items_);
+      }
       for (const auto& request : items_) {
-        handler_->FlushOut(request);
+        handler_->FlushOut(*request);
       }
     }
 
-    void Add(const RequestType& item) {
-      if (items_.empty() ||
-          !handler_->MergeItem(item, &items_[items_.size() - 1])) {
-        items_.push_back(item);
-      }
+    void Add(std::unique_ptr<RequestType> item) {
+      items_.push_back(std::move(item));
     }
 
     // Class Swapper is used to swap stack_buffer_ variable in the
@@ -114,8 +119,9 @@ class CacheRemovedItemsHandler {
 
    private:
     CacheRemovedItemsHandler* handler_;
-    // A vector to cache store removed items.
-    std::vector<RequestType> items_;
+    // A vector to cache store removed items. They are owned, so they are
+    // never copied until flushed out.
+    std::vector<std::unique_ptr<RequestType>> items_;
   };
 
  private:
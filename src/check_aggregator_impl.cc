@@ -18,90 +18,379 @@ limitations under the License.
 
 #include "google/protobuf/stubs/logging.h"
 
+#include <algorithm>
+#include <limits>
+
 using std::string;
 using ::google::api::MetricDescriptor;
+using ::google::api::servicecontrol::v1::MetricValue;
 using ::google::api::servicecontrol::v1::Operation;
 using ::google::api::servicecontrol::v1::CheckRequest;
 using ::google::api::servicecontrol::v1::CheckResponse;
+using ::google::protobuf::Timestamp;
 using ::google::protobuf::util::Status;
 using ::google::protobuf::util::error::Code;
 using ::google::service_control_client::SimpleCycleTimer;
 
 namespace google {
 namespace service_control_client {
+namespace {
+
+const int64_t kNanosPerSecond = 1000000000;
+
+// Markers for no start time and no end time in the lock-free accumulators.
+const int64_t kNoStartTime = std::numeric_limits<int64_t>::max();
+const int64_t kNoEndTime = std::numeric_limits<int64_t>::min();
+
+int64_t TimestampToNanos(const Timestamp& timestamp) {
+  return timestamp.seconds() * kNanosPerSecond + timestamp.nanos();
+}
+
+void NanosToTimestamp(int64_t nanos, Timestamp* timestamp) {
+  timestamp->set_seconds(nanos / kNanosPerSecond);
+  timestamp->set_nanos(nanos % kNanosPerSecond);
+}
+
+// Returns whether a metric value can be aggregated by a lock-free
+// accumulator: it must be an int64 value without its own time span.
+bool IsLockFreeMetricValue(const MetricValue& value) {
+  return value.value_case() == MetricValue::kInt64Value &&
+         !value.has_start_time() && !value.has_end_time();
+}
+
+// Returns whether two label maps are equal.
+bool SameLabels(const ::google::protobuf::Map<string, string>& a,
+                const ::google::protobuf::Map<string, string>& b) {
+  if (a.size() != b.size()) {
+    return false;
+  }
+  for (const auto& label : a) {
+    auto it = b.find(label.first);
+    if (it == b.end() || it->second != label.second) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Returns the number of tokens in an operation: the sum of the int64 values
+// of its DELTA metrics.
+int64_t CountTokens(const Operation& operation,
+                    const MetricKindTable* metric_kinds) {
+  int64_t tokens = 0;
+  for (const auto& metric_value_set : operation.metric_value_sets()) {
+    if (metric_kinds && metric_kinds->GetKind(metric_value_set.metric_name()) !=
+                            MetricDescriptor::DELTA) {
+      continue;
+    }
+    for (const auto& metric_value : metric_value_set.metric_values()) {
+      if (metric_value.value_case() == MetricValue::kInt64Value) {
+        tokens += metric_value.int64_value();
+      }
+    }
+  }
+  return tokens;
+}
+
+// Lowers target to value if value is smaller.
+void AtomicMin(std::atomic<int64_t>* target, int64_t value) {
+  int64_t current = target->load(std::memory_order_relaxed);
+  while (value < current &&
+         !target->compare_exchange_weak(current, value,
+                                        std::memory_order_relaxed)) {
+  }
+}
+
+// Raises target to value if value is larger.
+void AtomicMax(std::atomic<int64_t>* target, int64_t value) {
+  int64_t current = target->load(std::memory_order_relaxed);
+  while (value > current &&
+         !target->compare_exchange_weak(current, value,
+                                        std::memory_order_relaxed)) {
+  }
+}
+
+// Returns a small number identifying the calling thread, used to spread
+// lock-free readers over the reader counter stripes.
+int GetThreadIndex() {
+  static std::atomic<int> next_thread_index(0);
+  static thread_local int thread_index = next_thread_index.fetch_add(1);
+  return thread_index;
+}
+
+}  // namespace
+
+CheckAggregatorImpl::CacheElem::CacheElem(
+    const Signature& signature, size_t signature_hash,
+    const Operation& operation, const CheckResponse& response,
+    const int64_t time, const int quota_scale,
+    const std::shared_ptr<const MetricKindTable>& metric_kinds)
+    : signature_(signature),
+      signature_hash_(signature_hash),
+      is_published_(false),
+      check_response_(response),
+      last_check_time_(time),
+      response_time_(time),
+      quota_scale_(quota_scale),
+      is_flushing_(false),
+      template_operation_(operation),
+      num_lock_free_values_(0),
+      lock_free_start_time_(kNoStartTime),
+      lock_free_end_time_(kNoEndTime),
+      has_lock_free_requests_(false),
+      aggregated_tokens_(0) {
+  SetLockFreeMetricKinds(metric_kinds);
+}
+
+void CheckAggregatorImpl::CacheElem::SetLockFreeMetricKinds(
+    const std::shared_ptr<const MetricKindTable>& metric_kinds) {
+  lock_free_metric_kinds_ = metric_kinds;
+  num_lock_free_values_ = 0;
+  if (template_operation_.log_entries_size() > 0) {
+    num_lock_free_values_ = -1;
+    return;
+  }
+  for (const auto& metric_value_set : template_operation_.metric_value_sets()) {
+    MetricDescriptor::MetricKind metric_kind = MetricDescriptor::DELTA;
+    if (metric_kinds) {
+      metric_kind = metric_kinds->GetKind(metric_value_set.metric_name());
+    }
+    for (const auto& metric_value : metric_value_set.metric_values()) {
+      if (metric_kind != MetricDescriptor::DELTA ||
+          !IsLockFreeMetricValue(metric_value)) {
+        num_lock_free_values_ = -1;
+        return;
+      }
+      ++num_lock_free_values_;
+    }
+  }
+  lock_free_values_.reset(new std::atomic<int64_t>[num_lock_free_values_]);
+  for (int i = 0; i < num_lock_free_values_; ++i) {
+    lock_free_values_[i].store(0);
+  }
+}
 
 void CheckAggregatorImpl::CacheElem::Aggregate(
-    const CheckRequest& request, const MetricKindMap* metric_kinds) {
+    const CheckRequest& request,
+    const std::shared_ptr<const MetricKindTable>& metric_kinds) {
   if (operation_aggregator_ == NULL) {
     operation_aggregator_.reset(
         new OperationAggregator(request.operation(), metric_kinds));
   } else {
     operation_aggregator_->MergeOperation(request.operation());
   }
+  aggregated_tokens_.fetch_add(
+      CountTokens(request.operation(), metric_kinds.get()),
+      std::memory_order_relaxed);
 }
 
-CheckRequest CheckAggregatorImpl::CacheElem::ReturnCheckRequestAndClear(
+bool CheckAggregatorImpl::CacheElem::AggregateLockFree(
+    const CheckRequest& request, const AtomicMetricKindTable& metric_kinds) {
+  if (num_lock_free_values_ < 0 ||
+      !metric_kinds.IsCurrent(lock_free_metric_kinds_.get())) {
+    return false;
+  }
+  const Operation& operation = request.operation();
+  if (operation.log_entries_size() > 0) {
+    return false;
+  }
+  // The signature does not delimit the labels of consecutive metric values,
+  // so a request with the same signature may still spread them differently.
+  // The values are summed by position, so they must line up with those of
+  // template_operation_.
+  const auto& template_sets = template_operation_.metric_value_sets();
+  if (operation.metric_value_sets_size() != template_sets.size()) {
+    return false;
+  }
+  for (int i = 0; i < template_sets.size(); ++i) {
+    const auto& metric_value_set = operation.metric_value_sets(i);
+    const auto& template_set = template_sets.Get(i);
+    if (metric_value_set.metric_values_size() !=
+            template_set.metric_values_size() ||
+        metric_value_set.metric_name() != template_set.metric_name()) {
+      return false;
+    }
+    for (int j = 0; j < template_set.metric_values_size(); ++j) {
+      const MetricValue& metric_value = metric_value_set.metric_values(j);
+      if (!IsLockFreeMetricValue(metric_value) ||
+          !SameLabels(metric_value.labels(),
+                      template_set.metric_values(j).labels())) {
+        return false;
+      }
+    }
+  }
+
+  int index = 0;
+  int64_t tokens = 0;
+  for (const auto& metric_value_set : operation.metric_value_sets()) {
+    for (const auto& metric_value : metric_value_set.metric_values()) {
+      if (metric_value.int64_value() != 0) {
+        lock_free_values_[index].fetch_add(metric_value.int64_value(),
+                                           std::memory_order_relaxed);
+        tokens += metric_value.int64_value();
+      }
+      ++index;
+    }
+  }
+  if (tokens != 0) {
+    aggregated_tokens_.fetch_add(tokens, std::memory_order_relaxed);
+  }
+  if (operation.has_start_time()) {
+    AtomicMin(&lock_free_start_time_,
+              TimestampToNanos(operation.start_time()));
+  }
+  if (operation.has_end_time()) {
+    AtomicMax(&lock_free_end_time_, TimestampToNanos(operation.end_time()));
+  }
+  // Only write the flag once to keep the cache line shared between readers.
+  if (!has_lock_free_requests_.load(std::memory_order_relaxed)) {
+    has_lock_free_requests_.store(true, std::memory_order_relaxed);
+  }
+  return true;
+}
+
+void CheckAggregatorImpl::CacheElem::CollectLockFreeAggregation(
+    const std::shared_ptr<const MetricKindTable>& metric_kinds) {
+  if (!has_lock_free_requests_.load()) {
+    return;
+  }
+
+  Operation operation(template_operation_);
+  operation.clear_start_time();
+  operation.clear_end_time();
+  int64_t start_time = lock_free_start_time_.exchange(kNoStartTime);
+  if (start_time != kNoStartTime) {
+    NanosToTimestamp(start_time, operation.mutable_start_time());
+  }
+  int64_t end_time = lock_free_end_time_.exchange(kNoEndTime);
+  if (end_time != kNoEndTime) {
+    NanosToTimestamp(end_time, operation.mutable_end_time());
+  }
+  int index = 0;
+  for (auto& metric_value_set : *operation.mutable_metric_value_sets()) {
+    for (auto& metric_value : *metric_value_set.mutable_metric_values()) {
+      metric_value.set_int64_value(lock_free_values_[index].exchange(0));
+      ++index;
+    }
+  }
+  has_lock_free_requests_.store(false);
+
+  if (operation_aggregator_ == NULL) {
+    operation_aggregator_.reset(
+        new OperationAggregator(operation, metric_kinds));
+  } else {
+    operation_aggregator_->MergeOperation(operation);
+  }
+}
+
+std::unique_ptr<CheckRequest>
+CheckAggregatorImpl::CacheElem::ReturnCheckRequestAndClear(
     const string& service_name, const std::string& service_config_id) {
-  CheckRequest request;
-  request.set_service_name(service_name);
-  request.set_service_config_id(service_config_id);
+  std::unique_ptr<CheckRequest> request(new CheckRequest);
+  request->set_service_name(service_name);
+  request->set_service_config_id(service_config_id);
 
   if (operation_aggregator_ != NULL) {
-    *(request.mutable_operation()) = operation_aggregator_->ToOperationProto();
+    operation_aggregator_->ReleaseOperationProto(request->mutable_operation());
     operation_aggregator_ = NULL;
   }
+  aggregated_tokens_.store(0, std::memory_order_relaxed);
   return request;
 }
 
-CheckAggregatorImpl::CheckAggregatorImpl(
-    const string& service_name, const std::string& service_config_id,
-    const CheckAggregationOptions& options,
-    std::shared_ptr<MetricKindMap> metric_kinds)
-    : service_name_(service_name),
-      service_config_id_(service_config_id),
-      options_(options),
-      metric_kinds_(metric_kinds) {
-  // Converts flush_interval_ms to Cycle used by SimpleCycleTimer.
-  flush_interval_in_cycle_ =
-      options_.flush_interval_ms * SimpleCycleTimer::Frequency() / 1000;
-
-  if (options.num_entries > 0) {
-    cache_.reset(new CheckCache(
-        options.num_entries, std::bind(&CheckAggregatorImpl::OnCacheEntryDelete,
-                                       this, std::placeholders::_1)));
-    cache_->SetMaxIdleSeconds(options.expiration_ms / 1000.0);
+CheckAggregatorImpl::CacheShard::CacheShard(CheckAggregatorImpl* aggregator,
+                                            int num_entries)
+    : aggregator_(aggregator), epoch_(0) {
+  // Keeps the lock-free table at most half full to make slot collisions
+  // between cached entries rare.
+  size_t num_slots = 1;
+  while (num_slots < 2 * static_cast<size_t>(num_entries)) {
+    num_slots <<= 1;
   }
+  slots_.reset(new std::atomic<CacheElem*>[num_slots]);
+  for (size_t i = 0; i < num_slots; ++i) {
+    slots_[i].store(nullptr);
+  }
+  slot_mask_ = num_slots - 1;
+  for (auto& stripe : reader_stripes_) {
+    stripe.readers[0].store(0);
+    stripe.readers[1].store(0);
+  }
+
+  cache_.reset(new CheckCache(
+      num_entries,
+      std::bind(&CacheShard::OnCacheEntryDelete, this, std::placeholders::_1)));
+  cache_->SetMaxIdleSeconds(aggregator_->options_.expiration_ms / 1000.0);
 }
 
-CheckAggregatorImpl::~CheckAggregatorImpl() {
-  // FlushAll() will remove all cache items. For each removed item, it will call
-  // flush_callback.  At destructor, it is better not to call the callback.
-  SetFlushCallback(NULL);
-  FlushAll();
+bool CheckAggregatorImpl::CacheShard::CheckLockFree(
+    const Signature& request_signature, size_t signature_hash,
+    const CheckRequest& request, CheckResponse* response) {
+  // Registers as a reader of the current epoch. If a writer moves to the
+  // next epoch in between, it may not wait for this reader, so retry.
+  ReaderStripe& stripe = reader_stripes_[GetThreadIndex() % kReaderStripes];
+  uint64_t epoch;
+  for (;;) {
+    epoch = epoch_.load();
+    stripe.readers[epoch & 1].fetch_add(1);
+    if (epoch_.load() == epoch) break;
+    stripe.readers[epoch & 1].fetch_sub(1);
+  }
+
+  bool found = false;
+  CacheElem* elem = slots_[signature_hash & slot_mask_].load();
+  if (elem != nullptr && elem->signature() == request_signature &&
+      !aggregator_->ShouldFlush(*elem) &&
+      !aggregator_->ShouldFlushAggregatedRequests(*elem) &&
+      elem->AggregateLockFree(request, aggregator_->metric_kinds_)) {
+    *response = elem->check_response();
+    found = true;
+  }
+
+  stripe.readers[epoch & 1].fetch_sub(1);
+  return found;
 }
 
-// Set the flush callback function.
-void CheckAggregatorImpl::SetFlushCallback(FlushCallback callback) {
-  InternalSetFlushCallback(callback);
+void CheckAggregatorImpl::CacheShard::Publish(CacheElem* elem, bool replace) {
+  std::atomic<CacheElem*>& slot = slots_[elem->signature_hash() & slot_mask_];
+  if (slot.load() == elem) {
+    return;
+  }
+  if (replace || slot.load() == nullptr) {
+    slot.store(elem);
+    elem->set_is_published(true);
+  }
 }
 
-// Add a check request to cache
-Status CheckAggregatorImpl::Check(const CheckRequest& request,
-                                  CheckResponse* response) {
-  if (request.service_name() != service_name_) {
-    return Status(Code::INVALID_ARGUMENT,
-                  (string("Invalid service name: ") + request.service_name() +
-                   string(" Expecting: ") + service_name_));
+void CheckAggregatorImpl::CacheShard::Unpublish(CacheElem* elem) {
+  if (!elem->is_published()) {
+    return;
   }
-  if (!request.has_operation()) {
-    return Status(Code::INVALID_ARGUMENT, "operation field is required.");
+  std::atomic<CacheElem*>& slot = slots_[elem->signature_hash() & slot_mask_];
+  if (slot.load() == elem) {
+    slot.store(nullptr);
   }
-  if (request.operation().importance() != Operation::LOW || !cache_) {
-    // By returning NO_FOUND, caller will send request to server.
-    return Status(Code::NOT_FOUND, "");
+  // Even if elem has been replaced by another entry in its slot, readers
+  // which loaded it before may still be using it.
+  Synchronize();
+  elem->set_is_published(false);
+}
+
+void CheckAggregatorImpl::CacheShard::Synchronize() {
+  uint64_t epoch = epoch_.fetch_add(1);
+  for (auto& stripe : reader_stripes_) {
+    while (stripe.readers[epoch & 1].load() != 0) {
+      std::this_thread::yield();
+    }
   }
+}
 
-  string request_signature = GenerateCheckRequestSignature(request);
+Status CheckAggregatorImpl::CacheShard::Check(
+    const Signature& request_signature, size_t signature_hash,
+    const CheckRequest& request, CheckResponse* response) {
+  if (CheckLockFree(request_signature, signature_hash, request, response)) {
+    return Status::OK;
+  }
 
   CheckCacheRemovedItemsHandler::StackBuffer stack_buffer(this);
   MutexLock lock(cache_mutex_);
@@ -127,12 +416,17 @@ Status CheckAggregatorImpl::Check(const CheckRequest& request,
   // are aggregated until flushed.
   // More details can be found in design doc go/simple-chemist-client.
   if (elem->check_response().check_errors_size() > 0) {
-    if (ShouldFlush(*elem)) {
+    if (aggregator_->ShouldFlush(*elem)) {
       // Pretend that we did not find, so we can force it into a check request
       // to the server.
       //
       // Setting last check to now to block more check requests to Chemist.
       elem->set_last_check_time(SimpleCycleTimer::Now());
+      if (aggregator_->CanServeStale(*elem)) {
+        *response = elem->check_response();
+        // By returning ALREADY_EXISTS, caller will refresh in background.
+        return Status(Code::ALREADY_EXISTS, "");
+      }
       // By returning NO_FOUND, caller will send request to server.
       return Status(Code::NOT_FOUND, "");
     } else {
@@ -141,61 +435,254 @@ Status CheckAggregatorImpl::Check(const CheckRequest& request,
       return Status::OK;
     }
   } else {
-    elem->Aggregate(request, metric_kinds_.get());
+    std::shared_ptr<const MetricKindTable> metric_kinds =
+        aggregator_->metric_kinds_.Get();
+    if (!elem->HasCurrentMetricKinds(aggregator_->metric_kinds_)) {
+      // The metric kinds changed since the entry was cached. The requests
+      // aggregated with the old ones are collected before the lock-free
+      // path is decided again. Publish() below puts the entry back.
+      Unpublish(elem);
+      elem->CollectLockFreeAggregation(metric_kinds);
+      elem->SetLockFreeMetricKinds(metric_kinds);
+    }
+    elem->Aggregate(request, metric_kinds);
+    if (aggregator_->ShouldFlushAggregatedRequests(*elem)) {
+      FlushAggregatedRequests(elem);
+    }
 
-    if (ShouldFlush(*elem)) {
+    if (aggregator_->ShouldFlush(*elem)) {
       if (elem->is_flushing()) {
         GOOGLE_LOG(WARNING) << "Last refresh request was not completed yet.";
       }
       elem->set_is_flushing(true);
       // Setting last check to now to block more check requests to Chemist.
       elem->set_last_check_time(SimpleCycleTimer::Now());
+      if (aggregator_->CanServeStale(*elem)) {
+        *response = elem->check_response();
+        // By returning ALREADY_EXISTS, caller will refresh in background.
+        return Status(Code::ALREADY_EXISTS, "");
+      }
       // By returning NO_FOUND, caller will send request to server.
       return Status(Code::NOT_FOUND, "");
     }
 
     *response = elem->check_response();
+    // The entry may have lost its slot to another one; take it back if the
+    // slot is free again.
+    Publish(elem, false);
   }
   // TODO(qiwzhang): supports quota
   // ScaleQuotaTokens(request, elem->quota_scale(), response);
+  // The CheckResponse of the pinned googleapis protos (common-protos-1_3_1)
+  // has no quota fields, so there is nothing to predict into yet. The
+  // requested tokens are still aggregated above and sent on refresh or flush.
 
   return Status::OK;
 }
 
+void CheckAggregatorImpl::CacheShard::CacheResponse(
+    const Signature& request_signature, size_t signature_hash,
+    const CheckRequest& request, const CheckResponse& response) {
+  CheckCacheRemovedItemsHandler::StackBuffer stack_buffer(this);
+  MutexLock lock(cache_mutex_);
+  CheckCacheRemovedItemsHandler::StackBuffer::Swapper swapper(this,
+                                                              &stack_buffer);
+  CheckCache::ScopedLookup lookup(cache_.get(), request_signature);
+
+  int64_t now = SimpleCycleTimer::Now();
+  // TODO(qiwzhang): supports quota
+  // int scale = GetQuotaScale(request, response);
+  // Stays 0 until CheckResponse reports the charged tokens, see Check().
+  int quota_scale = 0;
+  if (lookup.Found()) {
+    CacheElem* elem = lookup.value();
+    // The cached response is about to change, wait for the readers to go.
+    Unpublish(elem);
+    elem->set_last_check_time(now);
+    elem->set_response_time(now);
+    elem->set_check_response(response);
+    elem->set_quota_scale(quota_scale);
+    elem->set_is_flushing(false);
+    if (response.check_errors_size() == 0) {
+      Publish(elem, true);
+    }
+  } else {
+    CacheElem* cache_elem =
+        new CacheElem(request_signature, signature_hash, request.operation(),
+                      response, now, quota_scale,
+                      aggregator_->metric_kinds_.Get());
+    // Publishes before inserting: if the insertion evicts the new entry
+    // right away, OnCacheEntryDelete() unpublishes it.
+    if (response.check_errors_size() == 0) {
+      Publish(cache_elem, true);
+    }
+    cache_->Insert(request_signature, cache_elem, 1);
+  }
+}
+
+void CheckAggregatorImpl::CacheShard::Flush() {
+  CheckCacheRemovedItemsHandler::StackBuffer stack_buffer(this);
+  MutexLock lock(cache_mutex_);
+  CheckCacheRemovedItemsHandler::StackBuffer::Swapper swapper(this,
+                                                              &stack_buffer);
+  cache_->RemoveExpiredEntries();
+}
+
+void CheckAggregatorImpl::CacheShard::FlushAll() {
+  CheckCacheRemovedItemsHandler::StackBuffer stack_buffer(this);
+  MutexLock lock(cache_mutex_);
+  CheckCacheRemovedItemsHandler::StackBuffer::Swapper swapper(this,
+                                                              &stack_buffer);
+  cache_->RemoveAll();
+}
+
+void CheckAggregatorImpl::CacheShard::FlushAggregatedRequests(
+    CacheElem* elem) {
+  // Lock-free aggregation can only be collected with no reader around.
+  Unpublish(elem);
+  elem->CollectLockFreeAggregation(aggregator_->metric_kinds_.Get());
+  if (elem->HasPendingCheckRequest()) {
+    AddRemovedItem(elem->ReturnCheckRequestAndClear(
+        aggregator_->service_name_, aggregator_->service_config_id_));
+  }
+  Publish(elem, false);
+}
+
+void CheckAggregatorImpl::CacheShard::OnCacheEntryDelete(CacheElem* elem) {
+  Unpublish(elem);
+  elem->CollectLockFreeAggregation(aggregator_->metric_kinds_.Get());
+  if (!elem->HasPendingCheckRequest()) {
+    delete elem;
+    return;
+  }
+
+  AddRemovedItem(elem->ReturnCheckRequestAndClear(
+      aggregator_->service_name_, aggregator_->service_config_id_));
+  delete elem;
+}
+
+CheckAggregatorImpl::CheckAggregatorImpl(
+    const string& service_name, const std::string& service_config_id,
+    const CheckAggregationOptions& options,
+    std::shared_ptr<MetricKindMap> metric_kinds)
+    : service_name_(service_name),
+      service_config_id_(service_config_id),
+      options_(options),
+      metric_kinds_(metric_kinds.get()) {
+  // Converts flush_interval_ms to Cycle used by SimpleCycleTimer.
+  flush_interval_in_cycle_ =
+      options_.flush_interval_ms * SimpleCycleTimer::Frequency() / 1000;
+  stale_response_in_cycle_ =
+      options_.stale_response_ms * SimpleCycleTimer::Frequency() / 1000;
+
+  if (options.num_entries > 0) {
+    // Every shard holds at least one entry, and the shards together hold
+    // at least num_entries.
+    int num_shards = std::min(options.num_shards, options.num_entries);
+    int shard_entries = (options.num_entries + num_shards - 1) / num_shards;
+    for (int i = 0; i < num_shards; ++i) {
+      shards_.emplace_back(new CacheShard(this, shard_entries));
+    }
+  }
+}
+
+CheckAggregatorImpl::~CheckAggregatorImpl() {
+  // FlushAll() will remove all cache items. For each removed item, it will call
+  // flush_callback.  At destructor, it is better not to call the callback.
+  SetFlushCallback(NULL);
+  FlushAll();
+}
+
+// Set the flush callback function.
+void CheckAggregatorImpl::SetFlushCallback(FlushCallback callback) {
+  for (const auto& shard : shards_) {
+    shard->SetFlushCallback(callback);
+  }
+}
+
+// Add a check request to cache
+Status CheckAggregatorImpl::Check(const CheckRequest& request,
+                                  CheckResponse* response) {
+  return Check(request, nullptr, response);
+}
+
+// Add a check request to cache, with its signature.
+Status CheckAggregatorImpl::Check(const CheckRequest& request,
+                                  const Signature& request_signature,
+                                  CheckResponse* response) {
+  return Check(request, &request_signature, response);
+}
+
+Status CheckAggregatorImpl::Check(const CheckRequest& request,
+                                  const Signature* request_signature,
+                                  CheckResponse* response) {
+  if (request.service_name() != service_name_) {
+    return Status(Code::INVALID_ARGUMENT,
+                  (string("Invalid service name: ") + request.service_name() +
+                   string(" Expecting: ") + service_name_));
+  }
+  if (!request.has_operation()) {
+    return Status(Code::INVALID_ARGUMENT, "operation field is required.");
+  }
+  if (request.operation().importance() != Operation::LOW || shards_.empty()) {
+    // By returning NO_FOUND, caller will send request to server.
+    return Status(Code::NOT_FOUND, "");
+  }
+
+  Signature signature = request_signature
+                            ? *request_signature
+                            : GenerateCheckRequestSignature(request);
+  size_t signature_hash;
+  CacheShard* shard = GetShard(signature, &signature_hash);
+  return shard->Check(signature, signature_hash, request, response);
+}
+
 bool CheckAggregatorImpl::ShouldFlush(const CacheElem& elem) {
   int64_t age = SimpleCycleTimer::Now() - elem.last_check_time();
-  // TODO(chengliang): consider accumulated tokens as well. If the
-  // accumulated number of tokens is larger than a threshold, we may also
-  // decide to send the request.
+  // Accumulated tokens are bounded separately, see
+  // ShouldFlushAggregatedRequests(). Flushing them does not need a new
+  // response, so the check request is not held up.
   //
   // This will prevent sending more RPCs while there is an ongoing one most of
   // the time, except when there is a long RPC that exceeds the flush interval.
   return age >= flush_interval_in_cycle_;
 }
 
+bool CheckAggregatorImpl::ShouldFlushAggregatedRequests(
+    const CacheElem& elem) {
+  return options_.max_aggregated_tokens > 0 &&
+         elem.aggregated_tokens() >= options_.max_aggregated_tokens;
+}
+
+bool CheckAggregatorImpl::CanServeStale(const CacheElem& elem) {
+  int64_t age = SimpleCycleTimer::Now() - elem.response_time();
+  return age < stale_response_in_cycle_;
+}
+
+CheckAggregatorImpl::CacheShard* CheckAggregatorImpl::GetShard(
+    const Signature& request_signature, size_t* shard_signature_hash) {
+  size_t signature_hash = request_signature.hash();
+  // The remainder picks the shard, the quotient is left for the shard.
+  *shard_signature_hash = signature_hash / shards_.size();
+  return shards_[signature_hash % shards_.size()].get();
+}
+
 Status CheckAggregatorImpl::CacheResponse(const CheckRequest& request,
                                           const CheckResponse& response) {
-  CheckCacheRemovedItemsHandler::StackBuffer stack_buffer(this);
-  MutexLock lock(cache_mutex_);
-  CheckCacheRemovedItemsHandler::StackBuffer::Swapper swapper(this,
-                                                              &stack_buffer);
-  if (cache_) {
-    string request_signature = GenerateCheckRequestSignature(request);
-    CheckCache::ScopedLookup lookup(cache_.get(), request_signature);
-
-    int64_t now = SimpleCycleTimer::Now();
-    // TODO(qiwzhang): supports quota
-    // int scale = GetQuotaScale(request, response);
-    int quota_scale = 0;
-    if (lookup.Found()) {
-      lookup.value()->set_last_check_time(now);
-      lookup.value()->set_check_response(response);
-      lookup.value()->set_quota_scale(quota_scale);
-      lookup.value()->set_is_flushing(false);
-    } else {
-      CacheElem* cache_elem = new CacheElem(response, now, quota_scale);
-      cache_->Insert(request_signature, cache_elem, 1);
-    }
+  if (shards_.empty()) {
+    return Status::OK;
+  }
+  return CacheResponse(request, GenerateCheckRequestSignature(request),
+                       response);
+}
+
+Status CheckAggregatorImpl::CacheResponse(const CheckRequest& request,
+                                          const Signature& request_signature,
+                                          const CheckResponse& response) {
+  if (!shards_.empty()) {
+    size_t signature_hash;
+    CacheShard* shard = GetShard(request_signature, &signature_hash);
+    shard->CacheResponse(request_signature, signature_hash, request, response);
   }
 
   return Status::OK;
@@ -204,51 +691,36 @@ Status CheckAggregatorImpl::CacheResponse(const CheckRequest& request,
 // When the next Flush() should be called.
 // Flush() call remove expired response.
 int CheckAggregatorImpl::GetNextFlushInterval() {
-  if (!cache_) return -1;
+  if (shards_.empty()) return -1;
   return options_.expiration_ms;
 }
 
 // Flush aggregated requests whom are longer than flush_interval.
 // Called at time specified by GetNextFlushInterval().
 Status CheckAggregatorImpl::Flush() {
-  CheckCacheRemovedItemsHandler::StackBuffer stack_buffer(this);
-  MutexLock lock(cache_mutex_);
-  CheckCacheRemovedItemsHandler::StackBuffer::Swapper swapper(this,
-                                                              &stack_buffer);
-  if (cache_) {
-    cache_->RemoveExpiredEntries();
+  for (const auto& shard : shards_) {
+    shard->Flush();
   }
 
   return Status::OK;
 }
 
-void CheckAggregatorImpl::OnCacheEntryDelete(CacheElem* elem) {
-  if (!elem->HasPendingCheckRequest()) {
-    delete elem;
-    return;
-  }
-
-  CheckRequest request;
-  request = elem->ReturnCheckRequestAndClear(service_name_, service_config_id_);
-  AddRemovedItem(request);
-  delete elem;
-}
-
 // Flush out aggregated check requests, clear all cache items.
 // Usually called at destructor.
 Status CheckAggregatorImpl::FlushAll() {
-  CheckCacheRemovedItemsHandler::StackBuffer stack_buffer(this);
-  MutexLock lock(cache_mutex_);
-  CheckCacheRemovedItemsHandler::StackBuffer::Swapper swapper(this,
-                                                              &stack_buffer);
   GOOGLE_LOG(INFO) << "Remove all entries of check aggregator.";
-  if (cache_) {
-    cache_->RemoveAll();
+  for (const auto& shard : shards_) {
+    shard->FlushAll();
   }
 
   return Status::OK;
 }
 
+void CheckAggregatorImpl::SetMetricKinds(
+    std::shared_ptr<MetricKindMap> metric_kinds) {
+  metric_kinds_.Rebuild(metric_kinds.get());
+}
+
 std::unique_ptr<CheckAggregator> CreateCheckAggregator(
     const std::string& service_name, const std::string& service_config_id,
     const CheckAggregationOptions& options,
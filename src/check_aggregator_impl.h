@@ -18,16 +18,20 @@ limitations under the License.
 #ifndef GOOGLE_SERVICE_CONTROL_CLIENT_CHECK_AGGREGATOR_IMPL_H_
 #define GOOGLE_SERVICE_CONTROL_CLIENT_CHECK_AGGREGATOR_IMPL_H_
 
+#include <atomic>
 #include <string>
 #include <unordered_map>
 #include <utility>
+#include <vector>
 
 #include "google/api/metric.pb.h"
 #include "google/api/servicecontrol/v1/operation.pb.h"
 #include "google/api/servicecontrol/v1/service_controller.pb.h"
 #include "src/aggregator_interface.h"
 #include "src/cache_removed_items_handler.h"
+#include "src/metric_kind_table.h"
 #include "src/operation_aggregator.h"
+#include "src/signature.h"
 #include "utils/simple_lru_cache.h"
 #include "utils/simple_lru_cache_inl.h"
 #include "utils/thread.h"
@@ -78,8 +82,7 @@ typedef CacheRemovedItemsHandler<
     ::google::api::servicecontrol::v1::CheckRequest>
     CheckCacheRemovedItemsHandler;
 
-class CheckAggregatorImpl : public CheckAggregator,
-                            public CheckCacheRemovedItemsHandler {
+class CheckAggregatorImpl : public CheckAggregator {
  public:
   // Constructor.
   // Does not take ownership of metric_kinds and controller, which must outlive
@@ -105,11 +108,23 @@ class CheckAggregatorImpl : public CheckAggregator,
       const ::google::api::servicecontrol::v1::CheckRequest& request,
       ::google::api::servicecontrol::v1::CheckResponse* response);
 
+  // Same as above, with the signature of the request.
+  virtual ::google::protobuf::util::Status Check(
+      const ::google::api::servicecontrol::v1::CheckRequest& request,
+      const Signature& signature,
+      ::google::api::servicecontrol::v1::CheckResponse* response);
+
   // Caches a response from a remote Service Controller Check call.
   virtual ::google::protobuf::util::Status CacheResponse(
       const ::google::api::servicecontrol::v1::CheckRequest& request,
       const ::google::api::servicecontrol::v1::CheckResponse& response);
 
+  // Same as above, with the signature of the request.
+  virtual ::google::protobuf::util::Status CacheResponse(
+      const ::google::api::servicecontrol::v1::CheckRequest& request,
+      const Signature& signature,
+      const ::google::api::servicecontrol::v1::CheckResponse& response);
+
   // When the next Flush() should be called.
   // Returns in ms from now, or -1 for never
   virtual int GetNextFlushInterval();
@@ -121,30 +136,90 @@ class CheckAggregatorImpl : public CheckAggregator,
   // Flushes out all cache items. Usually called at destructor.
   virtual ::google::protobuf::util::Status FlushAll();
 
+  // Replaces the metric kinds.
+  virtual void SetMetricKinds(std::shared_ptr<MetricKindMap> metric_kinds);
+
  private:
+  // Checks a request. request_signature is its signature if not NULL,
+  // otherwise it is computed if needed.
+  ::google::protobuf::util::Status Check(
+      const ::google::api::servicecontrol::v1::CheckRequest& request,
+      const Signature* request_signature,
+      ::google::api::servicecontrol::v1::CheckResponse* response);
+
   // Cache entry for aggregated check requests and previous check response.
+  //
+  // A cache entry with a pass response is published to the lock-free read
+  // path of its shard. While published, readers may call
+  // AggregateLockFree(), check_response() and last_check_time() without
+  // holding the shard lock; everything else requires the lock. The check
+  // response must not be changed while any reader can still see the entry,
+  // see CacheShard::Synchronize().
   class CacheElem {
    public:
-    CacheElem(const ::google::api::servicecontrol::v1::CheckResponse& response,
-              const int64_t time, const int quota_scale)
-        : check_response_(response),
-          last_check_time_(time),
-          quota_scale_(quota_scale),
-          is_flushing_(false) {}
+    // signature is the signature of the cached request and signature_hash
+    // its hash within the shard. operation is the operation of the cached
+    // request, used as the template to rebuild lock-free aggregated requests.
+    CacheElem(const Signature& signature, size_t signature_hash,
+              const ::google::api::servicecontrol::v1::Operation& operation,
+              const ::google::api::servicecontrol::v1::CheckResponse& response,
+              const int64_t time, const int quota_scale,
+              const std::shared_ptr<const MetricKindTable>& metric_kinds);
 
     // Aggregates the given request to this cache entry.
     void Aggregate(
         const ::google::api::servicecontrol::v1::CheckRequest& request,
-        const MetricKindMap* metric_kinds);
+        const std::shared_ptr<const MetricKindTable>& metric_kinds);
+
+    // Aggregates the given request to this cache entry with atomic
+    // accumulators only. Returns false if the request could not be
+    // aggregated this way, e.g. because the metric kinds changed since
+    // SetLockFreeMetricKinds(); it has to be aggregated by Aggregate() then.
+    bool AggregateLockFree(
+        const ::google::api::servicecontrol::v1::CheckRequest& request,
+        const AtomicMetricKindTable& metric_kinds);
+
+    // Returns whether AggregateLockFree() uses the current metric kinds.
+    bool HasCurrentMetricKinds(
+        const AtomicMetricKindTable& metric_kinds) const {
+      return metric_kinds.IsCurrent(lock_free_metric_kinds_.get());
+    }
+
+    // Decides from metric_kinds whether requests can be aggregated by
+    // AggregateLockFree(). No reader may access this entry concurrently, and
+    // its lock-free aggregation must have been collected.
+    void SetLockFreeMetricKinds(
+        const std::shared_ptr<const MetricKindTable>& metric_kinds);
+
+    // Moves the requests aggregated by AggregateLockFree() into the
+    // aggregated operation. No reader may access this entry concurrently.
+    void CollectLockFreeAggregation(
+        const std::shared_ptr<const MetricKindTable>& metric_kinds);
 
     // Returns the aggregated CheckRequest and reset the cache entry.
-    ::google::api::servicecontrol::v1::CheckRequest ReturnCheckRequestAndClear(
-        const std::string& service_name, const std::string& service_config_id);
+    std::unique_ptr<::google::api::servicecontrol::v1::CheckRequest>
+    ReturnCheckRequestAndClear(const std::string& service_name,
+                               const std::string& service_config_id);
 
     bool HasPendingCheckRequest() const {
       return operation_aggregator_ != NULL;
     }
 
+    // Getter for the number of tokens aggregated since the last
+    // ReturnCheckRequestAndClear().
+    inline int64_t aggregated_tokens() const {
+      return aggregated_tokens_.load(std::memory_order_relaxed);
+    }
+
+    // Getter for the request signature.
+    inline const Signature& signature() const { return signature_; }
+    // Getter for the request signature hash within the shard.
+    inline size_t signature_hash() const { return signature_hash_; }
+
+    // Getter and Setter of is_published_;
+    inline bool is_published() const { return is_published_; }
+    inline void set_is_published(bool v) { is_published_ = v; }
+
     // Setter for check response.
     inline void set_check_response(
         const ::google::api::servicecontrol::v1::CheckResponse&
@@ -159,10 +234,17 @@ class CheckAggregatorImpl : public CheckAggregator,
 
     // Setter for last check time.
     inline void set_last_check_time(const int64_t last_check_time) {
-      last_check_time_ = last_check_time;
+      last_check_time_.store(last_check_time);
     }
     // Getter for last check time.
-    inline const int64_t last_check_time() const { return last_check_time_; }
+    inline int64_t last_check_time() const { return last_check_time_.load(); }
+
+    // Setter for the time check_response was received.
+    inline void set_response_time(const int64_t response_time) {
+      response_time_ = response_time;
+    }
+    // Getter for the time check_response was received.
+    inline int64_t response_time() const { return response_time_; }
 
     // Setter for check response.
     inline void set_quota_scale(const int quota_scale) {
@@ -176,6 +258,14 @@ class CheckAggregatorImpl : public CheckAggregator,
     inline void set_is_flushing(bool v) { is_flushing_ = v; }
 
    private:
+    // The signature of the cached request and its hash within the shard.
+    const Signature signature_;
+    const size_t signature_hash_;
+
+    // If true, this entry has been published to the lock-free table since it
+    // was last unpublished, so readers may hold it.
+    bool is_published_;
+
     // Internal operation.
     std::unique_ptr<OperationAggregator> operation_aggregator_;
 
@@ -187,7 +277,10 @@ class CheckAggregatorImpl : public CheckAggregator,
     // check request from triggering another flush. Note that this prevention
     // works only during the flush interval, which means for long RPC, there
     // could be up to RPC_time/flush_interval ongoing check requests.
-    int64_t last_check_time_;
+    std::atomic<int64_t> last_check_time_;
+    // The time check_response was received. Unlike last_check_time, it is
+    // not moved by a refresh, so it tells how stale check_response is.
+    int64_t response_time_;
     // Scale used to predict how much quota are charged. It is calculated
     // as the tokens charged in the last check response / requested tokens.
     // The predicated amount tokens consumed is then request tokens * scale.
@@ -196,23 +289,166 @@ class CheckAggregatorImpl : public CheckAggregator,
 
     // If true, is sending the request to server to get new response.
     bool is_flushing_;
+
+    // The operation used to rebuild the lock-free aggregated requests. Only
+    // its metric values, start time and end time are replaced.
+    const ::google::api::servicecontrol::v1::Operation template_operation_;
+    // The metric kinds num_lock_free_values_ was decided with.
+    std::shared_ptr<const MetricKindTable> lock_free_metric_kinds_;
+    // Number of metric values in template_operation_. Lock-free aggregation
+    // is only supported if all of them are DELTA int64 values, otherwise
+    // it is -1.
+    int num_lock_free_values_;
+    // Sums of the lock-free aggregated metric values, in the order they
+    // appear in template_operation_.
+    std::unique_ptr<std::atomic<int64_t>[]> lock_free_values_;
+    // Earliest start time and latest end time of the lock-free aggregated
+    // requests, in nanoseconds since epoch.
+    std::atomic<int64_t> lock_free_start_time_;
+    std::atomic<int64_t> lock_free_end_time_;
+    // If true, some requests are aggregated by AggregateLockFree().
+    std::atomic<bool> has_lock_free_requests_;
+    // Sum of the int64 values of DELTA metrics aggregated by Aggregate() and
+    // AggregateLockFree().
+    std::atomic<int64_t> aggregated_tokens_;
+
+    GOOGLE_DISALLOW_EVIL_CONSTRUCTORS(CacheElem);
   };
 
   using CacheDeleter = std::function<void(CacheElem*)>;
   // Key is the signature of the check request. Value is the CacheElem.
   // It is a LRU cache with MaxIdelTime as response_expiration_time.
   using CheckCache =
-      SimpleLRUCacheWithDeleter<std::string, CacheElem, CacheDeleter>;
+      SimpleLRUCacheWithDeleter<Signature, CacheElem, CacheDeleter>;
+
+  // One partition of the check cache. Each shard has its own lock, its own
+  // LRU cache and its own buffer of removed items, so cache operations on
+  // different shards never contend with each other.
+  //
+  // Cache hits on pass responses are served without the lock: every cache
+  // entry with a pass response is published into a direct-mapped table of
+  // atomic pointers, keyed by the request signature hash. Readers register
+  // in the current epoch of a striped counter before looking at the table,
+  // and writers wait for all readers of the previous epoch to leave before
+  // changing or deleting an entry they have unpublished. Misses, refreshes,
+  // error responses and inserts take the lock.
+  //
+  // Lock-free hits do not update the LRU order. Since every pass entry goes
+  // through the locked path at least once per flush interval to be refreshed,
+  // and expiration_ms is larger than flush_interval_ms, a hot entry is never
+  // expired.
+  class CacheShard : public CheckCacheRemovedItemsHandler {
+   public:
+    // Does not take ownership of aggregator, which must outlive this shard.
+    CacheShard(CheckAggregatorImpl* aggregator, int num_entries);
+
+    // Sets the flush callback function of this shard.
+    void SetFlushCallback(FlushCallback callback) {
+      InternalSetFlushCallback(callback);
+    }
+
+    // Looks up the cached response for the request with the given signature.
+    // signature_hash is used to find the request in the lock-free table.
+    // Returns NOT_FOUND if the request needs to be sent to the server.
+    ::google::protobuf::util::Status Check(
+        const Signature& request_signature, size_t signature_hash,
+        const ::google::api::servicecontrol::v1::CheckRequest& request,
+        ::google::api::servicecontrol::v1::CheckResponse* response);
+
+    // Caches the response for the request with the given signature.
+    void CacheResponse(
+        const Signature& request_signature, size_t signature_hash,
+        const ::google::api::servicecontrol::v1::CheckRequest& request,
+        const ::google::api::servicecontrol::v1::CheckResponse& response);
+
+    // Removes expired cache entries.
+    void Flush();
+
+    // Removes all cache entries.
+    void FlushAll();
+
+   private:
+    // Number of reader counter stripes. Readers on different threads use
+    // different stripes to avoid bouncing one cache line between cores.
+    static const int kReaderStripes = 16;
+
+    // A pair of reader counters, one per epoch parity. Padded so that the
+    // counters of two stripes never share a cache line.
+    struct ReaderStripe {
+      char padding_before[56];
+      std::atomic<int64_t> readers[2];
+      char padding_after[56];
+    };
+
+    // Serves the check from the lock-free table if possible. Returns false
+    // if the request has to go through the locked path.
+    bool CheckLockFree(
+        const Signature& request_signature, size_t signature_hash,
+        const ::google::api::servicecontrol::v1::CheckRequest& request,
+        ::google::api::servicecontrol::v1::CheckResponse* response);
+
+    // Publishes elem to the lock-free table. If replace is false, elem is
+    // only published if its slot is empty. Called with cache_mutex_ held.
+    void Publish(CacheElem* elem, bool replace);
+
+    // Removes elem from the lock-free table and waits until no reader can
+    // see it anymore. Called with cache_mutex_ held.
+    void Unpublish(CacheElem* elem);
+
+    // Waits until all readers which have started before this call have
+    // finished. Called with cache_mutex_ held.
+    void Synchronize();
+
+    // Sends the requests aggregated in elem to the flush callback, keeping
+    // elem in the cache. Called with cache_mutex_ held.
+    void FlushAggregatedRequests(CacheElem* elem);
+
+    // Flushes the internal operation in the elem and delete the elem. The
+    // response from the server is NOT cached.
+    // Takes ownership of the elem.
+    void OnCacheEntryDelete(CacheElem* elem);
+
+    // The aggregator owning this shard. Not owned.
+    CheckAggregatorImpl* aggregator_;
+
+    // The lock-free table. Its size is a power of two. Written with
+    // cache_mutex_ held, read without.
+    std::unique_ptr<std::atomic<CacheElem*>[]> slots_;
+    size_t slot_mask_;
+
+    // The current reader epoch. Only its parity is used to pick the counter.
+    std::atomic<uint64_t> epoch_;
+    ReaderStripe reader_stripes_[kReaderStripes];
+
+    // Mutex guarding the access of cache_;
+    Mutex cache_mutex_;
+
+    // The cache that maps from operation signature to an operation.
+    // We don't calculate fine grained cost for cache entries, assign each
+    // entry 1 cost unit.
+    // Guarded by cache_mutex_.
+    std::unique_ptr<CheckCache> cache_;
+
+    GOOGLE_DISALLOW_EVIL_CONSTRUCTORS(CacheShard);
+  };
 
   // Returns whether we should flush a cache entry.
   //   If the aggregated check request is less than flush interval, no need to
   //   flush.
   bool ShouldFlush(const CacheElem& elem);
 
-  // Flushes the internal operation in the elem and delete the elem. The
-  // response from the server is NOT cached.
-  // Takes ownership of the elem.
-  void OnCacheEntryDelete(CacheElem* elem);
+  // Returns whether a cache entry has aggregated too many tokens and should
+  // flush its aggregated requests.
+  bool ShouldFlushAggregatedRequests(const CacheElem& elem);
+
+  // Returns whether the response of a cache entry to flush may still be
+  // returned while it is refreshed in the background.
+  bool CanServeStale(const CacheElem& elem);
+
+  // Returns the shard owning the given request signature. Sets
+  // shard_signature_hash to the signature hash to use within the shard.
+  CacheShard* GetShard(const Signature& request_signature,
+                       size_t* shard_signature_hash);
 
   // The service name for this cache.
   const std::string service_name_;
@@ -222,21 +458,17 @@ class CheckAggregatorImpl : public CheckAggregator,
   // The check aggregation options.
   CheckAggregationOptions options_;
 
-  // Metric kinds. Key is the metric name and value is the metric kind.
-  // Defaults to DELTA if not specified. Not owned.
-  std::shared_ptr<MetricKindMap> metric_kinds_;
-
-  // Mutex guarding the access of cache_;
-  Mutex cache_mutex_;
+  // Metric kinds, compiled from the metric kind map. Defaults to DELTA if
+  // not specified.
+  AtomicMetricKindTable metric_kinds_;
 
-  // The cache that maps from operation signature to an operation.
-  // We don't calculate fine grained cost for cache entries, assign each
-  // entry 1 cost unit.
-  // Guarded by mutex_, except when compare against NULL.
-  std::unique_ptr<CheckCache> cache_;
+  // The cache shards. Empty if the cache is disabled.
+  std::vector<std::unique_ptr<CacheShard>> shards_;
 
   // flush interval in cycles.
   int64_t flush_interval_in_cycle_;
+  // stale response age in cycles.
+  int64_t stale_response_in_cycle_;
 
   GOOGLE_DISALLOW_EVIL_CONSTRUCTORS(CheckAggregatorImpl);
 };
@@ -14,6 +14,7 @@ limitations under the License.
 ==============================================================================*/
 
 #include "src/check_aggregator_impl.h"
+#include "src/signature.h"
 
 #include "gmock/gmock.h"
 #include "google/protobuf/text_format.h"
@@ -22,8 +23,11 @@ limitations under the License.
 #include "utils/status_test_util.h"
 
 #include <unistd.h>
+#include <thread>
 
 using std::string;
+using ::google::api::MetricDescriptor;
+using ::google::api::servicecontrol::v1::MetricValue;
 using ::google::api::servicecontrol::v1::Operation;
 using ::google::api::servicecontrol::v1::CheckRequest;
 using ::google::api::servicecontrol::v1::CheckResponse;
@@ -273,6 +277,90 @@ TEST_F(CheckAggregatorImplTest, TestRefresh) {
   EXPECT_TRUE(MessageDifferencer::Equals(flushed_[0], request1_));
 }
 
+TEST_F(CheckAggregatorImplTest, TestStaleResponseWhileRefreshing) {
+  CheckAggregationOptions options(1 /*entries*/, 100 /*flush_interval_ms*/,
+                                  1000 /*expiration_ms*/, 1 /*shards*/,
+                                  0 /*coalesced_checks*/,
+                                  200 /*stale_response_ms*/);
+  aggregator_ =
+      CreateCheckAggregator(kServiceName, kServiceConfigId, options,
+                            std::shared_ptr<MetricKindMap>(new MetricKindMap));
+  ASSERT_TRUE((bool)(aggregator_));
+
+  CheckResponse response;
+  EXPECT_ERROR_CODE(Code::NOT_FOUND, aggregator_->Check(request1_, &response));
+  EXPECT_OK(aggregator_->CacheResponse(request1_, pass_response1_));
+
+  // sleep 0.12 second.
+  usleep(120000);
+
+  // First one refreshes in background with the cached response.
+  response.Clear();
+  EXPECT_ERROR_CODE(Code::ALREADY_EXISTS,
+                    aggregator_->Check(request1_, &response));
+  EXPECT_TRUE(MessageDifferencer::Equals(response, pass_response1_));
+  // Second one use cached response.
+  EXPECT_OK(aggregator_->Check(request1_, &response));
+  EXPECT_TRUE(MessageDifferencer::Equals(response, pass_response1_));
+
+  // The refreshed response replaces the cached one.
+  EXPECT_OK(aggregator_->CacheResponse(request1_, error_response1_));
+  EXPECT_OK(aggregator_->Check(request1_, &response));
+  EXPECT_TRUE(MessageDifferencer::Equals(response, error_response1_));
+
+  // sleep 0.22 second, longer than stale_response_ms.
+  usleep(220000);
+
+  // Too stale, the refresh blocks again.
+  EXPECT_ERROR_CODE(Code::NOT_FOUND, aggregator_->Check(request1_, &response));
+}
+
+TEST_F(CheckAggregatorImplTest, TestFlushAggregatedTokens) {
+  CheckAggregationOptions options(10 /*entries*/, 10000 /*flush_interval_ms*/,
+                                  20000 /*expiration_ms*/, 1 /*shards*/,
+                                  0 /*coalesced_checks*/,
+                                  0 /*stale_response_ms*/,
+                                  2500 /*aggregated_tokens_limit*/);
+  aggregator_ =
+      CreateCheckAggregator(kServiceName, kServiceConfigId, options,
+                            std::shared_ptr<MetricKindMap>(new MetricKindMap));
+  ASSERT_TRUE((bool)(aggregator_));
+  aggregator_->SetFlushCallback(std::bind(
+      &CheckAggregatorImplTest::FlushCallback, this, std::placeholders::_1));
+
+  CheckResponse response;
+  EXPECT_ERROR_CODE(Code::NOT_FOUND, aggregator_->Check(request1_, &response));
+  EXPECT_OK(aggregator_->CacheResponse(request1_, pass_response1_));
+
+  // Each check aggregates 1000 tokens.
+  for (int i = 0; i < 3; i++) {
+    EXPECT_OK(aggregator_->Check(request1_, &response));
+  }
+  EXPECT_EQ(flushed_.size(), 0);
+
+  // The limit has been reached, the next check flushes the aggregated tokens
+  // and still uses the cached response.
+  EXPECT_OK(aggregator_->Check(request1_, &response));
+  EXPECT_TRUE(MessageDifferencer::Equals(response, pass_response1_));
+  ASSERT_EQ(flushed_.size(), 1);
+  EXPECT_EQ(flushed_[0]
+                .operation()
+                .metric_value_sets(0)
+                .metric_values(0)
+                .int64_value(),
+            4000);
+
+  EXPECT_OK(aggregator_->Check(request1_, &response));
+  EXPECT_OK(aggregator_->FlushAll());
+  ASSERT_EQ(flushed_.size(), 2);
+  EXPECT_EQ(flushed_[1]
+                .operation()
+                .metric_value_sets(0)
+                .metric_values(0)
+                .int64_value(),
+            1000);
+}
+
 TEST_F(CheckAggregatorImplTest, TestCacheExpired) {
   CheckResponse response;
   EXPECT_ERROR_CODE(Code::NOT_FOUND, aggregator_->Check(request1_, &response));
@@ -338,5 +426,145 @@ TEST_F(CheckAggregatorImplTest, TestCheckWithCallbackCallingCacheResposne) {
   EXPECT_EQ(flushed_.size(), 1);
 }
 
+TEST_F(CheckAggregatorImplTest, TestShardedCache) {
+  CheckAggregationOptions options(10 /*entries*/, kFlushIntervalMs,
+                                  kExpirationMs, 4 /*shards*/);
+  aggregator_ =
+      CreateCheckAggregator(kServiceName, kServiceConfigId, options,
+                            std::shared_ptr<MetricKindMap>(new MetricKindMap));
+  ASSERT_TRUE((bool)(aggregator_));
+  aggregator_->SetFlushCallback(std::bind(
+      &CheckAggregatorImplTest::FlushCallback, this, std::placeholders::_1));
+
+  CheckResponse response;
+  EXPECT_ERROR_CODE(Code::NOT_FOUND, aggregator_->Check(request1_, &response));
+  EXPECT_ERROR_CODE(Code::NOT_FOUND, aggregator_->Check(request2_, &response));
+
+  EXPECT_OK(aggregator_->CacheResponse(request1_, pass_response1_));
+  EXPECT_OK(aggregator_->CacheResponse(request2_, pass_response2_));
+  EXPECT_OK(aggregator_->Check(request1_, &response));
+  EXPECT_TRUE(MessageDifferencer::Equals(response, pass_response1_));
+  EXPECT_OK(aggregator_->Check(request2_, &response));
+  EXPECT_TRUE(MessageDifferencer::Equals(response, pass_response2_));
+  EXPECT_EQ(flushed_.size(), 0);
+
+  // FlushAll() walks every shard.
+  EXPECT_OK(aggregator_->FlushAll());
+  EXPECT_EQ(flushed_.size(), 2);
+}
+
+TEST_F(CheckAggregatorImplTest, TestConcurrentCachedChecks) {
+  CheckAggregationOptions options(10 /*entries*/, 10000 /*flush_interval*/,
+                                  20000 /*expiration*/, 2 /*shards*/);
+  aggregator_ =
+      CreateCheckAggregator(kServiceName, kServiceConfigId, options,
+                            std::shared_ptr<MetricKindMap>(new MetricKindMap));
+  ASSERT_TRUE((bool)(aggregator_));
+  aggregator_->SetFlushCallback(std::bind(
+      &CheckAggregatorImplTest::FlushCallback, this, std::placeholders::_1));
+  EXPECT_OK(aggregator_->CacheResponse(request1_, pass_response1_));
+
+  const int kThreads = 4;
+  const int kChecksPerThread = 1000;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kThreads; ++i) {
+    threads.push_back(std::thread([this]() {
+      for (int j = 0; j < kChecksPerThread; ++j) {
+        CheckResponse response;
+        EXPECT_OK(aggregator_->Check(request1_, &response));
+        EXPECT_TRUE(MessageDifferencer::Equals(response, pass_response1_));
+      }
+    }));
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  EXPECT_OK(aggregator_->FlushAll());
+  ASSERT_EQ(flushed_.size(), 1);
+  // All the quota values are aggregated, whichever path served the checks.
+  request1_.mutable_operation()
+      ->mutable_metric_value_sets(0)
+      ->mutable_metric_values(0)
+      ->set_int64_value(1000 * kThreads * kChecksPerThread);
+  EXPECT_TRUE(MessageDifferencer::Equals(flushed_[0], request1_));
+}
+
+TEST_F(CheckAggregatorImplTest, TestLockFreeValuesMatchedByLabels) {
+  CheckAggregationOptions options(10 /*entries*/, 10000 /*flush_interval*/,
+                                  20000 /*expiration*/);
+  aggregator_ =
+      CreateCheckAggregator(kServiceName, kServiceConfigId, options,
+                            std::shared_ptr<MetricKindMap>(new MetricKindMap));
+  ASSERT_TRUE((bool)(aggregator_));
+  aggregator_->SetFlushCallback(std::bind(
+      &CheckAggregatorImplTest::FlushCallback, this, std::placeholders::_1));
+
+  // request1_ has a labeled value then an unlabeled one, swapped has them
+  // the other way around, but the same signature.
+  auto* metric_values = request1_.mutable_operation()
+                            ->mutable_metric_value_sets(0)
+                            ->mutable_metric_values();
+  metric_values->Add()->set_int64_value(10);
+  CheckRequest swapped = request1_;
+  swapped.mutable_operation()
+      ->mutable_metric_value_sets(0)
+      ->mutable_metric_values()
+      ->SwapElements(0, 1);
+  swapped.mutable_operation()
+      ->mutable_metric_value_sets(0)
+      ->mutable_metric_values(0)
+      ->set_int64_value(1);
+  swapped.mutable_operation()
+      ->mutable_metric_value_sets(0)
+      ->mutable_metric_values(1)
+      ->set_int64_value(2);
+  ASSERT_EQ(GenerateCheckRequestSignature(request1_),
+            GenerateCheckRequestSignature(swapped));
+
+  CheckResponse response;
+  EXPECT_OK(aggregator_->CacheResponse(request1_, pass_response1_));
+  EXPECT_OK(aggregator_->Check(swapped, &response));
+  EXPECT_OK(aggregator_->Check(request1_, &response));
+  EXPECT_OK(aggregator_->FlushAll());
+
+  // Each value is summed with the one of the same labels.
+  ASSERT_EQ(flushed_.size(), 1);
+  const auto& flushed_values =
+      flushed_[0].operation().metric_value_sets(0).metric_values();
+  ASSERT_EQ(flushed_values.size(), 2);
+  for (const MetricValue& metric_value : flushed_values) {
+    EXPECT_EQ(metric_value.int64_value(),
+              metric_value.labels().empty() ? 11 : 1002);
+  }
+}
+
+TEST_F(CheckAggregatorImplTest, TestSetMetricKindsForCachedEntry) {
+  CheckResponse response;
+  EXPECT_OK(aggregator_->CacheResponse(request1_, pass_response1_));
+  EXPECT_OK(aggregator_->Check(request1_, &response));
+  EXPECT_OK(aggregator_->Check(request1_, &response));
+
+  // The cached entry aggregates with the new metric kinds after the change.
+  std::shared_ptr<MetricKindMap> metric_kinds(new MetricKindMap);
+  (*metric_kinds)[request1_.operation().metric_value_sets(0).metric_name()] =
+      MetricDescriptor::GAUGE;
+  aggregator_->SetMetricKinds(metric_kinds);
+  request1_.mutable_operation()
+      ->mutable_metric_value_sets(0)
+      ->mutable_metric_values(0)
+      ->set_int64_value(5);
+  EXPECT_OK(aggregator_->Check(request1_, &response));
+
+  EXPECT_OK(aggregator_->FlushAll());
+  ASSERT_EQ(flushed_.size(), 1);
+  EXPECT_EQ(flushed_[0]
+                .operation()
+                .metric_value_sets(0)
+                .metric_values(0)
+                .int64_value(),
+            5);
+}
+
 }  // namespace service_control_client
 }  // namespace google
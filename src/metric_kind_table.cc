@@ -0,0 +1,97 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "src/metric_kind_table.h"
+
+#include <functional>
+
+using std::string;
+using ::google::api::MetricDescriptor;
+
+namespace google {
+namespace service_control_client {
+
+namespace {
+
+// Returns the number of slots of a table with the given number of metrics.
+size_t SlotCount(size_t metric_count) {
+  if (metric_count == 0) {
+    return 0;
+  }
+  size_t slot_count = 1;
+  while (slot_count < metric_count * 2) {
+    slot_count <<= 1;
+  }
+  return slot_count;
+}
+
+}  // namespace
+
+const int MetricKindTable::kUnknownMetric;
+
+MetricKindTable::MetricKindTable(const MetricKindMap* metric_kinds)
+    : slots_(SlotCount(metric_kinds ? metric_kinds->size() : 0),
+             kUnknownMetric) {
+  if (metric_kinds == nullptr) {
+    return;
+  }
+  size_t mask = slots_.size() - 1;
+  std::hash<string> hasher;
+  for (const auto& metric_kind : *metric_kinds) {
+    int id = static_cast<int>(names_.size());
+    size_t hash = hasher(metric_kind.first);
+    names_.push_back(metric_kind.first);
+    kinds_.push_back(metric_kind.second);
+    hashes_.push_back(hash);
+
+    size_t slot = hash & mask;
+    while (slots_[slot] != kUnknownMetric) {
+      slot = (slot + 1) & mask;
+    }
+    slots_[slot] = id;
+  }
+}
+
+int MetricKindTable::Find(const string& metric_name) const {
+  if (slots_.empty()) {
+    return kUnknownMetric;
+  }
+  size_t mask = slots_.size() - 1;
+  size_t hash = std::hash<string>()(metric_name);
+  for (size_t slot = hash & mask; slots_[slot] != kUnknownMetric;
+       slot = (slot + 1) & mask) {
+    int id = slots_[slot];
+    if (hashes_[id] == hash && names_[id] == metric_name) {
+      return id;
+    }
+  }
+  return kUnknownMetric;
+}
+
+AtomicMetricKindTable::AtomicMetricKindTable(
+    const MetricKindMap* metric_kinds)
+    : current_(std::make_shared<const MetricKindTable>(metric_kinds)),
+      current_pointer_(current_.get()) {}
+
+void AtomicMetricKindTable::Rebuild(const MetricKindMap* metric_kinds) {
+  std::shared_ptr<const MetricKindTable> table =
+      std::make_shared<const MetricKindTable>(metric_kinds);
+  MutexLock lock(rebuild_mutex_);
+  std::atomic_store(&current_, table);
+  current_pointer_.store(table.get(), std::memory_order_release);
+}
+
+}  // namespace service_control_client
+}  // namespace google
@@ -0,0 +1,117 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Internal data structures used to look metric kinds up.
+
+#ifndef GOOGLE_SERVICE_CONTROL_CLIENT_METRIC_KIND_TABLE_H_
+#define GOOGLE_SERVICE_CONTROL_CLIENT_METRIC_KIND_TABLE_H_
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "google/api/metric.pb.h"
+#include "include/aggregation_options.h"
+#include "utils/google_macros.h"
+#include "utils/thread.h"
+
+namespace google {
+namespace service_control_client {
+
+// A table of metric kinds compiled from a MetricKindMap. Metric names are
+// interned into dense ids, so a name can be resolved once and its kind then
+// read by id. Metrics not in the table are DELTA.
+//
+// Thread safe: it is immutable once built.
+class MetricKindTable {
+ public:
+  // The id of metrics not in the table.
+  static const int kUnknownMetric = -1;
+
+  // Compiles metric_kinds, which may be NULL.
+  explicit MetricKindTable(const MetricKindMap* metric_kinds);
+
+  // Returns the id of the metric with the given name, or kUnknownMetric.
+  int Find(const std::string& metric_name) const;
+
+  // Returns the kind of the metric with the given id.
+  ::google::api::MetricDescriptor::MetricKind GetKind(int id) const {
+    return id == kUnknownMetric ? ::google::api::MetricDescriptor::DELTA
+                                : kinds_[id];
+  }
+
+  // Returns the kind of the metric with the given name.
+  ::google::api::MetricDescriptor::MetricKind GetKind(
+      const std::string& metric_name) const {
+    return GetKind(Find(metric_name));
+  }
+
+ private:
+  // Metric names, kinds and name hashes, by id.
+  std::vector<std::string> names_;
+  std::vector<::google::api::MetricDescriptor::MetricKind> kinds_;
+  std::vector<size_t> hashes_;
+
+  // The open addressing table, with linear probing. Each slot is a metric
+  // id, or kUnknownMetric if empty. Its size is 0 or a power of 2, at least
+  // twice the number of metrics.
+  std::vector<int> slots_;
+
+  GOOGLE_DISALLOW_EVIL_CONSTRUCTORS(MetricKindTable);
+};
+
+// Holds the current MetricKindTable, which can be rebuilt at any time, e.g.
+// on service config reloads. The current table is published atomically;
+// replaced tables are freed once their last reader releases them.
+//
+// Thread safe.
+class AtomicMetricKindTable {
+ public:
+  // Builds the initial table from metric_kinds, which may be NULL.
+  explicit AtomicMetricKindTable(const MetricKindMap* metric_kinds);
+
+  // Returns the current table.
+  std::shared_ptr<const MetricKindTable> Get() const {
+    return std::atomic_load(&current_);
+  }
+
+  // Returns whether table is the current one. Cheaper than Get(), but only
+  // meaningful while the caller holds a reference to table.
+  bool IsCurrent(const MetricKindTable* table) const {
+    return current_pointer_.load(std::memory_order_acquire) == table;
+  }
+
+  // Rebuilds the table from metric_kinds, which may be NULL, and replaces
+  // the current one with it.
+  void Rebuild(const MetricKindMap* metric_kinds);
+
+ private:
+  // The current table, only accessed with std::atomic_load() and
+  // std::atomic_store().
+  std::shared_ptr<const MetricKindTable> current_;
+  // The address of the current table.
+  std::atomic<const MetricKindTable*> current_pointer_;
+  // Mutex serializing Rebuild() calls, so that current_ and current_pointer_
+  // are replaced together.
+  Mutex rebuild_mutex_;
+
+  GOOGLE_DISALLOW_EVIL_CONSTRUCTORS(AtomicMetricKindTable);
+};
+
+}  // namespace service_control_client
+}  // namespace google
+
+#endif  // GOOGLE_SERVICE_CONTROL_CLIENT_METRIC_KIND_TABLE_H_
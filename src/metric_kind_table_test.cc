@@ -0,0 +1,92 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "src/metric_kind_table.h"
+
+#include <thread>
+
+#include "gtest/gtest.h"
+
+using std::string;
+using ::google::api::MetricDescriptor;
+
+namespace google {
+namespace service_control_client {
+namespace {
+
+TEST(MetricKindTableTest, TestFind) {
+  MetricKindMap metric_kinds;
+  for (int i = 0; i < 100; ++i) {
+    metric_kinds["metric-" + std::to_string(i)] =
+        i % 2 ? MetricDescriptor::CUMULATIVE : MetricDescriptor::GAUGE;
+  }
+  MetricKindTable table(&metric_kinds);
+
+  for (int i = 0; i < 100; ++i) {
+    string name = "metric-" + std::to_string(i);
+    int id = table.Find(name);
+    ASSERT_NE(id, MetricKindTable::kUnknownMetric);
+    EXPECT_EQ(table.GetKind(id), metric_kinds[name]);
+    EXPECT_EQ(table.GetKind(name), metric_kinds[name]);
+  }
+  EXPECT_EQ(table.Find("metric-100"), MetricKindTable::kUnknownMetric);
+  EXPECT_EQ(table.GetKind("metric-100"), MetricDescriptor::DELTA);
+}
+
+TEST(MetricKindTableTest, TestEmptyTable) {
+  MetricKindTable table(nullptr);
+  EXPECT_EQ(table.Find("metric"), MetricKindTable::kUnknownMetric);
+  EXPECT_EQ(table.GetKind("metric"), MetricDescriptor::DELTA);
+}
+
+TEST(AtomicMetricKindTableTest, TestRebuild) {
+  MetricKindMap metric_kinds = {{"metric", MetricDescriptor::CUMULATIVE}};
+  AtomicMetricKindTable table(&metric_kinds);
+  std::shared_ptr<const MetricKindTable> old_table = table.Get();
+  EXPECT_EQ(old_table->GetKind("metric"), MetricDescriptor::CUMULATIVE);
+
+  metric_kinds["metric"] = MetricDescriptor::GAUGE;
+  table.Rebuild(&metric_kinds);
+  EXPECT_EQ(table.Get()->GetKind("metric"), MetricDescriptor::GAUGE);
+  // The replaced table can still be used by its readers.
+  EXPECT_EQ(old_table->GetKind("metric"), MetricDescriptor::CUMULATIVE);
+
+  // And is freed once they release it.
+  std::weak_ptr<const MetricKindTable> weak_old_table = old_table;
+  old_table.reset();
+  EXPECT_TRUE(weak_old_table.expired());
+}
+
+TEST(AtomicMetricKindTableTest, TestRebuildWhileReading) {
+  MetricKindMap cumulative = {{"metric", MetricDescriptor::CUMULATIVE}};
+  MetricKindMap gauge = {{"metric", MetricDescriptor::GAUGE}};
+  AtomicMetricKindTable table(&cumulative);
+
+  std::thread reader([&table]() {
+    for (int i = 0; i < 10000; ++i) {
+      MetricDescriptor::MetricKind kind = table.Get()->GetKind("metric");
+      ASSERT_TRUE(kind == MetricDescriptor::CUMULATIVE ||
+                  kind == MetricDescriptor::GAUGE);
+    }
+  });
+  for (int i = 0; i < 100; ++i) {
+    table.Rebuild(i % 2 ? &cumulative : &gauge);
+  }
+  reader.join();
+}
+
+}  // namespace
+}  // namespace service_control_client
+}  // namespace google
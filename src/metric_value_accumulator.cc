@@ -0,0 +1,388 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "src/metric_value_accumulator.h"
+
+#include "google/protobuf/stubs/logging.h"
+#include "src/money_utils.h"
+#include "utils/distribution_helper.h"
+
+using std::string;
+using ::google::api::MetricDescriptor;
+using ::google::api::servicecontrol::v1::MetricValue;
+using ::google::api::servicecontrol::v1::MetricValueSet;
+using ::google::api::servicecontrol::v1::Operation;
+using ::google::protobuf::Timestamp;
+
+namespace google {
+namespace service_control_client {
+
+namespace {
+
+// The minimum number of slots of a non empty table.
+const size_t kMinSlotCount = 8;
+
+// Returns whether timestamp a is before b or not.
+bool TimestampBefore(const Timestamp& a, const Timestamp& b) {
+  return a.seconds() < b.seconds() ||
+         (a.seconds() == b.seconds() && a.nanos() < b.nanos());
+}
+
+// Merges two metric values, with metric kind being Cumulative or
+// Gauge.
+//
+// New value will override old value, based on the end time.
+void MergeCumulativeOrGaugeMetricValue(const MetricValue& from,
+                                       MetricValue* to) {
+  if (TimestampBefore(from.end_time(), to->end_time())) return;
+
+  *to = from;
+}
+
+// Merges two metric values, with metric kind being Delta.
+//
+// Time [from_start, from_end] and [to_start, to_end] will be merged to time
+// [min(from_start, to_start), max(from_end, to_end)]. It is OK to have gap or
+// overlap between the two time spans.
+//
+// For INT64/DOUBLE/MONEY/DISTRIBUTION, values will be added together,
+// except no change when the bucket options does not match.
+void MergeDeltaMetricValue(const MetricValue& from, MetricValue* to) {
+  if (to->value_case() != from.value_case()) {
+    GOOGLE_LOG(WARNING) << "Metric values are not compatible, value cases: "
+                        << from.value_case() << ", " << to->value_case();
+    return;
+  }
+  if (to->value_case() == MetricValue::kMoneyValue &&
+      to->money_value().currency_code() !=
+          from.money_value().currency_code()) {
+    GOOGLE_LOG(WARNING) << "Money values have different currency codes: "
+                        << from.money_value().currency_code() << ", "
+                        << to->money_value().currency_code();
+    return;
+  }
+
+  if (from.has_start_time()) {
+    if (!to->has_start_time() ||
+        TimestampBefore(from.start_time(), to->start_time())) {
+      *(to->mutable_start_time()) = from.start_time();
+    }
+  }
+
+  if (from.has_end_time()) {
+    if (!to->has_end_time() ||
+        TimestampBefore(to->end_time(), from.end_time())) {
+      *(to->mutable_end_time()) = from.end_time();
+    }
+  }
+
+  switch (to->value_case()) {
+    case MetricValue::kInt64Value:
+      to->set_int64_value(to->int64_value() + from.int64_value());
+      break;
+    case MetricValue::kDoubleValue:
+      to->set_double_value(to->double_value() + from.double_value());
+      break;
+    case MetricValue::kMoneyValue:
+      *to->mutable_money_value() =
+          SaturatedAddMoney(to->money_value(), from.money_value());
+      break;
+    case MetricValue::kDistributionValue:
+      DistributionHelper::Merge(from.distribution_value(),
+                                to->mutable_distribution_value());
+      break;
+    default:
+      GOOGLE_LOG(WARNING) << "Unknown metric kind for value case: "
+                          << to->value_case();
+      break;
+  }
+}
+
+// Returns whether time a is before b or not.
+bool TimeBefore(int64_t a_seconds, int32_t a_nanos, int64_t b_seconds,
+                int32_t b_nanos) {
+  return a_seconds < b_seconds || (a_seconds == b_seconds && a_nanos < b_nanos);
+}
+
+// Returns the slot of a key in a table with the given mask.
+size_t SlotOf(int metric, const Signature& signature, size_t mask) {
+  uint64_t hash =
+      signature.low() ^ (static_cast<uint64_t>(metric) * 0x9E3779B97F4A7C15ULL);
+  return static_cast<size_t>(hash) & mask;
+}
+
+}  // namespace
+
+MetricValueAccumulator::MetricValueAccumulator(
+    const MetricKindTable* metric_kinds)
+    : metric_kinds_(metric_kinds) {}
+
+void MetricValueAccumulator::Merge(const Operation& operation) {
+  for (const auto& metric_value_set : operation.metric_value_sets()) {
+    int metric = InternMetric(metric_value_set.metric_name());
+    for (const auto& metric_value : metric_value_set.metric_values()) {
+      MergeValue(metric, metric_value, nullptr);
+    }
+  }
+}
+
+void MetricValueAccumulator::Merge(Operation* operation) {
+  for (auto& metric_value_set : *operation->mutable_metric_value_sets()) {
+    int metric = InternMetric(metric_value_set.metric_name());
+    for (auto& metric_value : *metric_value_set.mutable_metric_values()) {
+      MergeValue(metric, metric_value, &metric_value);
+    }
+  }
+}
+
+void MetricValueAccumulator::AppendTo(Operation* operation) const {
+  std::vector<MetricValueSet*> sets(metrics_.size(), nullptr);
+  for (const Entry& entry : entries_) {
+    MetricValueSet*& set = sets[entry.metric];
+    if (set == nullptr) {
+      set = operation->add_metric_value_sets();
+      set->set_metric_name(metrics_[entry.metric].name);
+    }
+    MetricValue* value = set->add_metric_values();
+    *value = *entry.value;
+    WriteNativeValue(entry, value);
+  }
+}
+
+void MetricValueAccumulator::ReleaseTo(Operation* operation) {
+  std::vector<MetricValueSet*> sets(metrics_.size(), nullptr);
+  for (Entry& entry : entries_) {
+    MetricValueSet*& set = sets[entry.metric];
+    if (set == nullptr) {
+      set = operation->add_metric_value_sets();
+      set->set_metric_name(metrics_[entry.metric].name);
+    }
+    WriteNativeValue(entry, entry.value.get());
+    set->add_metric_values()->Swap(entry.value.get());
+  }
+  metrics_.clear();
+  entries_.clear();
+  slots_.clear();
+}
+
+int MetricValueAccumulator::InternMetric(const string& metric_name) {
+  for (size_t i = 0; i < metrics_.size(); ++i) {
+    if (metrics_[i].name == metric_name) {
+      return static_cast<int>(i);
+    }
+  }
+  Metric metric;
+  metric.name = metric_name;
+  metric.kind = MetricDescriptor::DELTA;
+  if (metric_kinds_) {
+    metric.kind = metric_kinds_->GetKind(metric_name);
+  }
+  metric.merge = metric.kind == MetricDescriptor::DELTA
+                     ? MergeDeltaMetricValue
+                     : MergeCumulativeOrGaugeMetricValue;
+  metrics_.push_back(metric);
+  return static_cast<int>(metrics_.size() - 1);
+}
+
+void MetricValueAccumulator::MergeValue(int metric, const MetricValue& value,
+                                        MetricValue* movable_value) {
+  // Many metrics have no labels, their signature is always the same unless
+  // it includes a currency code.
+  static const Signature kNoLabelsSignature =
+      GenerateReportMetricValueSignature(MetricValue());
+  Signature signature =
+      value.labels().empty() && value.value_case() != MetricValue::kMoneyValue
+          ? kNoLabelsSignature
+          : GenerateReportMetricValueSignature(value);
+  Entry* entry = Find(metric, signature);
+  if (entry == nullptr) {
+    Insert(metric, signature, value, movable_value);
+    return;
+  }
+  if (!entry->native) {
+    metrics_[metric].merge(value, entry->value.get());
+    return;
+  }
+
+  // Only delta int64, double, money and distribution values are native.
+  if (value.value_case() != entry->value_case) {
+    GOOGLE_LOG(WARNING) << "Metric values are not compatible for metric "
+                        << metrics_[metric].name
+                        << ", value cases: " << value.value_case() << ", "
+                        << entry->value_case;
+    return;
+  }
+  if (entry->value_case == MetricValue::kMoneyValue &&
+      value.money_value().currency_code() !=
+          entry->value->money_value().currency_code()) {
+    GOOGLE_LOG(WARNING) << "Money values have different currency codes for "
+                        << "metric " << metrics_[metric].name << ": "
+                        << value.money_value().currency_code() << ", "
+                        << entry->value->money_value().currency_code();
+    return;
+  }
+  if (value.has_start_time()) {
+    const Timestamp& start_time = value.start_time();
+    if (!entry->start_time.set ||
+        TimeBefore(start_time.seconds(), start_time.nanos(),
+                   entry->start_time.seconds, entry->start_time.nanos)) {
+      entry->start_time = {true, start_time.seconds(), start_time.nanos()};
+    }
+  }
+  if (value.has_end_time()) {
+    const Timestamp& end_time = value.end_time();
+    if (!entry->end_time.set ||
+        TimeBefore(entry->end_time.seconds, entry->end_time.nanos,
+                   end_time.seconds(), end_time.nanos())) {
+      entry->end_time = {true, end_time.seconds(), end_time.nanos()};
+    }
+  }
+  switch (entry->value_case) {
+    case MetricValue::kInt64Value:
+      entry->int64_value += value.int64_value();
+      break;
+    case MetricValue::kDoubleValue:
+      entry->double_value += value.double_value();
+      break;
+    case MetricValue::kMoneyValue:
+      entry->money_value += GetAmountNanos(value.money_value());
+      break;
+    default:
+      entry->distribution->Merge(value.distribution_value());
+      break;
+  }
+}
+
+MetricValueAccumulator::Entry* MetricValueAccumulator::Find(
+    int metric, const Signature& signature) {
+  if (slots_.empty()) {
+    return nullptr;
+  }
+  size_t mask = slots_.size() - 1;
+  for (size_t slot = SlotOf(metric, signature, mask); slots_[slot] >= 0;
+       slot = (slot + 1) & mask) {
+    Entry& entry = entries_[slots_[slot]];
+    if (entry.metric == metric && entry.signature == signature) {
+      return &entry;
+    }
+  }
+  return nullptr;
+}
+
+void MetricValueAccumulator::Insert(int metric, const Signature& signature,
+                                    const MetricValue& value,
+                                    MetricValue* movable_value) {
+  if ((entries_.size() + 1) * 2 > slots_.size()) {
+    Rehash(slots_.empty() ? kMinSlotCount : slots_.size() * 2);
+  }
+
+  Entry entry;
+  entry.signature = signature;
+  entry.metric = metric;
+  entry.value_case = value.value_case();
+  entry.value.reset(new MetricValue);
+  if (movable_value) {
+    entry.value->Swap(movable_value);
+  } else {
+    *entry.value = value;
+  }
+
+  MetricValue* entry_value = entry.value.get();
+  entry.native = metrics_[metric].kind == MetricDescriptor::DELTA &&
+                 (entry.value_case == MetricValue::kInt64Value ||
+                  entry.value_case == MetricValue::kDoubleValue ||
+                  entry.value_case == MetricValue::kMoneyValue ||
+                  entry.value_case == MetricValue::kDistributionValue);
+  entry.int64_value = 0;
+  entry.double_value = 0;
+  entry.money_value = 0;
+  entry.start_time = {entry_value->has_start_time(),
+                      entry_value->start_time().seconds(),
+                      entry_value->start_time().nanos()};
+  entry.end_time = {entry_value->has_end_time(),
+                    entry_value->end_time().seconds(),
+                    entry_value->end_time().nanos()};
+  if (entry.native) {
+    entry.int64_value = entry_value->int64_value();
+    entry.double_value = entry_value->double_value();
+    entry_value->clear_start_time();
+    entry_value->clear_end_time();
+    if (entry.value_case == MetricValue::kMoneyValue) {
+      // Keeps the currency code in the proto.
+      entry.money_value = GetAmountNanos(entry_value->money_value());
+      entry_value->mutable_money_value()->clear_units();
+      entry_value->mutable_money_value()->clear_nanos();
+    } else if (entry.value_case == MetricValue::kDistributionValue) {
+      entry.distribution.reset(
+          new DistributionAccumulator(entry_value->distribution_value()));
+      entry_value->clear_value();
+    } else {
+      entry_value->clear_value();
+    }
+  }
+
+  size_t mask = slots_.size() - 1;
+  size_t slot = SlotOf(metric, signature, mask);
+  while (slots_[slot] >= 0) {
+    slot = (slot + 1) & mask;
+  }
+  slots_[slot] = static_cast<int>(entries_.size());
+  entries_.push_back(std::move(entry));
+}
+
+void MetricValueAccumulator::Rehash(size_t slot_count) {
+  slots_.assign(slot_count, -1);
+  size_t mask = slot_count - 1;
+  for (size_t i = 0; i < entries_.size(); ++i) {
+    size_t slot = SlotOf(entries_[i].metric, entries_[i].signature, mask);
+    while (slots_[slot] >= 0) {
+      slot = (slot + 1) & mask;
+    }
+    slots_[slot] = static_cast<int>(i);
+  }
+}
+
+void MetricValueAccumulator::WriteNativeValue(const Entry& entry,
+                                              MetricValue* value) {
+  if (!entry.native) {
+    return;
+  }
+  if (entry.start_time.set) {
+    value->mutable_start_time()->set_seconds(entry.start_time.seconds);
+    value->mutable_start_time()->set_nanos(entry.start_time.nanos);
+  }
+  if (entry.end_time.set) {
+    value->mutable_end_time()->set_seconds(entry.end_time.seconds);
+    value->mutable_end_time()->set_nanos(entry.end_time.nanos);
+  }
+  switch (entry.value_case) {
+    case MetricValue::kInt64Value:
+      value->set_int64_value(entry.int64_value);
+      break;
+    case MetricValue::kDoubleValue:
+      value->set_double_value(entry.double_value);
+      break;
+    case MetricValue::kMoneyValue:
+      // Saturates like SaturatedAddMoney if the sum does not fit.
+      SetAmountNanos(entry.money_value, value->mutable_money_value());
+      break;
+    default:
+      entry.distribution->ToProto(value->mutable_distribution_value());
+      break;
+  }
+}
+
+}  // namespace service_control_client
+}  // namespace google
@@ -0,0 +1,158 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Internal data structure used to aggregate the metric values of an
+// operation.
+
+#ifndef GOOGLE_SERVICE_CONTROL_CLIENT_METRIC_VALUE_ACCUMULATOR_H_
+#define GOOGLE_SERVICE_CONTROL_CLIENT_METRIC_VALUE_ACCUMULATOR_H_
+
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "google/api/metric.pb.h"
+#include "google/api/servicecontrol/v1/metric_value.pb.h"
+#include "google/api/servicecontrol/v1/operation.pb.h"
+#include "src/metric_kind_table.h"
+#include "src/money_utils.h"
+#include "src/signature.h"
+#include "utils/distribution_helper.h"
+#include "utils/google_macros.h"
+
+namespace google {
+namespace service_control_client {
+
+// Aggregates metric values by metric name and label set.
+//
+// Metric names are interned into small ids, and values are kept in a flat
+// open addressing table keyed by metric id and label set signature, which
+// includes the currency code of money values. Delta int64, double, money and
+// distribution values, with their times, are accumulated natively: merging
+// them does not go through proto accessors. Money is summed exactly in 128
+// bits fixed-point, and only saturated when written out. Distributions are
+// merged into DistributionAccumulator. Values turn back into MetricValueSet
+// protos only when written out.
+//
+// Thread compatible.
+class MetricValueAccumulator {
+ public:
+  // Does not take ownership of metric_kinds, which must outlive this
+  // instance. If it is NULL, all metrics are DELTA.
+  explicit MetricValueAccumulator(const MetricKindTable* metric_kinds);
+
+  // Merges the metric value sets of the given operation.
+  void Merge(const ::google::api::servicecontrol::v1::Operation& operation);
+
+  // Same as above, but swaps new metric values out of the given operation
+  // instead of copying them.
+  void Merge(::google::api::servicecontrol::v1::Operation* operation);
+
+  // Appends the accumulated metric value sets to the given operation.
+  void AppendTo(::google::api::servicecontrol::v1::Operation* operation) const;
+
+  // Same as above, but moves the accumulated metric values instead of
+  // copying them. Leaves this instance empty.
+  void ReleaseTo(::google::api::servicecontrol::v1::Operation* operation);
+
+ private:
+  // An interned metric. Its kind, and so how its values are merged, is
+  // resolved once when it is interned.
+  struct Metric {
+    std::string name;
+    ::google::api::MetricDescriptor::MetricKind kind;
+    // Merges a value of the metric into another, unless native.
+    void (*merge)(const ::google::api::servicecontrol::v1::MetricValue& from,
+                  ::google::api::servicecontrol::v1::MetricValue* to);
+  };
+
+  // A timestamp, kept as plain numbers.
+  struct Time {
+    bool set;
+    int64_t seconds;
+    int32_t nanos;
+  };
+
+  // An accumulated metric value.
+  struct Entry {
+    // The label set signature of the value.
+    Signature signature;
+    // The index of its metric in metrics_.
+    int metric;
+    // Whether the value and its times are kept natively below rather than in
+    // value.
+    bool native;
+    ::google::api::servicecontrol::v1::MetricValue::ValueCase value_case;
+    int64_t int64_value;
+    double double_value;
+    MoneyNanos money_value;
+    std::unique_ptr<DistributionAccumulator> distribution;
+    Time start_time;
+    Time end_time;
+    // The labels and currency code of the value, and the value itself unless
+    // native.
+    std::unique_ptr<::google::api::servicecontrol::v1::MetricValue> value;
+  };
+
+  // Returns the id of the metric with the given name, interning it if
+  // needed.
+  int InternMetric(const std::string& metric_name);
+
+  // Merges a metric value of the metric with the given id. If
+  // movable_value is not NULL, it is the same value and it is swapped out
+  // instead of copied when it is new.
+  void MergeValue(
+      int metric, const ::google::api::servicecontrol::v1::MetricValue& value,
+      ::google::api::servicecontrol::v1::MetricValue* movable_value);
+
+  // Returns the entry with the given key, or NULL if there is none.
+  Entry* Find(int metric, const Signature& signature);
+
+  // Adds a new entry for the given value.
+  void Insert(int metric, const Signature& signature,
+              const ::google::api::servicecontrol::v1::MetricValue& value,
+              ::google::api::servicecontrol::v1::MetricValue* movable_value);
+
+  // Rebuilds slots_ with the given number of slots, a power of 2.
+  void Rehash(size_t slot_count);
+
+  // Writes the value and times of an entry into the given proto if they are
+  // native.
+  static void WriteNativeValue(
+      const Entry& entry, ::google::api::servicecontrol::v1::MetricValue* value);
+
+  // Interned metrics, by id. Operations have few metrics, so they are
+  // looked up linearly.
+  std::vector<Metric> metrics_;
+
+  // The entries, in insertion order.
+  std::vector<Entry> entries_;
+
+  // The open addressing table, with linear probing. Each slot is an index in
+  // entries_, or -1 if empty. Its size is 0 or a power of 2, at least twice
+  // the number of entries.
+  std::vector<int> slots_;
+
+  // Metric kinds.
+  const MetricKindTable* metric_kinds_;
+
+  GOOGLE_DISALLOW_EVIL_CONSTRUCTORS(MetricValueAccumulator);
+};
+
+}  // namespace service_control_client
+}  // namespace google
+
+#endif  // GOOGLE_SERVICE_CONTROL_CLIENT_METRIC_VALUE_ACCUMULATOR_H_
@@ -0,0 +1,326 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "src/metric_value_accumulator.h"
+
+#include "google/protobuf/text_format.h"
+#include "google/protobuf/util/message_differencer.h"
+#include "gtest/gtest.h"
+#include "utils/distribution_helper.h"
+
+using std::string;
+using ::google::api::MetricDescriptor;
+using ::google::api::servicecontrol::v1::Distribution;
+using ::google::api::servicecontrol::v1::MetricValue;
+using ::google::api::servicecontrol::v1::Operation;
+using ::google::protobuf::TextFormat;
+using ::google::protobuf::util::MessageDifferencer;
+
+namespace google {
+namespace service_control_client {
+namespace {
+
+const char kCountMetric[] = "library.googleapis.com/rpc/client/count";
+const char kGaugeMetric[] = "library.googleapis.com/rpc/client/gauge";
+
+const char kOperation1[] = R"(
+metric_value_sets {
+  metric_name: "library.googleapis.com/rpc/client/count"
+  metric_values {
+    labels { key: "code" value: "200" }
+    start_time { seconds: 100000 nanos: 200 }
+    end_time { seconds: 100001 nanos: 300 }
+    int64_value: 10
+  }
+  metric_values {
+    labels { key: "code" value: "404" }
+    int64_value: 1
+  }
+}
+metric_value_sets {
+  metric_name: "library.googleapis.com/rpc/client/bytes"
+  metric_values {
+    start_time { seconds: 100000 nanos: 100 }
+    end_time { seconds: 100001 nanos: 100 }
+    double_value: 1.5
+  }
+}
+metric_value_sets {
+  metric_name: "library.googleapis.com/rpc/client/gauge"
+  metric_values {
+    end_time { seconds: 100001 }
+    int64_value: 7
+  }
+}
+)";
+
+const char kOperation2[] = R"(
+metric_value_sets {
+  metric_name: "library.googleapis.com/rpc/client/bytes"
+  metric_values {
+    start_time { seconds: 99999 nanos: 100 }
+    end_time { seconds: 100000 nanos: 100 }
+    double_value: 2.5
+  }
+}
+metric_value_sets {
+  metric_name: "library.googleapis.com/rpc/client/count"
+  metric_values {
+    labels { key: "code" value: "200" }
+    start_time { seconds: 100001 }
+    end_time { seconds: 100002 }
+    int64_value: 5
+  }
+  metric_values {
+    labels { key: "code" value: "500" }
+    int64_value: 2
+  }
+}
+metric_value_sets {
+  metric_name: "library.googleapis.com/rpc/client/gauge"
+  metric_values {
+    end_time { seconds: 100002 }
+    int64_value: 3
+  }
+}
+)";
+
+// Metric value sets appear in the order their metrics were first merged,
+// and metric values in the order they were first merged.
+const char kMerged12[] = R"(
+metric_value_sets {
+  metric_name: "library.googleapis.com/rpc/client/count"
+  metric_values {
+    labels { key: "code" value: "200" }
+    start_time { seconds: 100000 nanos: 200 }
+    end_time { seconds: 100002 }
+    int64_value: 15
+  }
+  metric_values {
+    labels { key: "code" value: "404" }
+    int64_value: 1
+  }
+  metric_values {
+    labels { key: "code" value: "500" }
+    int64_value: 2
+  }
+}
+metric_value_sets {
+  metric_name: "library.googleapis.com/rpc/client/bytes"
+  metric_values {
+    start_time { seconds: 99999 nanos: 100 }
+    end_time { seconds: 100001 nanos: 100 }
+    double_value: 4
+  }
+}
+metric_value_sets {
+  metric_name: "library.googleapis.com/rpc/client/gauge"
+  metric_values {
+    end_time { seconds: 100002 }
+    int64_value: 3
+  }
+}
+)";
+
+class MetricValueAccumulatorTest : public ::testing::Test {
+ public:
+  void SetUp() {
+    ASSERT_TRUE(TextFormat::ParseFromString(kOperation1, &operation1_));
+    ASSERT_TRUE(TextFormat::ParseFromString(kOperation2, &operation2_));
+    ASSERT_TRUE(TextFormat::ParseFromString(kMerged12, &merged12_));
+    MetricKindMap metric_kinds;
+    metric_kinds[kGaugeMetric] = MetricDescriptor::GAUGE;
+    metric_kinds_.reset(new MetricKindTable(&metric_kinds));
+  }
+
+  Operation operation1_;
+  Operation operation2_;
+  Operation merged12_;
+  std::unique_ptr<MetricKindTable> metric_kinds_;
+};
+
+TEST_F(MetricValueAccumulatorTest, TestMerge) {
+  MetricValueAccumulator accumulator(metric_kinds_.get());
+  accumulator.Merge(operation1_);
+  accumulator.Merge(operation2_);
+
+  Operation merged;
+  accumulator.AppendTo(&merged);
+  EXPECT_TRUE(MessageDifferencer::Equals(merged, merged12_));
+
+  // Appending does not change the accumulated values.
+  Operation merged_again;
+  accumulator.AppendTo(&merged_again);
+  EXPECT_TRUE(MessageDifferencer::Equals(merged_again, merged12_));
+}
+
+TEST_F(MetricValueAccumulatorTest, TestMergeMoved) {
+  MetricValueAccumulator accumulator(metric_kinds_.get());
+  accumulator.Merge(&operation1_);
+  accumulator.Merge(&operation2_);
+
+  Operation merged;
+  accumulator.ReleaseTo(&merged);
+  EXPECT_TRUE(MessageDifferencer::Equals(merged, merged12_));
+
+  // The accumulator is left empty.
+  Operation empty;
+  accumulator.AppendTo(&empty);
+  EXPECT_EQ(empty.metric_value_sets_size(), 0);
+}
+
+TEST_F(MetricValueAccumulatorTest, TestIncompatibleValueIgnored) {
+  MetricValueAccumulator accumulator(nullptr);
+  accumulator.Merge(operation1_);
+  operation1_.mutable_metric_value_sets(1)
+      ->mutable_metric_values(0)
+      ->set_int64_value(3);
+  accumulator.Merge(operation1_);
+  Operation merged;
+  accumulator.AppendTo(&merged);
+  EXPECT_EQ(merged.metric_value_sets(1).metric_values(0).double_value(), 1.5);
+}
+
+TEST_F(MetricValueAccumulatorTest, TestManyLabelSets) {
+  // Enough distinct values to grow the table a few times.
+  Operation operation;
+  auto* set = operation.add_metric_value_sets();
+  set->set_metric_name(kCountMetric);
+  for (int i = 0; i < 1000; ++i) {
+    MetricValue* value = set->add_metric_values();
+    (*value->mutable_labels())["id"] = std::to_string(i);
+    value->set_int64_value(i);
+  }
+  MetricValueAccumulator accumulator(nullptr);
+  accumulator.Merge(operation);
+  accumulator.Merge(operation);
+
+  Operation merged;
+  accumulator.AppendTo(&merged);
+  ASSERT_EQ(merged.metric_value_sets_size(), 1);
+  ASSERT_EQ(merged.metric_value_sets(0).metric_values_size(), 1000);
+  for (int i = 0; i < 1000; ++i) {
+    EXPECT_EQ(merged.metric_value_sets(0).metric_values(i).int64_value(),
+              2 * i);
+  }
+}
+
+TEST_F(MetricValueAccumulatorTest, TestMergeDistribution) {
+  Distribution distribution1;
+  ASSERT_TRUE(
+      DistributionHelper::InitExponential(10, 2, 0.001, &distribution1).ok());
+  Distribution distribution2 = distribution1;
+  for (double value : {0.0005, 0.002, 0.03}) {
+    DistributionHelper::AddSample(value, &distribution1);
+  }
+  for (double value : {0.004, 0.5}) {
+    DistributionHelper::AddSample(value, &distribution2);
+  }
+
+  Operation operation1;
+  auto* set = operation1.add_metric_value_sets();
+  set->set_metric_name("library.googleapis.com/rpc/client/latencies");
+  *set->add_metric_values()->mutable_distribution_value() = distribution1;
+  Operation operation2 = operation1;
+  *operation2.mutable_metric_value_sets(0)
+       ->mutable_metric_values(0)
+       ->mutable_distribution_value() = distribution2;
+
+  MetricValueAccumulator accumulator(nullptr);
+  accumulator.Merge(operation1);
+  accumulator.Merge(&operation2);
+
+  Distribution expected = distribution1;
+  DistributionHelper::Merge(distribution2, &expected);
+  Operation merged;
+  accumulator.AppendTo(&merged);
+  EXPECT_TRUE(MessageDifferencer::Equals(
+      merged.metric_value_sets(0).metric_values(0).distribution_value(),
+      expected));
+}
+
+TEST_F(MetricValueAccumulatorTest, TestMergeMoneyPerCurrency) {
+  Operation operation;
+  ASSERT_TRUE(TextFormat::ParseFromString(R"(
+metric_value_sets {
+  metric_name: "library.googleapis.com/rpc/client/cost"
+  metric_values {
+    money_value { currency_code: "USD" units: 1 nanos: 600000000 }
+  }
+  metric_values {
+    money_value { currency_code: "EUR" units: -2 nanos: -100000000 }
+  }
+}
+)",
+                                          &operation));
+  MetricValueAccumulator accumulator(nullptr);
+  accumulator.Merge(operation);
+  accumulator.Merge(operation);
+  accumulator.Merge(operation);
+
+  Operation expected;
+  ASSERT_TRUE(TextFormat::ParseFromString(R"(
+metric_value_sets {
+  metric_name: "library.googleapis.com/rpc/client/cost"
+  metric_values {
+    money_value { currency_code: "USD" units: 4 nanos: 800000000 }
+  }
+  metric_values {
+    money_value { currency_code: "EUR" units: -6 nanos: -300000000 }
+  }
+}
+)",
+                                          &expected));
+  Operation merged;
+  accumulator.AppendTo(&merged);
+  EXPECT_TRUE(MessageDifferencer::Equals(merged, expected));
+}
+
+TEST_F(MetricValueAccumulatorTest, TestMergeMoneySaturates) {
+  Operation operation;
+  auto* set = operation.add_metric_value_sets();
+  set->set_metric_name("library.googleapis.com/rpc/client/cost");
+  MetricValue* value = set->add_metric_values();
+  value->mutable_money_value()->set_currency_code("USD");
+  value->mutable_money_value()->set_units(INT64_MAX);
+  Operation negative = operation;
+  negative.mutable_metric_value_sets(0)
+      ->mutable_metric_values(0)
+      ->mutable_money_value()
+      ->set_units(-INT64_MAX);
+
+  MetricValueAccumulator accumulator(nullptr);
+  accumulator.Merge(operation);
+  accumulator.Merge(operation);
+  Operation merged;
+  accumulator.AppendTo(&merged);
+  const auto& money =
+      merged.metric_value_sets(0).metric_values(0).money_value();
+  EXPECT_EQ(money.units(), INT64_MAX);
+  EXPECT_EQ(money.nanos(), 999999999);
+
+  // The sum is kept exactly, so it can come back in range.
+  accumulator.Merge(negative);
+  Operation merged_again;
+  accumulator.AppendTo(&merged_again);
+  const auto& money_again =
+      merged_again.metric_value_sets(0).metric_values(0).money_value();
+  EXPECT_EQ(money_again.units(), INT64_MAX);
+  EXPECT_EQ(money_again.nanos(), 0);
+}
+
+}  // namespace
+}  // namespace service_control_client
+}  // namespace google
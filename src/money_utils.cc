@@ -128,5 +128,26 @@ Money SaturatedAddMoney(const Money& a, const Money& b) {
   return sum;
 }
 
+MoneyNanos GetAmountNanos(const Money& money) {
+  const int kBillion = 1000000000;
+  return static_cast<MoneyNanos>(money.units()) * kBillion + money.nanos();
+}
+
+void SetAmountNanos(MoneyNanos nanos, Money* money) {
+  const int kBillion = 1000000000;
+  MoneyNanos units = nanos / kBillion;
+  if (units > INT64_MAX) {
+    money->set_units(INT64_MAX);
+    money->set_nanos(kBillion - 1);
+  } else if (units < INT64_MIN) {
+    money->set_units(INT64_MIN);
+    money->set_nanos(-kBillion + 1);
+  } else {
+    // Both truncate toward zero, so units and nanos have the same sign.
+    money->set_units(static_cast<int64_t>(units));
+    money->set_nanos(static_cast<int32_t>(nanos % kBillion));
+  }
+}
+
 }  // namespace service_control_client
 }  // namespace google
@@ -24,6 +24,10 @@ limitations under the License.
 namespace google {
 namespace service_control_client {
 
+// An amount of money in nanos, as a 128 bits fixed-point number. It holds the
+// exact sum of billions of money values of any amount.
+__extension__ typedef __int128 MoneyNanos;
+
 // Returns OK if the given money is a valid value. The possible validation
 // errors include invalid currency_code format, nanos out of range, and
 // the signs of units and nanos disagree. In all error cases the error
@@ -60,6 +64,14 @@ int GetAmountSign(const ::google::type::Money& money);
 ::google::type::Money SaturatedAddMoney(const ::google::type::Money& a,
                                         const ::google::type::Money& b);
 
+// Returns the amount of the given money in nanos.
+MoneyNanos GetAmountNanos(const ::google::type::Money& money);
+
+// Sets the amount of the given money to the given number of nanos, keeping
+// its currency_code. Like SaturatedAddMoney, the amount is set to the maximum
+// positive or minimum negative amount if it does not fit.
+void SetAmountNanos(MoneyNanos nanos, ::google::type::Money* money);
+
 }  // namespace service_control_client
 }  // namespace google
 
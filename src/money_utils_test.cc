@@ -520,5 +520,35 @@ TEST_F(MoneyUtilsTest, SaturatedAddMoneyOverflow) {
   EXPECT_EQ(-999999999, sum.nanos());
 }
 
+TEST_F(MoneyUtilsTest, AmountNanos) {
+  Money money;
+  money.set_currency_code("USD");
+  money.set_units(-3);
+  money.set_nanos(-250000000);
+  EXPECT_TRUE(GetAmountNanos(money) == -3250000000LL);
+
+  money.Clear();
+  money.set_currency_code("USD");
+  SetAmountNanos(-3250000000LL, &money);
+  EXPECT_EQ("USD", money.currency_code());
+  EXPECT_EQ(-3, money.units());
+  EXPECT_EQ(-250000000, money.nanos());
+
+  money.set_units(INT64_MAX);
+  money.set_nanos(999999999);
+  MoneyNanos max_nanos = GetAmountNanos(money);
+  SetAmountNanos(max_nanos, &money);
+  EXPECT_EQ(INT64_MAX, money.units());
+  EXPECT_EQ(999999999, money.nanos());
+
+  SetAmountNanos(max_nanos + max_nanos, &money);
+  EXPECT_EQ(INT64_MAX, money.units());
+  EXPECT_EQ(999999999, money.nanos());
+
+  SetAmountNanos(-max_nanos - max_nanos, &money);
+  EXPECT_EQ(INT64_MIN, money.units());
+  EXPECT_EQ(-999999999, money.nanos());
+}
+
 }  // namespace service_control_client
 }  // namespace google
@@ -18,11 +18,13 @@ limitations under the License.
 #ifndef GOOGLE_SERVICE_CONTROL_CLIENT_OPERATION_AGGREGATOR_H_
 #define GOOGLE_SERVICE_CONTROL_CLIENT_OPERATION_AGGREGATOR_H_
 
-#include <unordered_map>
+#include <memory>
 
 #include "google/api/metric.pb.h"
 #include "google/api/servicecontrol/v1/metric_value.pb.h"
 #include "google/api/servicecontrol/v1/operation.pb.h"
+#include "src/metric_kind_table.h"
+#include "src/metric_value_accumulator.h"
 #include "utils/google_macros.h"
 
 namespace google {
@@ -31,50 +33,52 @@ namespace service_control_client {
 // Thread compatible.
 class OperationAggregator {
  public:
-  // Constructor. Does not take ownership of metric_kinds, which must outlive
-  // this instance.
+  // Constructor. Shares the ownership of metric_kinds, which may be NULL.
   OperationAggregator(
       const ::google::api::servicecontrol::v1::Operation& operation,
-      const std::unordered_map<std::string,
-                               ::google::api::MetricDescriptor::MetricKind>*
-          metric_kinds);
+      std::shared_ptr<const MetricKindTable> metric_kinds);
+
+  // Same as above, but moves the given operation instead of copying it.
+  OperationAggregator(::google::api::servicecontrol::v1::Operation&& operation,
+                      std::shared_ptr<const MetricKindTable> metric_kinds);
 
   // Merges the given operation with this operation, assuming the given
   // operation has the same operation signature.
   void MergeOperation(
       const ::google::api::servicecontrol::v1::Operation& operation);
 
+  // Same as above, but moves the metric values and log entries of the given
+  // operation instead of copying them.
+  void MergeOperation(::google::api::servicecontrol::v1::Operation&& operation);
+
   // Transforms to Operation proto message.
   ::google::api::servicecontrol::v1::Operation ToOperationProto() const;
 
+  // Moves the aggregated operation into the given, empty, operation without
+  // copying it. Leaves this instance empty, it should be deleted after.
+  void ReleaseOperationProto(
+      ::google::api::servicecontrol::v1::Operation* operation);
+
   // Check if the operation is too big.
   bool TooBig() const;
 
  private:
-  // Merges the metric value sets in the given operation into this operation.
-  void MergeMetricValueSets(
-      const ::google::api::servicecontrol::v1::Operation& operation);
+  // Merges the start and end times of the given operation into this
+  // operation.
+  void MergeTimes(const ::google::api::servicecontrol::v1::Operation& operation);
 
   // Merges the log entries in the given operation into this operation.
   void MergeLogEntries(
       const ::google::api::servicecontrol::v1::Operation& operation);
 
+  // Metric kinds, kept alive for metric_values_.
+  std::shared_ptr<const MetricKindTable> metric_kinds_;
+
   // Used to store everything but metric value sets.
   ::google::api::servicecontrol::v1::Operation operation_;
 
   // Aggregated metric values in the operation.
-  // Key is metric_name.
-  // Value is a map of metric value signature to aggregated metric value.
-  std::unordered_map<
-      std::string,
-      std::unordered_map<std::string,
-                         ::google::api::servicecontrol::v1::MetricValue>>
-      metric_value_sets_;
-
-  // Metric kinds. Key is the metric name and value is the metric kind.
-  // Defaults to DELTA if not specified.
-  const std::unordered_map<
-      std::string, ::google::api::MetricDescriptor::MetricKind>* metric_kinds_;
+  MetricValueAccumulator metric_values_;
 
   GOOGLE_DISALLOW_EVIL_CONSTRUCTORS(OperationAggregator);
 };
@@ -362,11 +362,15 @@ class OperationAggregatorTest : public ::testing::Test {
 
   MetricValue metric_value_;
 
-  const std::unordered_map<string, MetricDescriptor::MetricKind>
-      cumulative_metric_kind_ = {{kMetric, MetricDescriptor::CUMULATIVE}};
-
-  const std::unordered_map<string, MetricDescriptor::MetricKind>
-      delta_metric_kind_ = {{kMetric, MetricDescriptor::DELTA}};
+  const MetricKindMap cumulative_metric_kind_map_ = {
+      {kMetric, MetricDescriptor::CUMULATIVE}};
+  const std::shared_ptr<const MetricKindTable> cumulative_metric_kind_ =
+      std::make_shared<MetricKindTable>(&cumulative_metric_kind_map_);
+
+  const MetricKindMap delta_metric_kind_map_ = {
+      {kMetric, MetricDescriptor::DELTA}};
+  const std::shared_ptr<const MetricKindTable> delta_metric_kind_ =
+      std::make_shared<MetricKindTable>(&delta_metric_kind_map_);
 };
 
 // Clears the start time of operation and metric values.
@@ -380,19 +384,37 @@ void ClearStartEndTime(Operation* operation) {
 }
 
 TEST_F(OperationAggregatorTest, Cumulative_MergeOperation1AndOperation2) {
-  OperationAggregator iop(operation1_, &cumulative_metric_kind_);
+  OperationAggregator iop(operation1_, cumulative_metric_kind_);
   iop.MergeOperation(operation2_);
   EXPECT_TRUE(MessageDifferencer::Equals(iop.ToOperationProto(),
                                          cumulateive_merged12_));
 }
 
 TEST_F(OperationAggregatorTest, Delta_MergeOperation1AndOperation2) {
-  OperationAggregator iop(operation1_, &delta_metric_kind_);
+  OperationAggregator iop(operation1_, delta_metric_kind_);
   iop.MergeOperation(operation2_);
   EXPECT_TRUE(
       MessageDifferencer::Equals(iop.ToOperationProto(), delta_merged12_));
 }
 
+TEST_F(OperationAggregatorTest, Delta_ReleaseOperationProto) {
+  OperationAggregator iop(operation1_, delta_metric_kind_);
+  iop.MergeOperation(operation2_);
+  Operation released;
+  iop.ReleaseOperationProto(&released);
+  EXPECT_TRUE(MessageDifferencer::Equals(released, delta_merged12_));
+}
+
+TEST_F(OperationAggregatorTest, Delta_MoveOperation1AndOperation2) {
+  Operation operation1 = operation1_;
+  Operation operation2 = operation2_;
+  OperationAggregator iop(std::move(operation1), delta_metric_kind_);
+  iop.MergeOperation(std::move(operation2));
+
+  EXPECT_TRUE(
+      MessageDifferencer::Equals(iop.ToOperationProto(), delta_merged12_));
+}
+
 TEST_F(OperationAggregatorTest, Delta_MergeOperation2AndOperation1) {
   // Merge order does not matter.
   // log_entries is a repeated field, the order is different if added in
@@ -400,7 +422,7 @@ TEST_F(OperationAggregatorTest, Delta_MergeOperation2AndOperation1) {
   operation1_.clear_log_entries();
   operation2_.clear_log_entries();
   delta_merged12_.clear_log_entries();
-  OperationAggregator iop(operation2_, &delta_metric_kind_);
+  OperationAggregator iop(operation2_, delta_metric_kind_);
   iop.MergeOperation(operation1_);
 
   EXPECT_TRUE(
@@ -409,15 +431,16 @@ TEST_F(OperationAggregatorTest, Delta_MergeOperation2AndOperation1) {
 
 TEST_F(OperationAggregatorTest,
        DefaultMetricKind_MergeOperation1AndOperation2) {
-  std::unordered_map<string, MetricDescriptor::MetricKind> empty_map;
-  OperationAggregator iop(operation1_, &empty_map);
+  MetricKindMap empty_map;
+  OperationAggregator iop(operation1_,
+                          std::make_shared<MetricKindTable>(&empty_map));
   iop.MergeOperation(operation2_);
   EXPECT_TRUE(
       MessageDifferencer::Equals(iop.ToOperationProto(), delta_merged12_));
 }
 
 TEST_F(OperationAggregatorTest, Delta_InconsistentMetricValue) {
-  OperationAggregator iop(operation1_, &delta_metric_kind_);
+  OperationAggregator iop(operation1_, delta_metric_kind_);
   MetricValue* value =
       operation2_.mutable_metric_value_sets(0)->mutable_metric_values(0);
   value->set_double_value(110.0);
@@ -436,7 +459,7 @@ TEST_F(OperationAggregatorTest, Delta_InconsistentMetricValue) {
 
 TEST_F(OperationAggregatorTest, Delta_FirstOperationMissingStartEndTime) {
   ClearStartEndTime(&operation1_);
-  OperationAggregator iop(operation1_, &delta_metric_kind_);
+  OperationAggregator iop(operation1_, delta_metric_kind_);
   iop.MergeOperation(operation2_);
 
   // The merged operation should have the same time as operation2_.
@@ -453,7 +476,7 @@ TEST_F(OperationAggregatorTest, Delta_FirstOperationMissingStartEndTime) {
 
 TEST_F(OperationAggregatorTest, Delta_SecondOperationMissingStartEndTime) {
   ClearStartEndTime(&operation2_);
-  OperationAggregator iop(operation1_, &delta_metric_kind_);
+  OperationAggregator iop(operation1_, delta_metric_kind_);
   iop.MergeOperation(operation2_);
 
   // The merged operation should have the same time as operation1_.
@@ -472,7 +495,7 @@ TEST_F(OperationAggregatorTest, Delta_SecondOperationMissingStartEndTime) {
 TEST_F(OperationAggregatorTest, Delta_BothOperationsMissingStartEndTime) {
   ClearStartEndTime(&operation1_);
   ClearStartEndTime(&operation2_);
-  OperationAggregator iop(operation1_, &delta_metric_kind_);
+  OperationAggregator iop(operation1_, delta_metric_kind_);
   iop.MergeOperation(operation2_);
 
   // The merged operation should have no start and end time.
@@ -486,7 +509,7 @@ TEST_F(OperationAggregatorTest, DeltaMetricKind_DoubleValue) {
   SetDobuleValue(10, &operation1_);
   SetDobuleValue(20, &operation2_);
   SetDobuleValue(30, &delta_merged12_);
-  OperationAggregator iop(operation1_, &delta_metric_kind_);
+  OperationAggregator iop(operation1_, delta_metric_kind_);
   iop.MergeOperation(operation2_);
 
   EXPECT_TRUE(
@@ -503,7 +526,7 @@ TEST_F(OperationAggregatorTest, DeltaMetricKind_DistributionValue) {
   SetDistributionValue(distribution, &operation1_);
   SetDistributionValue(distribution, &operation2_);
   SetDistributionValue(sum, &delta_merged12_);
-  OperationAggregator iop(operation1_, &delta_metric_kind_);
+  OperationAggregator iop(operation1_, delta_metric_kind_);
   iop.MergeOperation(operation2_);
 
   EXPECT_TRUE(
@@ -0,0 +1,243 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "src/periodic_timer_impl.h"
+
+#include <chrono>
+#include <memory>
+#include <queue>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "utils/google_macros.h"
+#include "utils/thread.h"
+
+namespace google {
+namespace service_control_client {
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+// A background thread running periodic timers. Deadlines are kept in a
+// min-heap, so the thread sleeps until exactly the next one.
+class TimerThread {
+ public:
+  // Returns the timer thread shared by all timers, starting it if needed.
+  static std::shared_ptr<TimerThread> Get();
+
+  // Stops the thread. When the last timer is released from its own function,
+  // this runs on the thread itself, which is then detached instead.
+  ~TimerThread();
+
+  // Adds a timer calling func every interval. Returns its id.
+  int64_t Add(Clock::duration interval, std::function<void()> func);
+
+  // Removes a timer. Unless called from func itself, waits for func to
+  // return if it is running.
+  void Remove(int64_t id);
+
+ private:
+  // A periodic timer.
+  struct Timer {
+    Clock::duration interval;
+    std::function<void()> func;
+    Clock::time_point deadline;
+  };
+
+  // A deadline in the heap, with the id of its timer.
+  typedef std::pair<Clock::time_point, int64_t> Deadline;
+
+  TimerThread();
+
+  // The loop of the thread.
+  void Run();
+
+  // Mutex guarding all members below.
+  Mutex mutex_;
+  // Signaled when the earliest deadline changes, when the thread is stopped
+  // and when a timer function returns.
+  CondVar cond_var_;
+  // If true, the thread is being stopped.
+  bool stopping_;
+  // The timers by id.
+  std::unordered_map<int64_t, Timer> timers_;
+  // The deadline of each timer, earliest first. Deadlines of removed timers
+  // are skipped when they reach the top.
+  std::priority_queue<Deadline, std::vector<Deadline>, std::greater<Deadline>>
+      deadlines_;
+  // The id of the next timer.
+  int64_t next_id_;
+  // The id of the timer whose function is running, or 0.
+  int64_t running_id_;
+  // This thread, locked by Run() while a timer function runs so that the
+  // function may release the last reference.
+  std::weak_ptr<TimerThread> self_;
+  // The thread running the timers. Started last.
+  Thread thread_;
+
+  GOOGLE_DISALLOW_EVIL_CONSTRUCTORS(TimerThread);
+};
+
+std::shared_ptr<TimerThread> TimerThread::Get() {
+  static Mutex* mutex = new Mutex;
+  static std::weak_ptr<TimerThread>* instance = new std::weak_ptr<TimerThread>;
+  MutexLock lock(*mutex);
+  std::shared_ptr<TimerThread> timer_thread = instance->lock();
+  if (!timer_thread) {
+    timer_thread.reset(new TimerThread);
+    *instance = timer_thread;
+    MutexLock self_lock(timer_thread->mutex_);
+    timer_thread->self_ = timer_thread;
+  }
+  return timer_thread;
+}
+
+TimerThread::TimerThread()
+    : stopping_(false),
+      next_id_(1),
+      running_id_(0),
+      thread_(&TimerThread::Run, this) {}
+
+TimerThread::~TimerThread() {
+  {
+    MutexLock lock(mutex_);
+    stopping_ = true;
+    cond_var_.notify_all();
+  }
+  if (std::this_thread::get_id() == thread_.get_id()) {
+    thread_.detach();
+  } else {
+    thread_.join();
+  }
+}
+
+int64_t TimerThread::Add(Clock::duration interval,
+                         std::function<void()> func) {
+  MutexLock lock(mutex_);
+  int64_t id = next_id_++;
+  Timer& timer = timers_[id];
+  timer.interval = interval;
+  timer.func = func;
+  timer.deadline = Clock::now() + interval;
+  deadlines_.push(Deadline(timer.deadline, id));
+  cond_var_.notify_all();
+  return id;
+}
+
+void TimerThread::Remove(int64_t id) {
+  MutexLock lock(mutex_);
+  timers_.erase(id);
+  if (std::this_thread::get_id() != thread_.get_id()) {
+    cond_var_.wait(lock, [this, id]() { return running_id_ != id; });
+  }
+}
+
+void TimerThread::Run() {
+  MutexLock lock(mutex_);
+  while (!stopping_) {
+    if (deadlines_.empty()) {
+      cond_var_.wait(lock);
+      continue;
+    }
+    Deadline deadline = deadlines_.top();
+    auto it = timers_.find(deadline.second);
+    if (it == timers_.end()) {
+      deadlines_.pop();
+      continue;
+    }
+    if (Clock::now() < deadline.first) {
+      cond_var_.wait_until(lock, deadline.first);
+      continue;
+    }
+    // Fails only while being destroyed by another thread.
+    std::shared_ptr<TimerThread> self = self_.lock();
+    if (!self) {
+      break;
+    }
+    deadlines_.pop();
+
+    // The timer may be removed while its function runs without the lock.
+    std::function<void()> func = it->second.func;
+    running_id_ = deadline.second;
+    lock.unlock();
+    func();
+    func = nullptr;
+    lock.lock();
+    running_id_ = 0;
+    cond_var_.notify_all();
+
+    it = timers_.find(deadline.second);
+    if (it != timers_.end()) {
+      // Keeps the timer on its original schedule, unless it fell behind.
+      Timer& timer = it->second;
+      timer.deadline += timer.interval;
+      Clock::time_point now = Clock::now();
+      if (timer.deadline < now) {
+        timer.deadline = now + timer.interval;
+      }
+      deadlines_.push(Deadline(timer.deadline, deadline.second));
+    }
+
+    // If func released the last timer, this destroys the thread object, which
+    // must not be touched afterwards.
+    lock.unlock();
+    std::weak_ptr<TimerThread> weak_self = self;
+    self.reset();
+    if (weak_self.expired()) {
+      return;
+    }
+    lock.lock();
+  }
+}
+
+// A PeriodicTimer run by the shared TimerThread.
+class ThreadPeriodicTimer : public PeriodicTimer {
+ public:
+  ThreadPeriodicTimer(int interval_ms, std::function<void()> timer_func)
+      : timer_thread_(TimerThread::Get()), stopped_(false) {
+    id_ = timer_thread_->Add(std::chrono::milliseconds(interval_ms),
+                             timer_func);
+  }
+
+  virtual ~ThreadPeriodicTimer() { Stop(); }
+
+  // Keeps the reference to the thread, as Stop() may be called on it.
+  virtual void Stop() {
+    if (!stopped_) {
+      stopped_ = true;
+      timer_thread_->Remove(id_);
+    }
+  }
+
+ private:
+  // The thread running this timer.
+  std::shared_ptr<TimerThread> timer_thread_;
+  // The id of this timer in timer_thread_.
+  int64_t id_;
+  // If true, the timer has been stopped.
+  bool stopped_;
+};
+
+}  // namespace
+
+std::unique_ptr<PeriodicTimer> CreateThreadPeriodicTimer(
+    int interval_ms, std::function<void()> timer_func) {
+  return std::unique_ptr<PeriodicTimer>(
+      new ThreadPeriodicTimer(interval_ms, timer_func));
+}
+
+}  // namespace service_control_client
+}  // namespace google
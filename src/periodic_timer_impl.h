@@ -0,0 +1,40 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef GOOGLE_SERVICE_CONTROL_CLIENT_PERIODIC_TIMER_IMPL_H_
+#define GOOGLE_SERVICE_CONTROL_CLIENT_PERIODIC_TIMER_IMPL_H_
+
+#include "include/service_control_client.h"
+
+namespace google {
+namespace service_control_client {
+
+// Creates a periodic timer calling timer_func every interval_ms until it is
+// stopped. It is the PeriodicTimerCreateFunc used when none is provided in
+// ServiceControlClientOptions.
+//
+// All such timers are run by one background thread, shared by all clients,
+// which is started with the first timer and exits after the last one is
+// stopped. Timer functions should be fast: a slow one delays the others.
+// Once Stop() returns, timer_func is not running and will not be called
+// again, unless Stop() is called from timer_func itself. The timer must not
+// be destroyed from its own timer_func.
+std::unique_ptr<PeriodicTimer> CreateThreadPeriodicTimer(
+    int interval_ms, std::function<void()> timer_func);
+
+}  // namespace service_control_client
+}  // namespace google
+
+#endif  // GOOGLE_SERVICE_CONTROL_CLIENT_PERIODIC_TIMER_IMPL_H_
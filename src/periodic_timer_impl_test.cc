@@ -0,0 +1,147 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "src/periodic_timer_impl.h"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace google {
+namespace service_control_client {
+namespace {
+
+const int kIntervalMs = 5;
+
+void SleepMs(int ms) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+// Waits up to 10 seconds for count to reach at least min_count.
+bool WaitForCount(const std::atomic<int>& count, int min_count) {
+  for (int i = 0; i < 10000 && count < min_count; ++i) {
+    SleepMs(1);
+  }
+  return count >= min_count;
+}
+
+}  // namespace
+
+TEST(PeriodicTimerImplTest, TestFiresRepeatedly) {
+  std::atomic<int> count(0);
+  std::unique_ptr<PeriodicTimer> timer =
+      CreateThreadPeriodicTimer(kIntervalMs, [&count]() { ++count; });
+  EXPECT_TRUE(WaitForCount(count, 3));
+  timer->Stop();
+}
+
+TEST(PeriodicTimerImplTest, TestNotCalledAfterStop) {
+  std::atomic<int> count(0);
+  std::unique_ptr<PeriodicTimer> timer =
+      CreateThreadPeriodicTimer(kIntervalMs, [&count]() {
+        SleepMs(1);
+        ++count;
+      });
+  EXPECT_TRUE(WaitForCount(count, 1));
+  timer->Stop();
+  int stopped_count = count;
+  SleepMs(5 * kIntervalMs);
+  EXPECT_EQ(stopped_count, count);
+}
+
+TEST(PeriodicTimerImplTest, TestDestroyWithoutStop) {
+  std::atomic<int> count(0);
+  {
+    std::unique_ptr<PeriodicTimer> timer =
+        CreateThreadPeriodicTimer(kIntervalMs, [&count]() { ++count; });
+    EXPECT_TRUE(WaitForCount(count, 1));
+  }
+  int stopped_count = count;
+  SleepMs(5 * kIntervalMs);
+  EXPECT_EQ(stopped_count, count);
+}
+
+TEST(PeriodicTimerImplTest, TestStopFromTimerFunction) {
+  std::atomic<int> count(0);
+  std::unique_ptr<PeriodicTimer> timer;
+  PeriodicTimer* timer_ptr = nullptr;
+  std::atomic<bool> started(false);
+  timer = CreateThreadPeriodicTimer(kIntervalMs, [&]() {
+    while (!started) {
+      SleepMs(1);
+    }
+    timer_ptr->Stop();
+    ++count;
+  });
+  timer_ptr = timer.get();
+  started = true;
+  EXPECT_TRUE(WaitForCount(count, 1));
+  SleepMs(5 * kIntervalMs);
+  EXPECT_EQ(1, count);
+  timer.reset();
+}
+
+TEST(PeriodicTimerImplTest, TestDestroyFromTimerFunction) {
+  std::atomic<int> count(0);
+  std::unique_ptr<PeriodicTimer> timer;
+  std::atomic<bool> started(false);
+  timer = CreateThreadPeriodicTimer(kIntervalMs, [&]() {
+    while (!started) {
+      SleepMs(1);
+    }
+    // Releases the only timer, and so the timer thread, from the thread.
+    timer.reset();
+    ++count;
+  });
+  started = true;
+  EXPECT_TRUE(WaitForCount(count, 1));
+  SleepMs(5 * kIntervalMs);
+  EXPECT_EQ(1, count);
+
+  // A new timer starts a new thread.
+  std::atomic<int> new_count(0);
+  std::unique_ptr<PeriodicTimer> new_timer =
+      CreateThreadPeriodicTimer(kIntervalMs, [&new_count]() { ++new_count; });
+  EXPECT_TRUE(WaitForCount(new_count, 2));
+  new_timer->Stop();
+}
+
+TEST(PeriodicTimerImplTest, TestManyTimers) {
+  const int kNumTimers = 200;
+  std::vector<std::atomic<int>> counts(kNumTimers);
+  std::vector<std::unique_ptr<PeriodicTimer>> timers;
+  for (int i = 0; i < kNumTimers; ++i) {
+    counts[i] = 0;
+    std::atomic<int>* count = &counts[i];
+    timers.push_back(CreateThreadPeriodicTimer(kIntervalMs + i % 10,
+                                               [count]() { ++*count; }));
+  }
+  for (int i = 0; i < kNumTimers; ++i) {
+    EXPECT_TRUE(WaitForCount(counts[i], 2));
+  }
+  // Stops half of them, the others keep firing.
+  for (int i = 0; i < kNumTimers; i += 2) {
+    timers[i]->Stop();
+  }
+  int last_count = counts[1];
+  EXPECT_TRUE(WaitForCount(counts[1], last_count + 2));
+  timers.clear();
+}
+
+}  // namespace service_control_client
+}  // namespace google
@@ -16,6 +16,9 @@ limitations under the License.
 #include "src/report_aggregator_impl.h"
 #include "src/signature.h"
 
+#include <algorithm>
+
+#include "google/protobuf/io/coded_stream.h"
 #include "google/protobuf/stubs/logging.h"
 
 using std::string;
@@ -23,6 +26,7 @@ using ::google::api::MetricDescriptor;
 using ::google::api::servicecontrol::v1::Operation;
 using ::google::api::servicecontrol::v1::ReportRequest;
 using ::google::api::servicecontrol::v1::ReportResponse;
+using ::google::protobuf::io::CodedOutputStream;
 using ::google::protobuf::util::Status;
 using ::google::protobuf::util::error::Code;
 
@@ -30,19 +34,36 @@ namespace google {
 namespace service_control_client {
 namespace {
 
-// Service control server limits each report data size to 1MB.
-// Roughly, each operation may have up to 50KB based on maximum of 100
-// aggregated logEntries (each log entry is about 500 bytes).
-const int kMaxOperationsToSend = 10;
+// Returns the number of bytes the operations of the given report request
+// add to a report request they are merged into.
+int64_t OperationsByteSize(const ReportRequest& request) {
+  int64_t bytes = 0;
+  for (const auto& operation : request.operations()) {
+    int size = operation.ByteSize();
+    // The operations field has a one byte tag, then the varint size.
+    bytes += 1 + CodedOutputStream::VarintSize32(size) + size;
+  }
+  return bytes;
+}
 
-// Returns whether the given report request has high value operations.
-bool HasHighImportantOperation(const ReportRequest& request) {
+// Returns whether the given report request only has low value operations.
+bool HasOnlyLowImportantOperations(const ReportRequest& request) {
   for (const auto& operation : request.operations()) {
     if (operation.importance() != Operation::LOW) {
-      return true;
+      return false;
+    }
+  }
+  return true;
+}
+
+// Returns whether the given report request only has high value operations.
+bool HasOnlyHighImportantOperations(const ReportRequest& request) {
+  for (const auto& operation : request.operations()) {
+    if (operation.importance() == Operation::LOW) {
+      return false;
     }
   }
-  return false;
+  return request.operations_size() > 0;
 }
 
 }  // namespace
@@ -54,21 +75,43 @@ ReportAggregatorImpl::ReportAggregatorImpl(
     : service_name_(service_name),
       service_config_id_(service_config_id),
       options_(options),
-      metric_kinds_(metric_kinds) {
+      metric_kinds_(metric_kinds.get()),
+      id_(next_id_++),
+      queue_depth_(0),
+      dropped_reports_(0),
+      queue_thread_waiting_(false),
+      queue_full_waiters_(0),
+      queue_stopping_(false) {
   if (options.num_entries > 0) {
     cache_.reset(
         new ReportCache(options.num_entries,
                         std::bind(&ReportAggregatorImpl::OnCacheEntryDelete,
                                   this, std::placeholders::_1)));
     cache_->SetAgeBasedEviction(options.flush_interval_ms / 1000.0);
+
+    if (options.queue_size > 0) {
+      queue_.reset(new ReportQueue(options.queue_size));
+      queue_thread_ = Thread(&ReportAggregatorImpl::RunQueue, this);
+    }
   }
 }
 
+std::atomic<int64_t> ReportAggregatorImpl::next_id_(0);
+
 ReportAggregatorImpl::~ReportAggregatorImpl() {
   // FlushAll() is a blocking call to remove all cache items.
   // For each removed item, it will call flush_callback().
   // At the destructor, it is better not to call the callback.
   SetFlushCallback(NULL);
+  if (queue_) {
+    {
+      MutexLock lock(queue_mutex_);
+      queue_stopping_ = true;
+      queue_cond_var_.notify_all();
+    }
+    // The queue thread aggregates all queued requests before exiting.
+    queue_thread_.join();
+  }
   FlushAll();
 }
 
@@ -80,15 +123,63 @@ void ReportAggregatorImpl::SetFlushCallback(FlushCallback callback) {
 // Add a report request to cache
 Status ReportAggregatorImpl::Report(
     const ::google::api::servicecontrol::v1::ReportRequest& request) {
+  return Report(request, nullptr, nullptr);
+}
+
+// Add a report request to cache, moving its operations out when accepted.
+Status ReportAggregatorImpl::Report(
+    ::google::api::servicecontrol::v1::ReportRequest&& request) {
+  return Report(request, &request, nullptr);
+}
+
+// Add the low important operations of a report request to cache.
+Status ReportAggregatorImpl::Report(const ReportRequest& request,
+                                    ReportRequest* high_request) {
+  return Report(request, nullptr, high_request);
+}
+
+// Same as above, moving the operations out when accepted.
+Status ReportAggregatorImpl::Report(ReportRequest&& request,
+                                    ReportRequest* high_request) {
+  return Report(request, &request, high_request);
+}
+
+Status ReportAggregatorImpl::Report(const ReportRequest& request,
+                                    ReportRequest* movable_request,
+                                    ReportRequest* high_request) {
   if (request.service_name() != service_name_) {
     return Status(Code::INVALID_ARGUMENT,
                   (string("Invalid service name: ") + request.service_name() +
                    string(" Expecting: ") + service_name_));
   }
-  if (HasHighImportantOperation(request) || !cache_) {
+  if (HasOnlyHighImportantOperations(request) || !cache_) {
     // By returning NO_FOUND, caller will send request to server.
     return Status(Code::NOT_FOUND, "");
   }
+  if (!HasOnlyLowImportantOperations(request)) {
+    if (!high_request) {
+      return Status(Code::NOT_FOUND, "");
+    }
+    // High important operations are handed back to the caller, so that they
+    // are sent right away with its transport, and it gets their status.
+    ReportRequest low_request;
+    SplitByImportance(request, movable_request, &low_request, high_request);
+    if (queue_) {
+      return Enqueue(low_request, &low_request);
+    }
+    return Aggregate(low_request, &low_request);
+  }
+  if (queue_) {
+    return Enqueue(request, movable_request);
+  }
+  return Aggregate(request, movable_request);
+}
+
+Status ReportAggregatorImpl::Aggregate(const ReportRequest& request,
+                                       ReportRequest* movable_request) {
+  if (options_.thread_buffer_entries > 0) {
+    return ReportToThreadBuffer(request, movable_request);
+  }
 
   ReportCacheRemovedItemsHandler::StackBuffer stack_buffer(this);
   MutexLock lock(cache_mutex_);
@@ -96,18 +187,30 @@ Status ReportAggregatorImpl::Report(
                                                                &stack_buffer);
 
   // Starts to cache and aggregate low important operations.
-  for (const auto& operation : request.operations()) {
-    string signature = GenerateReportOperationSignature(operation);
+  for (int i = 0; i < request.operations_size(); ++i) {
+    const Operation& operation = request.operations(i);
+    Operation* movable_operation =
+        movable_request ? movable_request->mutable_operations(i) : nullptr;
+
+    // The signature has to be computed before the operation is moved.
+    Signature signature = GenerateReportOperationSignature(operation);
 
     bool too_big = false;
     {
       ReportCache::ScopedLookup lookup(cache_.get(), signature);
       if (lookup.Found()) {
-        lookup.value()->MergeOperation(operation);
+        if (movable_operation) {
+          lookup.value()->MergeOperation(std::move(*movable_operation));
+        } else {
+          lookup.value()->MergeOperation(operation);
+        }
         too_big = lookup.value()->TooBig();
       } else {
         OperationAggregator* iop =
-            new OperationAggregator(operation, metric_kinds_.get());
+            movable_operation
+                ? new OperationAggregator(std::move(*movable_operation),
+                                          metric_kinds_.Get())
+                : new OperationAggregator(operation, metric_kinds_.Get());
         cache_->Insert(signature, iop, 1);
       }
     }
@@ -120,29 +223,330 @@ Status ReportAggregatorImpl::Report(
   return Status::OK;
 }
 
+Status ReportAggregatorImpl::Enqueue(const ReportRequest& request,
+                                     ReportRequest* movable_request) {
+  std::unique_ptr<ReportRequest> queued(new ReportRequest);
+  if (movable_request) {
+    queued->Swap(movable_request);
+  } else {
+    *queued = request;
+  }
+  // Counted before the push so the queue thread never sees it negative.
+  ++queue_depth_;
+  if (!queue_->Push(std::move(queued))) {
+    switch (options_.queue_full_policy) {
+      case ReportQueueFullPolicy::BLOCK: {
+        MutexLock lock(queue_mutex_);
+        ++queue_full_waiters_;
+        // Pairs with the fence in RunQueue() so that either the push below
+        // sees the slot freed by the queue thread, or it sees this waiting.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        queue_not_full_cond_var_.wait(lock, [this, &queued]() {
+          return queue_->Push(std::move(queued));
+        });
+        --queue_full_waiters_;
+        break;
+      }
+      case ReportQueueFullPolicy::DROP_LOW_IMPORTANCE:
+        // Only low important operations are queued.
+        ++dropped_reports_;
+        DecrementQueueDepth();
+        return Status::OK;
+      case ReportQueueFullPolicy::SYNCHRONOUS: {
+        Status status = Aggregate(*queued, queued.get());
+        DecrementQueueDepth();
+        return status;
+      }
+    }
+  }
+  WakeUpQueueThread();
+  return Status::OK;
+}
+
+void ReportAggregatorImpl::WakeUpQueueThread() {
+  // Pairs with the fence in RunQueue() so that either the queue thread sees
+  // the pushed request, or this sees it waiting.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (queue_thread_waiting_.load(std::memory_order_relaxed)) {
+    MutexLock lock(queue_mutex_);
+    queue_cond_var_.notify_all();
+  }
+}
+
+void ReportAggregatorImpl::DecrementQueueDepth() {
+  if (--queue_depth_ == 0) {
+    // Wakes up FlushAll() calls waiting for the queue to drain.
+    MutexLock lock(queue_mutex_);
+    queue_cond_var_.notify_all();
+  }
+}
+
+void ReportAggregatorImpl::RunQueue() {
+  std::unique_ptr<ReportRequest> request;
+  for (;;) {
+    while (queue_->Pop(&request)) {
+      // Pairs with the fence in Enqueue() so that either a thread blocked on
+      // the full queue sees the freed slot, or this sees it waiting.
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (queue_full_waiters_.load(std::memory_order_relaxed) > 0) {
+        MutexLock lock(queue_mutex_);
+        queue_not_full_cond_var_.notify_all();
+      }
+      Status status = Aggregate(*request, request.get());
+      if (!status.ok()) {
+        GOOGLE_LOG(ERROR) << "Failed to aggregate a queued report request: "
+                          << status.error_message();
+      }
+      request.reset();
+      DecrementQueueDepth();
+    }
+
+    MutexLock lock(queue_mutex_);
+    queue_thread_waiting_.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    while (queue_->Empty() && !queue_stopping_) {
+      queue_cond_var_.wait(lock);
+    }
+    queue_thread_waiting_.store(false, std::memory_order_relaxed);
+    if (queue_->Empty() && queue_stopping_) {
+      return;
+    }
+  }
+}
+
+void ReportAggregatorImpl::WaitForQueueToDrain() {
+  if (!queue_ || std::this_thread::get_id() == queue_thread_.get_id()) {
+    return;
+  }
+  MutexLock lock(queue_mutex_);
+  queue_cond_var_.wait(lock, [this]() { return queue_depth_ == 0; });
+}
+
+void ReportAggregatorImpl::GetQueueStatistics(uint64_t* queue_depth,
+                                              uint64_t* dropped_reports) {
+  *queue_depth = queue_depth_;
+  *dropped_reports = dropped_reports_;
+}
+
+void ReportAggregatorImpl::SetMetricKinds(
+    std::shared_ptr<MetricKindMap> metric_kinds) {
+  metric_kinds_.Rebuild(metric_kinds.get());
+}
+
+Status ReportAggregatorImpl::ReportToThreadBuffer(
+    const ReportRequest& request, ReportRequest* movable_request) {
+  ThreadBuffer* buffer = GetThreadBuffer();
+  OperationMap full_operations;
+  {
+    MutexLock lock(buffer->mutex);
+    bool too_big = false;
+    for (int i = 0; i < request.operations_size(); ++i) {
+      const Operation& operation = request.operations(i);
+      Operation* movable_operation =
+          movable_request ? movable_request->mutable_operations(i) : nullptr;
+      std::unique_ptr<OperationAggregator>& iop =
+          buffer->operations[GenerateReportOperationSignature(operation)];
+      if (iop && movable_operation) {
+        iop->MergeOperation(std::move(*movable_operation));
+        too_big = too_big || iop->TooBig();
+      } else if (iop) {
+        iop->MergeOperation(operation);
+        too_big = too_big || iop->TooBig();
+      } else if (movable_operation) {
+        iop.reset(new OperationAggregator(std::move(*movable_operation),
+                                          metric_kinds_.Get()));
+      } else {
+        iop.reset(new OperationAggregator(operation, metric_kinds_.Get()));
+      }
+    }
+    if (too_big || buffer->operations.size() >=
+                       static_cast<size_t>(options_.thread_buffer_entries)) {
+      full_operations.swap(buffer->operations);
+    }
+  }
+  if (full_operations.empty()) {
+    return Status::OK;
+  }
+
+  ReportCacheRemovedItemsHandler::StackBuffer stack_buffer(this);
+  MutexLock lock(cache_mutex_);
+  ReportCacheRemovedItemsHandler::StackBuffer::Swapper swapper(this,
+                                                               &stack_buffer);
+  MergeIntoCache(&full_operations);
+  return Status::OK;
+}
+
+ReportAggregatorImpl::ThreadBuffer* ReportAggregatorImpl::GetThreadBuffer() {
+  // The buffers of the current thread, by aggregator id.
+  static thread_local std::unordered_map<int64_t, std::shared_ptr<ThreadBuffer>>
+      thread_buffers;
+  std::shared_ptr<ThreadBuffer>& buffer = thread_buffers[id_];
+  if (!buffer) {
+    // Forgets the buffers of the aggregators deleted since.
+    for (auto it = thread_buffers.begin(); it != thread_buffers.end();) {
+      if (it->second && it->second.use_count() == 1) {
+        it = thread_buffers.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    buffer = std::make_shared<ThreadBuffer>();
+    MutexLock lock(thread_buffers_mutex_);
+    thread_buffers_.push_back(buffer);
+  }
+  return buffer.get();
+}
+
+std::vector<ReportAggregatorImpl::OperationMap>
+ReportAggregatorImpl::TakeThreadBufferedOperations() {
+  std::vector<OperationMap> operations;
+  MutexLock lock(thread_buffers_mutex_);
+  for (auto it = thread_buffers_.begin(); it != thread_buffers_.end();) {
+    ThreadBuffer* buffer = it->get();
+    {
+      MutexLock buffer_lock(buffer->mutex);
+      if (!buffer->operations.empty()) {
+        operations.push_back(OperationMap());
+        operations.back().swap(buffer->operations);
+      }
+    }
+    // The thread of a buffer only referenced here has exited.
+    if (it->use_count() == 1) {
+      it = thread_buffers_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  return operations;
+}
+
+void ReportAggregatorImpl::MergeIntoCache(OperationMap* operations) {
+  for (auto& it : *operations) {
+    const Signature& signature = it.first;
+    bool too_big = false;
+    {
+      ReportCache::ScopedLookup lookup(cache_.get(), signature);
+      if (lookup.Found()) {
+        Operation operation;
+        it.second->ReleaseOperationProto(&operation);
+        lookup.value()->MergeOperation(std::move(operation));
+        too_big = lookup.value()->TooBig();
+      } else {
+        too_big = it.second->TooBig();
+        cache_->Insert(signature, it.second.release(), 1);
+      }
+    }
+    if (too_big) {
+      cache_->Remove(signature);
+    }
+  }
+  operations->clear();
+}
+
+void ReportAggregatorImpl::SplitByImportance(const ReportRequest& request,
+                                             ReportRequest* movable_request,
+                                             ReportRequest* low_request,
+                                             ReportRequest* high_request) {
+  low_request->set_service_name(request.service_name());
+  low_request->set_service_config_id(request.service_config_id());
+  high_request->set_service_name(request.service_name());
+  high_request->set_service_config_id(request.service_config_id());
+  for (int i = 0; i < request.operations_size(); ++i) {
+    const Operation& operation = request.operations(i);
+    ReportRequest* target =
+        operation.importance() == Operation::LOW ? low_request : high_request;
+    if (movable_request) {
+      target->add_operations()->Swap(movable_request->mutable_operations(i));
+    } else {
+      *target->add_operations() = operation;
+    }
+  }
+}
+
 void ReportAggregatorImpl::OnCacheEntryDelete(OperationAggregator* iop) {
   // iop or cache is under projected.  This function is only called when
   // cache::Insert() or cache::Removed() is called and these operations
   // are already protected by cache_mutex.
-  ReportRequest request;
-  request.set_service_name(service_name_);
-  request.set_service_config_id(service_config_id_);
-  // TODO(qiwzhang): Remove this copy
-  *(request.add_operations()) = iop->ToOperationProto();
+  std::unique_ptr<ReportRequest> request(new ReportRequest);
+  request->set_service_name(service_name_);
+  request->set_service_config_id(service_config_id_);
+  iop->ReleaseOperationProto(request->add_operations());
   delete iop;
 
-  AddRemovedItem(request);
+  AddRemovedItem(std::move(request));
 }
 
-bool ReportAggregatorImpl::MergeItem(const ReportRequest& new_item,
-                                     ReportRequest* old_item) {
-  if (old_item->service_name() != new_item.service_name() ||
-      old_item->operations().size() + new_item.operations().size() >
-          kMaxOperationsToSend) {
-    return false;
+void ReportAggregatorImpl::MergeItems(
+    std::vector<std::unique_ptr<ReportRequest>>* items) {
+  // A request to pack, with the bytes its operations add to a request.
+  struct Item {
+    ReportRequest* request;
+    size_t index;
+    int64_t bytes;
+  };
+  std::vector<Item> sorted;
+  sorted.reserve(items->size());
+  for (size_t i = 0; i < items->size(); ++i) {
+    ReportRequest* request = (*items)[i].get();
+    sorted.push_back({request, i, OperationsByteSize(*request)});
   }
-  old_item->MergeFrom(new_item);
-  return true;
+  // Groups requests by service, largest first in each group.
+  std::stable_sort(sorted.begin(), sorted.end(),
+                   [](const Item& a, const Item& b) {
+                     if (a.request->service_name() !=
+                         b.request->service_name()) {
+                       return a.request->service_name() <
+                              b.request->service_name();
+                     }
+                     if (a.request->service_config_id() !=
+                         b.request->service_config_id()) {
+                       return a.request->service_config_id() <
+                              b.request->service_config_id();
+                     }
+                     return a.bytes > b.bytes;
+                   });
+
+  // A request the following ones of its group are packed into, with its
+  // size.
+  struct Bin {
+    const Item* item;
+    int64_t bytes;
+  };
+  std::vector<std::unique_ptr<ReportRequest>> packed;
+  std::vector<Bin> bins;
+  for (size_t i = 0; i < sorted.size(); ++i) {
+    const Item& item = sorted[i];
+    // Puts the request in the first bin of its group with room for it.
+    Bin* bin = nullptr;
+    for (auto& candidate : bins) {
+      if (candidate.bytes + item.bytes <= options_.max_request_bytes) {
+        bin = &candidate;
+        break;
+      }
+    }
+    if (bin == nullptr) {
+      bins.push_back({&item, item.request->ByteSize()});
+    } else {
+      for (auto& operation : *item.request->mutable_operations()) {
+        bin->item->request->add_operations()->Swap(&operation);
+      }
+      bin->bytes += item.bytes;
+    }
+
+    // Moves the bins out at the end of each group. The other requests of the
+    // group are empty now.
+    if (i + 1 == sorted.size() ||
+        sorted[i + 1].request->service_name() !=
+            item.request->service_name() ||
+        sorted[i + 1].request->service_config_id() !=
+            item.request->service_config_id()) {
+      for (const auto& full_bin : bins) {
+        packed.push_back(std::move((*items)[full_bin.item->index]));
+      }
+      bins.clear();
+    }
+  }
+  items->swap(packed);
 }
 
 // When the next Flush() should be called.
@@ -155,11 +559,15 @@ int ReportAggregatorImpl::GetNextFlushInterval() {
 // Flush aggregated requests whom are longer than flush_interval.
 // Called at time specified by GetNextFlushInterval().
 Status ReportAggregatorImpl::Flush() {
+  std::vector<OperationMap> buffered = TakeThreadBufferedOperations();
   ReportCacheRemovedItemsHandler::StackBuffer stack_buffer(this);
   MutexLock lock(cache_mutex_);
   ReportCacheRemovedItemsHandler::StackBuffer::Swapper swapper(this,
                                                                &stack_buffer);
   if (cache_) {
+    for (auto& operations : buffered) {
+      MergeIntoCache(&operations);
+    }
     cache_->RemoveExpiredEntries();
   }
   return Status::OK;
@@ -168,12 +576,17 @@ Status ReportAggregatorImpl::Flush() {
 // Flush out aggregated report requests, clear all cache items.
 // Usually called at destructor.
 Status ReportAggregatorImpl::FlushAll() {
+  WaitForQueueToDrain();
+  std::vector<OperationMap> buffered = TakeThreadBufferedOperations();
   ReportCacheRemovedItemsHandler::StackBuffer stack_buffer(this);
   MutexLock lock(cache_mutex_);
   ReportCacheRemovedItemsHandler::StackBuffer::Swapper swapper(this,
                                                                &stack_buffer);
   GOOGLE_LOG(INFO) << "Remove all entries of report aggregator.";
   if (cache_) {
+    for (auto& operations : buffered) {
+      MergeIntoCache(&operations);
+    }
     cache_->RemoveAll();
   }
   return Status::OK;
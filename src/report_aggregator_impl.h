@@ -18,16 +18,22 @@ limitations under the License.
 #ifndef GOOGLE_SERVICE_CONTROL_CLIENT_REPORT_AGGREGATOR_IMPL_H_
 #define GOOGLE_SERVICE_CONTROL_CLIENT_REPORT_AGGREGATOR_IMPL_H_
 
+#include <atomic>
+#include <memory>
 #include <string>
 #include <unordered_map>
 #include <utility>
+#include <vector>
 
 #include "google/api/metric.pb.h"
 #include "google/api/servicecontrol/v1/operation.pb.h"
 #include "google/api/servicecontrol/v1/service_controller.pb.h"
 #include "src/aggregator_interface.h"
 #include "src/cache_removed_items_handler.h"
+#include "src/metric_kind_table.h"
 #include "src/operation_aggregator.h"
+#include "src/signature.h"
+#include "utils/mpsc_queue.h"
 #include "utils/simple_lru_cache.h"
 #include "utils/simple_lru_cache_inl.h"
 #include "utils/thread.h"
@@ -56,10 +62,27 @@ class ReportAggregatorImpl : public ReportAggregator,
   virtual void SetFlushCallback(FlushCallback callback);
 
   // Adds a report request to cache. Returns NOT_FOUND if it could not be
-  // aggregated. Callers need to send it to the server.
+  // aggregated. Callers need to send it to the server. That is the case when
+  // any of its operations is of high importance.
   virtual ::google::protobuf::util::Status Report(
       const ::google::api::servicecontrol::v1::ReportRequest& request);
 
+  // Same as above, but moves the operations out of the request instead of
+  // copying them. The request is left untouched unless OK is returned.
+  virtual ::google::protobuf::util::Status Report(
+      ::google::api::servicecontrol::v1::ReportRequest&& request);
+
+  // Same as above, but when high importance operations are mixed with low
+  // importance ones, only the latter are aggregated. The others are added to
+  // high_request, for callers to send to the server along with their status.
+  // NOT_FOUND is still returned when all operations are of high importance.
+  virtual ::google::protobuf::util::Status Report(
+      const ::google::api::servicecontrol::v1::ReportRequest& request,
+      ::google::api::servicecontrol::v1::ReportRequest* high_request);
+  virtual ::google::protobuf::util::Status Report(
+      ::google::api::servicecontrol::v1::ReportRequest&& request,
+      ::google::api::servicecontrol::v1::ReportRequest* high_request);
+
   // When the next Flush() should be called.
   // Returns in ms from now, or -1 for never
   virtual int GetNextFlushInterval();
@@ -74,21 +97,107 @@ class ReportAggregatorImpl : public ReportAggregator,
   // the flush_callback() function return.
   virtual ::google::protobuf::util::Status FlushAll();
 
+  // Gets the number of report requests queued and dropped.
+  virtual void GetQueueStatistics(uint64_t* queue_depth,
+                                  uint64_t* dropped_reports);
+
+  // Replaces the metric kinds.
+  virtual void SetMetricKinds(std::shared_ptr<MetricKindMap> metric_kinds);
+
  private:
   using CacheDeleter = std::function<void(OperationAggregator*)>;
   // Key is the signature of the operation. Value is the
   // OperationAggregator.
   using ReportCache =
-      SimpleLRUCacheWithDeleter<std::string, OperationAggregator, CacheDeleter>;
+      SimpleLRUCacheWithDeleter<Signature, OperationAggregator, CacheDeleter>;
+
+  // The queue of report requests to aggregate.
+  using ReportQueue = BoundedMpscQueue<
+      std::unique_ptr<::google::api::servicecontrol::v1::ReportRequest>>;
+
+  // Adds a report request to cache. If movable_request is not null, it is
+  // the same request and its operations are moved out instead of copied.
+  // Mixed requests are not aggregated if high_request is null.
+  ::google::protobuf::util::Status Report(
+      const ::google::api::servicecontrol::v1::ReportRequest& request,
+      ::google::api::servicecontrol::v1::ReportRequest* movable_request,
+      ::google::api::servicecontrol::v1::ReportRequest* high_request);
+
+  // Aggregates the operations of a report request, all of low importance.
+  // Moves them out of movable_request if not null.
+  ::google::protobuf::util::Status Aggregate(
+      const ::google::api::servicecontrol::v1::ReportRequest& request,
+      ::google::api::servicecontrol::v1::ReportRequest* movable_request);
+
+  // Queues a report request for queue_thread_ to aggregate, applying
+  // options_.queue_full_policy if the queue is full. The request is swapped
+  // out of movable_request if not null.
+  ::google::protobuf::util::Status Enqueue(
+      const ::google::api::servicecontrol::v1::ReportRequest& request,
+      ::google::api::servicecontrol::v1::ReportRequest* movable_request);
+
+  // Wakes up queue_thread_ if it waits for requests.
+  void WakeUpQueueThread();
+
+  // Decrements queue_depth_, waking up WaitForQueueToDrain() calls when it
+  // drops to 0.
+  void DecrementQueueDepth();
+
+  // The loop of queue_thread_, aggregating queued requests until stopped.
+  void RunQueue();
+
+  // Waits until all queued requests are aggregated, unless called from
+  // queue_thread_.
+  void WaitForQueueToDrain();
+
+  // Operations aggregated by one thread, by signature.
+  using OperationMap =
+      std::unordered_map<Signature, std::unique_ptr<OperationAggregator>>;
+
+  // The operations aggregated by one thread before they are merged into
+  // cache_. Only the thread and flushes access it, so its mutex is rarely
+  // contended.
+  struct ThreadBuffer {
+    Mutex mutex;
+    OperationMap operations;
+  };
+
+  // Aggregates the operations of a report request in the buffer of the
+  // current thread, merging it into cache_ once it is full.
+  ::google::protobuf::util::Status ReportToThreadBuffer(
+      const ::google::api::servicecontrol::v1::ReportRequest& request,
+      ::google::api::servicecontrol::v1::ReportRequest* movable_request);
+
+  // Returns the buffer of the current thread, creating it if needed.
+  ThreadBuffer* GetThreadBuffer();
+
+  // Empties all the thread buffers, returning their operations.
+  std::vector<OperationMap> TakeThreadBufferedOperations();
+
+  // Merges operations into cache_ and clears them. Called with cache_mutex_
+  // held.
+  void MergeIntoCache(OperationMap* operations);
+
+  // Adds the low important operations of a report request to low_request,
+  // and the others to high_request. The operations are swapped out of
+  // movable_request if not null.
+  void SplitByImportance(
+      const ::google::api::servicecontrol::v1::ReportRequest& request,
+      ::google::api::servicecontrol::v1::ReportRequest* movable_request,
+      ::google::api::servicecontrol::v1::ReportRequest* low_request,
+      ::google::api::servicecontrol::v1::ReportRequest* high_request);
 
   // Callback function passed to Cache, called when a cache item is removed.
   // Takes ownership of the iop.
   void OnCacheEntryDelete(OperationAggregator* iop);
 
-  // Tries to merge two report requests.
-  bool MergeItem(
-      const ::google::api::servicecontrol::v1::ReportRequest& new_item,
-      ::google::api::servicecontrol::v1::ReportRequest* old_item);
+  // Packs report requests with the same service name and config id into as
+  // few requests of at most options_.max_request_bytes as possible, with the
+  // first-fit decreasing heuristic. Operations of a request stay together.
+  void MergeItems(
+      std::vector<
+          std::unique_ptr<::google::api::servicecontrol::v1::ReportRequest>>*
+          items);
 
   // The service name.
   const std::string service_name_;
@@ -97,9 +206,9 @@ class ReportAggregatorImpl : public ReportAggregator,
 
   ReportAggregationOptions options_;
 
-  // Metric kinds. Key is the metric name and value is the metric kind.
-  // Defaults to DELTA if not specified. Not owned.
-  std::shared_ptr<MetricKindMap> metric_kinds_;
+  // Metric kinds, compiled from the metric kind map. Defaults to DELTA if
+  // not specified.
+  AtomicMetricKindTable metric_kinds_;
 
   // Mutex guarding the access of cache_;
   Mutex cache_mutex_;
@@ -110,6 +219,39 @@ class ReportAggregatorImpl : public ReportAggregator,
   // Guarded by mutex_, except when compare against nullptr.
   std::unique_ptr<ReportCache> cache_;
 
+  // The id of this aggregator, keying the buffers of each thread.
+  const int64_t id_;
+  // The id of the next aggregator.
+  static std::atomic<int64_t> next_id_;
+
+  // Mutex guarding the access of thread_buffers_.
+  Mutex thread_buffers_mutex_;
+  // The buffers of the threads which reported to this aggregator, if
+  // options_.thread_buffer_entries > 0.
+  std::vector<std::shared_ptr<ThreadBuffer>> thread_buffers_;
+
+  // The report requests to aggregate, if options_.queue_size > 0.
+  std::unique_ptr<ReportQueue> queue_;
+  // The number of requests pushed to queue_ and not aggregated yet.
+  std::atomic<int64_t> queue_depth_;
+  // The number of requests dropped because queue_ was full.
+  std::atomic<uint64_t> dropped_reports_;
+  // If true, queue_thread_ may be waiting on queue_cond_var_.
+  std::atomic<bool> queue_thread_waiting_;
+  // The number of threads which may be waiting on queue_not_full_cond_var_.
+  std::atomic<int> queue_full_waiters_;
+  // Mutex guarding queue_stopping_ and waits on the condition variables.
+  Mutex queue_mutex_;
+  // Signaled when requests are queued, when queue_depth_ drops to 0, and
+  // when queue_thread_ is stopped.
+  CondVar queue_cond_var_;
+  // Signaled when queue_thread_ pops a request, if queue_full_waiters_ > 0.
+  CondVar queue_not_full_cond_var_;
+  // If true, queue_thread_ exits once queue_ is empty.
+  bool queue_stopping_;
+  // The thread aggregating queued requests.
+  Thread queue_thread_;
+
   GOOGLE_DISALLOW_EVIL_CONSTRUCTORS(ReportAggregatorImpl);
 };
 
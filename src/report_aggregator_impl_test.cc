@@ -255,6 +255,56 @@ TEST_F(ReportAggregatorImplTest, TestAddOperation12) {
   EXPECT_TRUE(MessageDifferencer::Equals(flushed_[0], delta_merged12_));
 }
 
+TEST_F(ReportAggregatorImplTest, TestMoveOperation12) {
+  EXPECT_OK(aggregator_->Report(std::move(request1_)));
+  EXPECT_OK(aggregator_->Report(std::move(request2_)));
+  // Item cached, not flushed out
+  EXPECT_EQ(flushed_.size(), 0);
+
+  EXPECT_OK(aggregator_->FlushAll());
+  EXPECT_EQ(flushed_.size(), 1);
+  EXPECT_TRUE(MessageDifferencer::Equals(flushed_[0], delta_merged12_));
+}
+
+TEST_F(ReportAggregatorImplTest, TestMoveKeepsNotAggregatedRequest) {
+  ReportRequest request = request1_;
+  request.mutable_operations(0)->set_importance(Operation::HIGH);
+  ReportRequest expected = request;
+  EXPECT_ERROR_CODE(Code::NOT_FOUND, aggregator_->Report(std::move(request)));
+  // The caller still has to send it.
+  EXPECT_TRUE(MessageDifferencer::Equals(request, expected));
+}
+
+TEST_F(ReportAggregatorImplTest, TestSetMetricKinds) {
+  // DELTA by default: values are added.
+  EXPECT_OK(aggregator_->Report(request1_));
+  EXPECT_OK(aggregator_->Report(request1_));
+  EXPECT_OK(aggregator_->FlushAll());
+  ASSERT_EQ(flushed_.size(), 1);
+  EXPECT_EQ(flushed_[0]
+                .operations(0)
+                .metric_value_sets(0)
+                .metric_values(0)
+                .int64_value(),
+            2000);
+
+  // CUMULATIVE after the reload: the latest value wins.
+  std::shared_ptr<MetricKindMap> metric_kinds(new MetricKindMap);
+  (*metric_kinds)["library.googleapis.com/rpc/client/count"] =
+      ::google::api::MetricDescriptor::CUMULATIVE;
+  aggregator_->SetMetricKinds(metric_kinds);
+  EXPECT_OK(aggregator_->Report(request1_));
+  EXPECT_OK(aggregator_->Report(request1_));
+  EXPECT_OK(aggregator_->FlushAll());
+  ASSERT_EQ(flushed_.size(), 2);
+  EXPECT_EQ(flushed_[1]
+                .operations(0)
+                .metric_value_sets(0)
+                .metric_values(0)
+                .int64_value(),
+            1000);
+}
+
 TEST_F(ReportAggregatorImplTest, TestCacheCapacity) {
   EXPECT_OK(aggregator_->Report(request1_));
   // Item cached, not flushed out
@@ -301,6 +351,28 @@ TEST_F(ReportAggregatorImplTest, TestHighValueOperationSuccess) {
   EXPECT_EQ(flushed_.size(), 0);
 }
 
+TEST_F(ReportAggregatorImplTest, TestMixedImportanceOperations) {
+  // request2_ has a different operation signature, request1_ stays low.
+  AddLabel("key1", "value1", request2_.mutable_operations(0));
+  request2_.mutable_operations(0)->set_importance(Operation::HIGH);
+  ReportRequest high_request = request2_;
+  request2_.add_operations()->CopyFrom(request1_.operations(0));
+
+  // Not aggregated if the caller does not take the high important one.
+  EXPECT_ERROR_CODE(Code::NOT_FOUND, aggregator_->Report(request2_));
+
+  // The high important operation is handed back to the caller.
+  ReportRequest returned_request;
+  EXPECT_OK(aggregator_->Report(request2_, &returned_request));
+  EXPECT_TRUE(MessageDifferencer::Equals(returned_request, high_request));
+  EXPECT_EQ(flushed_.size(), 0);
+
+  // The low important operation is aggregated.
+  EXPECT_OK(aggregator_->FlushAll());
+  ASSERT_EQ(flushed_.size(), 1);
+  EXPECT_TRUE(MessageDifferencer::Equals(flushed_[0], request1_));
+}
+
 TEST_F(ReportAggregatorImplTest, TestDisableCache) {
   ReportAggregationOptions options(0 /*entries*/, 1000 /*flush_interval_ms*/);
   aggregator_ =
@@ -318,6 +390,284 @@ TEST_F(ReportAggregatorImplTest, TestDisableCache) {
   EXPECT_EQ(flushed_.size(), 0);
 }
 
+TEST_F(ReportAggregatorImplTest, TestBatchFlushedOperationsBySize) {
+  // Operations with different signatures, all the same size.
+  std::vector<ReportRequest> requests(10, request1_);
+  for (size_t i = 0; i < requests.size(); ++i) {
+    AddLabel("key", "value" + std::to_string(i),
+             requests[i].mutable_operations(0));
+  }
+  ReportRequest three_operations = requests[0];
+  three_operations.add_operations()->CopyFrom(requests[1].operations(0));
+  three_operations.add_operations()->CopyFrom(requests[2].operations(0));
+
+  ReportAggregationOptions options(100 /*entries*/, 1000 /*flush_interval_ms*/,
+                                   three_operations.ByteSize());
+  aggregator_ =
+      CreateReportAggregator(kServiceName, kServiceConfigId, options,
+                             std::shared_ptr<MetricKindMap>(new MetricKindMap));
+  ASSERT_TRUE((bool)(aggregator_));
+  aggregator_->SetFlushCallback(std::bind(
+      &ReportAggregatorImplTest::FlushCallback, this, std::placeholders::_1));
+
+  for (const auto& request : requests) {
+    EXPECT_OK(aggregator_->Report(request));
+  }
+  EXPECT_OK(aggregator_->FlushAll());
+
+  // Three operations fit in each request, the last one takes the rest.
+  ASSERT_EQ(flushed_.size(), 4);
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_EQ(flushed_[i].operations_size(), 3);
+    EXPECT_EQ(flushed_[i].ByteSize(), three_operations.ByteSize());
+  }
+  EXPECT_EQ(flushed_[3].operations_size(), 1);
+}
+
+TEST_F(ReportAggregatorImplTest, TestOversizedOperationSentAlone) {
+  ReportAggregationOptions options(100 /*entries*/, 1000 /*flush_interval_ms*/,
+                                   1 /*max_report_request_bytes*/);
+  aggregator_ =
+      CreateReportAggregator(kServiceName, kServiceConfigId, options,
+                             std::shared_ptr<MetricKindMap>(new MetricKindMap));
+  ASSERT_TRUE((bool)(aggregator_));
+  aggregator_->SetFlushCallback(std::bind(
+      &ReportAggregatorImplTest::FlushCallback, this, std::placeholders::_1));
+
+  EXPECT_OK(aggregator_->Report(request1_));
+  AddLabel("key1", "value1", request2_.mutable_operations(0));
+  EXPECT_OK(aggregator_->Report(request2_));
+  EXPECT_OK(aggregator_->FlushAll());
+
+  ASSERT_EQ(flushed_.size(), 2);
+  EXPECT_EQ(flushed_[0].operations_size(), 1);
+  EXPECT_EQ(flushed_[1].operations_size(), 1);
+}
+
+TEST_F(ReportAggregatorImplTest, TestPackOperationsAroundOversizedOne) {
+  ReportRequest small1 = request1_;
+  AddLabel("key", "value1", small1.mutable_operations(0));
+  ReportRequest small2 = request1_;
+  AddLabel("key", "value2", small2.mutable_operations(0));
+  ReportRequest large = request1_;
+  AddLabel("key", string(1000, 'x'), large.mutable_operations(0));
+  ReportRequest two_small = small1;
+  two_small.add_operations()->CopyFrom(small2.operations(0));
+
+  ReportAggregationOptions options(100 /*entries*/, 1000 /*flush_interval_ms*/,
+                                   two_small.ByteSize());
+  aggregator_ =
+      CreateReportAggregator(kServiceName, kServiceConfigId, options,
+                             std::shared_ptr<MetricKindMap>(new MetricKindMap));
+  ASSERT_TRUE((bool)(aggregator_));
+  aggregator_->SetFlushCallback(std::bind(
+      &ReportAggregatorImplTest::FlushCallback, this, std::placeholders::_1));
+
+  EXPECT_OK(aggregator_->Report(small1));
+  EXPECT_OK(aggregator_->Report(large));
+  EXPECT_OK(aggregator_->Report(small2));
+  EXPECT_OK(aggregator_->FlushAll());
+
+  // The oversized operation goes alone, the small ones share a request.
+  ASSERT_EQ(flushed_.size(), 2);
+  EXPECT_TRUE(MessageDifferencer::Equals(flushed_[0], large));
+  EXPECT_EQ(flushed_[1].operations_size(), 2);
+  EXPECT_EQ(flushed_[1].ByteSize(), two_small.ByteSize());
+}
+
+TEST_F(ReportAggregatorImplTest, TestThreadBuffer) {
+  ReportAggregationOptions options(1 /*entries*/, 1000 /*flush_interval_ms*/,
+                                   512 * 1024, 0, 0,
+                                   2 /*thread_buffered_operations*/);
+  aggregator_ =
+      CreateReportAggregator(kServiceName, kServiceConfigId, options,
+                             std::shared_ptr<MetricKindMap>(new MetricKindMap));
+  ASSERT_TRUE((bool)(aggregator_));
+  aggregator_->SetFlushCallback(std::bind(
+      &ReportAggregatorImplTest::FlushCallback, this, std::placeholders::_1));
+
+  // Both are merged in the buffer of this thread.
+  EXPECT_OK(aggregator_->Report(request1_));
+  EXPECT_OK(aggregator_->Report(request2_));
+  EXPECT_EQ(flushed_.size(), 0);
+
+  EXPECT_OK(aggregator_->FlushAll());
+  ASSERT_EQ(flushed_.size(), 1);
+  EXPECT_TRUE(MessageDifferencer::Equals(flushed_[0], delta_merged12_));
+
+  // A second operation fills the buffer up. It is merged into the cache,
+  // which can only keep one of them.
+  AddLabel("key1", "value1", request2_.mutable_operations(0));
+  EXPECT_OK(aggregator_->Report(request1_));
+  EXPECT_EQ(flushed_.size(), 1);
+  EXPECT_OK(aggregator_->Report(request2_));
+  EXPECT_EQ(flushed_.size(), 2);
+  EXPECT_OK(aggregator_->FlushAll());
+  EXPECT_EQ(flushed_.size(), 3);
+}
+
+TEST_F(ReportAggregatorImplTest, TestThreadBuffersMergedAtFlush) {
+  ReportAggregationOptions options(10 /*entries*/, 1000 /*flush_interval_ms*/,
+                                   512 * 1024, 0, 0,
+                                   10 /*thread_buffered_operations*/);
+  aggregator_ =
+      CreateReportAggregator(kServiceName, kServiceConfigId, options,
+                             std::shared_ptr<MetricKindMap>(new MetricKindMap));
+  ASSERT_TRUE((bool)(aggregator_));
+  aggregator_->SetFlushCallback(std::bind(
+      &ReportAggregatorImplTest::FlushCallback, this, std::placeholders::_1));
+
+  const int kThreads = 4;
+  const int kReportsPerThread = 10;
+  std::vector<std::unique_ptr<Thread>> threads;
+  for (int i = 0; i < kThreads; ++i) {
+    threads.emplace_back(new Thread([this]() {
+      for (int j = 0; j < kReportsPerThread; ++j) {
+        EXPECT_OK(aggregator_->Report(request1_));
+      }
+    }));
+  }
+  for (auto& thread : threads) {
+    thread->join();
+  }
+  EXPECT_EQ(flushed_.size(), 0);
+
+  EXPECT_OK(aggregator_->FlushAll());
+  ASSERT_EQ(flushed_.size(), 1);
+  ASSERT_EQ(flushed_[0].operations_size(), 1);
+  EXPECT_EQ(flushed_[0].operations(0).log_entries_size(),
+            kThreads * kReportsPerThread);
+}
+
+TEST_F(ReportAggregatorImplTest, TestQueuedReports) {
+  ReportAggregationOptions options(10 /*entries*/, 1000 /*flush_interval_ms*/,
+                                   512 * 1024, 0, 0, 0,
+                                   16 /*report_queue_size*/);
+  aggregator_ =
+      CreateReportAggregator(kServiceName, kServiceConfigId, options,
+                             std::shared_ptr<MetricKindMap>(new MetricKindMap));
+  ASSERT_TRUE((bool)(aggregator_));
+  aggregator_->SetFlushCallback(std::bind(
+      &ReportAggregatorImplTest::FlushCallback, this, std::placeholders::_1));
+
+  EXPECT_OK(aggregator_->Report(request1_));
+  EXPECT_OK(aggregator_->Report(request2_));
+  // High important requests are not queued.
+  ReportRequest high_request = request1_;
+  high_request.mutable_operations(0)->set_importance(Operation::HIGH);
+  EXPECT_ERROR_CODE(Code::NOT_FOUND, aggregator_->Report(high_request));
+
+  // FlushAll() waits for the queued requests to be aggregated.
+  EXPECT_OK(aggregator_->FlushAll());
+  ASSERT_EQ(flushed_.size(), 1);
+  EXPECT_TRUE(MessageDifferencer::Equals(flushed_[0], delta_merged12_));
+
+  uint64_t queue_depth = 1;
+  uint64_t dropped_reports = 1;
+  aggregator_->GetQueueStatistics(&queue_depth, &dropped_reports);
+  EXPECT_EQ(queue_depth, 0);
+  EXPECT_EQ(dropped_reports, 0);
+}
+
+TEST_F(ReportAggregatorImplTest, TestFullQueueDropsLowImportance) {
+  ReportAggregationOptions options(
+      1 /*entries*/, 1000 /*flush_interval_ms*/, 512 * 1024, 0, 0, 0,
+      2 /*report_queue_size*/, ReportQueueFullPolicy::DROP_LOW_IMPORTANCE);
+  aggregator_ =
+      CreateReportAggregator(kServiceName, kServiceConfigId, options,
+                             std::shared_ptr<MetricKindMap>(new MetricKindMap));
+  ASSERT_TRUE((bool)(aggregator_));
+
+  // Blocks the queue thread in the flush callback of the first eviction.
+  std::atomic<bool> flushing(false);
+  StatusPromise release_promise;
+  std::shared_future<Status> release = release_promise.get_future().share();
+  aggregator_->SetFlushCallback(
+      [this, &flushing, release](const ReportRequest& request) {
+        flushed_.push_back(request);
+        flushing = true;
+        release.wait();
+      });
+
+  AddLabel("key1", "value1", request2_.mutable_operations(0));
+  EXPECT_OK(aggregator_->Report(request1_));
+  EXPECT_OK(aggregator_->Report(request2_));
+  while (!flushing) {
+    std::this_thread::yield();
+  }
+
+  // Fills the queue up, then the next low important request is dropped.
+  EXPECT_OK(aggregator_->Report(request1_));
+  EXPECT_OK(aggregator_->Report(request1_));
+  EXPECT_OK(aggregator_->Report(request1_));
+  uint64_t queue_depth = 0;
+  uint64_t dropped_reports = 0;
+  aggregator_->GetQueueStatistics(&queue_depth, &dropped_reports);
+  // The two queued ones, and request2_ being aggregated.
+  EXPECT_EQ(queue_depth, 3);
+  EXPECT_EQ(dropped_reports, 1);
+
+  release_promise.set_value(Status::OK);
+  EXPECT_OK(aggregator_->FlushAll());
+  aggregator_->GetQueueStatistics(&queue_depth, &dropped_reports);
+  EXPECT_EQ(queue_depth, 0);
+  // request1_, then request2_ with the two queued request1_ merged.
+  ASSERT_EQ(flushed_.size(), 3);
+  EXPECT_EQ(flushed_[2].operations(0).log_entries_size(), 2);
+}
+
+TEST_F(ReportAggregatorImplTest, TestFullQueueBlocks) {
+  ReportAggregationOptions options(
+      1 /*entries*/, 1000 /*flush_interval_ms*/, 512 * 1024, 0, 0, 0,
+      2 /*report_queue_size*/, ReportQueueFullPolicy::BLOCK);
+  aggregator_ =
+      CreateReportAggregator(kServiceName, kServiceConfigId, options,
+                             std::shared_ptr<MetricKindMap>(new MetricKindMap));
+  ASSERT_TRUE((bool)(aggregator_));
+
+  // Blocks the queue thread in the flush callback of the first eviction.
+  std::atomic<bool> flushing(false);
+  StatusPromise release_promise;
+  std::shared_future<Status> release = release_promise.get_future().share();
+  aggregator_->SetFlushCallback(
+      [this, &flushing, release](const ReportRequest& request) {
+        flushed_.push_back(request);
+        flushing = true;
+        release.wait();
+      });
+
+  AddLabel("key1", "value1", request2_.mutable_operations(0));
+  EXPECT_OK(aggregator_->Report(request1_));
+  EXPECT_OK(aggregator_->Report(request2_));
+  while (!flushing) {
+    std::this_thread::yield();
+  }
+
+  // Fills the queue up, then the next request waits for room.
+  EXPECT_OK(aggregator_->Report(request1_));
+  EXPECT_OK(aggregator_->Report(request1_));
+  std::atomic<bool> reported(false);
+  std::thread reporter([this, &reported]() {
+    EXPECT_OK(aggregator_->Report(request1_));
+    reported = true;
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  EXPECT_FALSE(reported);
+
+  release_promise.set_value(Status::OK);
+  reporter.join();
+  EXPECT_TRUE(reported);
+  EXPECT_OK(aggregator_->FlushAll());
+  uint64_t queue_depth = 1;
+  uint64_t dropped_reports = 1;
+  aggregator_->GetQueueStatistics(&queue_depth, &dropped_reports);
+  EXPECT_EQ(queue_depth, 0);
+  EXPECT_EQ(dropped_reports, 0);
+  // request1_, request2_, then the three queued request1_ merged.
+  ASSERT_EQ(flushed_.size(), 3);
+  EXPECT_EQ(flushed_[2].operations(0).log_entries_size(), 3);
+}
+
 TEST_F(ReportAggregatorImplTest, TestFlushAllWithCallbackCallingFlush) {
   aggregator_->SetFlushCallback(
       std::bind(&ReportAggregatorImplTest::FlushCallbackCallingBackToAggregator,
@@ -0,0 +1,121 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "src/report_batcher.h"
+
+using ::google::api::servicecontrol::v1::Operation;
+using ::google::api::servicecontrol::v1::ReportRequest;
+using ::google::api::servicecontrol::v1::ReportResponse;
+using ::google::protobuf::Arena;
+using ::google::protobuf::util::Status;
+
+namespace google {
+namespace service_control_client {
+
+ReportBatcher::ReportBatcher(int max_operations, int max_request_bytes,
+                             TransportReportFunc transport)
+    : max_operations_(max_operations),
+      max_request_bytes_(max_request_bytes),
+      transport_(transport) {}
+
+ReportBatcher::Batch::Batch()
+    : request(Arena::CreateMessage<ReportRequest>(&arena)),
+      response(Arena::CreateMessage<ReportResponse>(&arena)),
+      bytes(0) {}
+
+void ReportBatcher::Add(const ReportRequest& request, ReportResponse* response,
+                        TransportDoneFunc on_report_done) {
+  Add(request, nullptr, response, on_report_done);
+}
+
+void ReportBatcher::Add(ReportRequest&& request, ReportResponse* response,
+                        TransportDoneFunc on_report_done) {
+  Add(request, &request, response, on_report_done);
+}
+
+void ReportBatcher::Add(const ReportRequest& request,
+                        ReportRequest* movable_request,
+                        ReportResponse* response,
+                        TransportDoneFunc on_report_done) {
+  int64_t bytes = request.ByteSize();
+  std::unique_ptr<Batch> full_batch;
+  std::unique_ptr<Batch> next_batch;
+  {
+    MutexLock lock(mutex_);
+    // Closes the batch if the request does not fit in it.
+    if (batch_ &&
+        (batch_->request->service_config_id() != request.service_config_id() ||
+         batch_->bytes + bytes > max_request_bytes_)) {
+      full_batch = std::move(batch_);
+    }
+    if (!batch_) {
+      batch_.reset(new Batch);
+      batch_->request->set_service_name(request.service_name());
+      batch_->request->set_service_config_id(request.service_config_id());
+    }
+    if (movable_request) {
+      // Swapping into operations allocated on the arena would copy them,
+      // handing them over to the arena does not.
+      int size = movable_request->operations_size();
+      std::vector<Operation*> operations(size);
+      movable_request->mutable_operations()->ExtractSubrange(0, size,
+                                                             operations.data());
+      for (Operation* operation : operations) {
+        batch_->request->mutable_operations()->AddAllocated(operation);
+      }
+    } else {
+      for (const auto& operation : request.operations()) {
+        *batch_->request->add_operations() = operation;
+      }
+    }
+    batch_->bytes += bytes;
+    batch_->calls.push_back({response, on_report_done});
+    if (batch_->request->operations_size() >= max_operations_) {
+      next_batch = std::move(batch_);
+    }
+  }
+  if (full_batch) {
+    Send(std::move(full_batch));
+  }
+  if (next_batch) {
+    Send(std::move(next_batch));
+  }
+}
+
+void ReportBatcher::Flush() {
+  std::unique_ptr<Batch> batch;
+  {
+    MutexLock lock(mutex_);
+    batch = std::move(batch_);
+  }
+  if (batch) {
+    Send(std::move(batch));
+  }
+}
+
+void ReportBatcher::Send(std::unique_ptr<Batch> batch) {
+  Batch* sent_batch = batch.release();
+  transport_(*sent_batch->request, sent_batch->response,
+             [sent_batch](const Status& status) {
+               for (const auto& call : sent_batch->calls) {
+                 *call.response = *sent_batch->response;
+                 call.on_report_done(status);
+               }
+               delete sent_batch;
+             });
+}
+
+}  // namespace service_control_client
+}  // namespace google
@@ -0,0 +1,116 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef GOOGLE_SERVICE_CONTROL_CLIENT_REPORT_BATCHER_H_
+#define GOOGLE_SERVICE_CONTROL_CLIENT_REPORT_BATCHER_H_
+
+#include <memory>
+#include <vector>
+
+#include "google/api/servicecontrol/v1/service_controller.pb.h"
+#include "google/protobuf/arena.h"
+#include "include/service_control_client.h"
+#include "utils/google_macros.h"
+#include "utils/thread.h"
+
+namespace google {
+namespace service_control_client {
+
+// Batches report requests which are not aggregated, such as the ones with
+// high importance operations, for a short time window. Each call still gets
+// its own completion: its response is a copy of the response to the batch.
+// Thread safe.
+class ReportBatcher {
+ public:
+  // Sends a batch with transport once it has max_operations operations or
+  // is about to exceed max_request_bytes, and when Flush() is called,
+  // usually by a timer. Batched operations keep the order they are added in.
+  ReportBatcher(int max_operations, int max_request_bytes,
+                TransportReportFunc transport);
+
+  // Adds a report request to the batch. on_report_done is called once the
+  // batch is sent, with its status.
+  void Add(const ::google::api::servicecontrol::v1::ReportRequest& request,
+           ::google::api::servicecontrol::v1::ReportResponse* response,
+           TransportDoneFunc on_report_done);
+
+  // Same as above, but moves the operations into the batch instead of
+  // copying them.
+  void Add(::google::api::servicecontrol::v1::ReportRequest&& request,
+           ::google::api::servicecontrol::v1::ReportResponse* response,
+           TransportDoneFunc on_report_done);
+
+  // Sends the batched requests, if any. Batches are sent in the order they
+  // are closed, concurrent Flush() calls may race each other.
+  void Flush();
+
+ private:
+  // A report call in a batch.
+  struct Call {
+    ::google::api::servicecontrol::v1::ReportResponse* response;
+    TransportDoneFunc on_report_done;
+  };
+
+  // Report calls merged into one report request. The request, the response
+  // and copied operations are allocated on arena, so they are freed at once
+  // when the batch is done. Moved operations stay on the heap: the arena only
+  // owns them, and deletes them one by one.
+  //
+  // Only high importance batches use an arena. Aggregated operations are
+  // flushed from the heap allocated cache, and moving them onto a per flush
+  // arena would deep copy each of them, so the aggregation cache and its
+  // flushes allocate on the heap.
+  struct Batch {
+    Batch();
+
+    ::google::protobuf::Arena arena;
+    ::google::api::servicecontrol::v1::ReportRequest* request;
+    ::google::api::servicecontrol::v1::ReportResponse* response;
+    std::vector<Call> calls;
+    // The total size of the batched requests, an upper bound of the size of
+    // request.
+    int64_t bytes;
+  };
+
+  // Adds a report request to the batch, moving the operations out of
+  // movable_request if not NULL. Moved operations are owned by the arena of
+  // the batch, copied ones are allocated on it.
+  void Add(const ::google::api::servicecontrol::v1::ReportRequest& request,
+           ::google::api::servicecontrol::v1::ReportRequest* movable_request,
+           ::google::api::servicecontrol::v1::ReportResponse* response,
+           TransportDoneFunc on_report_done);
+
+  // Sends a batch and deletes it once done.
+  void Send(std::unique_ptr<Batch> batch);
+
+  // The maximum number of operations in a batch.
+  const int max_operations_;
+  // The maximum serialized size of a batch.
+  const int max_request_bytes_;
+  // The transport sending the batches.
+  TransportReportFunc transport_;
+
+  // Mutex guarding batch_.
+  Mutex mutex_;
+  // The batch being filled. NULL if there is no call to send.
+  std::unique_ptr<Batch> batch_;
+
+  GOOGLE_DISALLOW_EVIL_CONSTRUCTORS(ReportBatcher);
+};
+
+}  // namespace service_control_client
+}  // namespace google
+
+#endif  // GOOGLE_SERVICE_CONTROL_CLIENT_REPORT_BATCHER_H_
@@ -0,0 +1,163 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "src/report_batcher.h"
+
+#include "gtest/gtest.h"
+#include "utils/status_test_util.h"
+
+using std::string;
+using ::google::api::servicecontrol::v1::Operation;
+using ::google::api::servicecontrol::v1::ReportRequest;
+using ::google::api::servicecontrol::v1::ReportResponse;
+using ::google::protobuf::util::Status;
+using ::google::protobuf::util::error::Code;
+
+namespace google {
+namespace service_control_client {
+namespace {
+
+const char kServiceName[] = "library.googleapis.com";
+const char kServiceConfigId[] = "2016-09-19r0";
+
+// Returns a report request with one high importance operation.
+ReportRequest CreateRequest(const string& operation_id,
+                            const string& service_config_id) {
+  ReportRequest request;
+  request.set_service_name(kServiceName);
+  request.set_service_config_id(service_config_id);
+  Operation* operation = request.add_operations();
+  operation->set_operation_id(operation_id);
+  operation->set_importance(Operation::HIGH);
+  return request;
+}
+
+}  // namespace
+
+class ReportBatcherTest : public ::testing::Test {
+ public:
+  void SetUp() { CreateBatcher(3, 1024 * 1024); }
+
+  void CreateBatcher(int max_operations, int max_request_bytes) {
+    batcher_.reset(new ReportBatcher(
+        max_operations, max_request_bytes,
+        [this](const ReportRequest& request, ReportResponse* response,
+               TransportDoneFunc on_done) {
+          sent_.push_back(request);
+          sent_on_arena_.push_back(request.GetArena() != nullptr);
+          response->add_report_errors()->set_operation_id("error");
+          on_done_.push_back(on_done);
+        }));
+  }
+
+  // Adds a request to the batcher, recording its status in statuses_.
+  void Add(const ReportRequest& request) {
+    responses_.emplace_back(new ReportResponse);
+    size_t index = statuses_.size();
+    statuses_.push_back(Status(Code::UNKNOWN, ""));
+    batcher_->Add(request, responses_.back().get(),
+                  [this, index](const Status& status) {
+                    statuses_[index] = status;
+                  });
+  }
+
+  std::unique_ptr<ReportBatcher> batcher_;
+  std::vector<ReportRequest> sent_;
+  std::vector<bool> sent_on_arena_;
+  std::vector<TransportDoneFunc> on_done_;
+  std::vector<std::unique_ptr<ReportResponse>> responses_;
+  std::vector<Status> statuses_;
+};
+
+TEST_F(ReportBatcherTest, TestFlushSendsBatch) {
+  Add(CreateRequest("operation-1", kServiceConfigId));
+  Add(CreateRequest("operation-2", kServiceConfigId));
+  EXPECT_EQ(sent_.size(), 0);
+
+  batcher_->Flush();
+  ASSERT_EQ(sent_.size(), 1);
+  EXPECT_EQ(sent_[0].service_name(), kServiceName);
+  EXPECT_EQ(sent_[0].service_config_id(), kServiceConfigId);
+  ASSERT_EQ(sent_[0].operations_size(), 2);
+  EXPECT_EQ(sent_[0].operations(0).operation_id(), "operation-1");
+  EXPECT_EQ(sent_[0].operations(1).operation_id(), "operation-2");
+
+  // Each call completes with the status and response of the batch.
+  EXPECT_ERROR_CODE(Code::UNKNOWN, statuses_[0]);
+  on_done_[0](Status(Code::UNAVAILABLE, ""));
+  EXPECT_ERROR_CODE(Code::UNAVAILABLE, statuses_[0]);
+  EXPECT_ERROR_CODE(Code::UNAVAILABLE, statuses_[1]);
+  EXPECT_EQ(responses_[0]->report_errors_size(), 1);
+  EXPECT_EQ(responses_[1]->report_errors_size(), 1);
+
+  // Nothing left to send.
+  batcher_->Flush();
+  EXPECT_EQ(sent_.size(), 1);
+}
+
+TEST_F(ReportBatcherTest, TestMovedOperationsBatchedOnArena) {
+  Add(CreateRequest("operation-1", kServiceConfigId));
+  ReportRequest request = CreateRequest("operation-2", kServiceConfigId);
+  responses_.emplace_back(new ReportResponse);
+  batcher_->Add(std::move(request), responses_.back().get(),
+                [](const Status& /* status */) {});
+  EXPECT_EQ(request.operations_size(), 0);
+
+  batcher_->Flush();
+  ASSERT_EQ(sent_.size(), 1);
+  EXPECT_TRUE(sent_on_arena_[0]);
+  ASSERT_EQ(sent_[0].operations_size(), 2);
+  EXPECT_EQ(sent_[0].operations(0).operation_id(), "operation-1");
+  EXPECT_EQ(sent_[0].operations(1).operation_id(), "operation-2");
+  on_done_[0](Status::OK);
+  EXPECT_OK(statuses_[0]);
+}
+
+TEST_F(ReportBatcherTest, TestFullBatchSent) {
+  for (int i = 0; i < 4; ++i) {
+    Add(CreateRequest("operation-" + std::to_string(i), kServiceConfigId));
+  }
+  ASSERT_EQ(sent_.size(), 1);
+  EXPECT_EQ(sent_[0].operations_size(), 3);
+
+  batcher_->Flush();
+  ASSERT_EQ(sent_.size(), 2);
+  EXPECT_EQ(sent_[1].operations_size(), 1);
+  EXPECT_EQ(sent_[1].operations(0).operation_id(), "operation-3");
+}
+
+TEST_F(ReportBatcherTest, TestBatchSizeLimit) {
+  ReportRequest request = CreateRequest("operation-1", kServiceConfigId);
+  CreateBatcher(100, request.ByteSize() * 2);
+  for (int i = 0; i < 3; ++i) {
+    Add(request);
+  }
+  ASSERT_EQ(sent_.size(), 1);
+  EXPECT_EQ(sent_[0].operations_size(), 2);
+}
+
+TEST_F(ReportBatcherTest, TestDifferentServiceConfigIds) {
+  Add(CreateRequest("operation-1", kServiceConfigId));
+  Add(CreateRequest("operation-2", "2016-09-20r0"));
+  ASSERT_EQ(sent_.size(), 1);
+  EXPECT_EQ(sent_[0].service_config_id(), kServiceConfigId);
+
+  batcher_->Flush();
+  ASSERT_EQ(sent_.size(), 2);
+  EXPECT_EQ(sent_[1].service_config_id(), "2016-09-20r0");
+}
+
+}  // namespace service_control_client
+}  // namespace google
@@ -0,0 +1,392 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// A multi-threaded benchmark of ServiceControlClient with an in-process
+// transport. It measures the throughput and latency of cached checks, cache
+// missed checks and aggregated reports at increasing thread counts.
+//
+// Usage: service_control_client_benchmark [--flag=value]...
+//   --benchmarks=check_hit,check_miss,report  Benchmarks to run.
+//   --threads=1,2,4,8           Thread counts to run each benchmark with.
+//   --duration_ms=1000          Time to run each benchmark for.
+//   --signatures=1000           Number of distinct request signatures.
+//   --labels=4                  Number of labels of each operation.
+//   --distribution=uniform      How requests pick a signature: uniform or
+//                               zipf.
+//   --zipf_exponent=1.0         Exponent of the zipf distribution.
+//   --cache_entries=10000       Entries of the check and report caches.
+//   --check_shards=1            Shards of the check cache.
+//
+// Each result is printed as one JSON object per line, for example
+//   {"benchmark": "check_hit", "threads": 4, ..., "ops_per_sec": 1.2e+07,
+//    "p50_ns": 250, "p99_ns": 1100, "p999_ns": 4200}
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "include/service_control_client.h"
+
+using std::string;
+using ::google::api::servicecontrol::v1::CheckRequest;
+using ::google::api::servicecontrol::v1::CheckResponse;
+using ::google::api::servicecontrol::v1::MetricValueSet;
+using ::google::api::servicecontrol::v1::Operation;
+using ::google::api::servicecontrol::v1::ReportRequest;
+using ::google::api::servicecontrol::v1::ReportResponse;
+using ::google::protobuf::util::Status;
+
+namespace google {
+namespace service_control_client {
+namespace {
+
+const char kServiceName[] = "library.googleapis.com";
+const char kServiceConfigId[] = "2016-09-19r0";
+
+// Latency samples kept per thread.
+const size_t kMaxSamplesPerThread = 1 << 16;
+
+// The benchmark configuration.
+struct Flags {
+  std::vector<string> benchmarks = {"check_hit", "check_miss", "report"};
+  std::vector<int> threads = {1, 2, 4, 8};
+  int duration_ms = 1000;
+  int signatures = 1000;
+  int labels = 4;
+  string distribution = "uniform";
+  double zipf_exponent = 1.0;
+  int cache_entries = 10000;
+  int check_shards = 1;
+};
+
+std::vector<string> SplitList(const string& value) {
+  std::vector<string> items;
+  std::stringstream stream(value);
+  string item;
+  while (std::getline(stream, item, ',')) {
+    if (!item.empty()) {
+      items.push_back(item);
+    }
+  }
+  return items;
+}
+
+// Parses --name=value flags. Returns false on an unknown or invalid flag.
+bool ParseFlags(int argc, char** argv, Flags* flags) {
+  for (int i = 1; i < argc; ++i) {
+    string arg = argv[i];
+    size_t equal = arg.find('=');
+    if (arg.compare(0, 2, "--") != 0 || equal == string::npos) {
+      return false;
+    }
+    string name = arg.substr(2, equal - 2);
+    string value = arg.substr(equal + 1);
+    if (name == "benchmarks") {
+      flags->benchmarks = SplitList(value);
+    } else if (name == "threads") {
+      flags->threads.clear();
+      for (const string& item : SplitList(value)) {
+        flags->threads.push_back(atoi(item.c_str()));
+      }
+    } else if (name == "duration_ms") {
+      flags->duration_ms = atoi(value.c_str());
+    } else if (name == "signatures") {
+      flags->signatures = atoi(value.c_str());
+    } else if (name == "labels") {
+      flags->labels = atoi(value.c_str());
+    } else if (name == "distribution") {
+      flags->distribution = value;
+    } else if (name == "zipf_exponent") {
+      flags->zipf_exponent = atof(value.c_str());
+    } else if (name == "cache_entries") {
+      flags->cache_entries = atoi(value.c_str());
+    } else if (name == "check_shards") {
+      flags->check_shards = atoi(value.c_str());
+    } else {
+      return false;
+    }
+  }
+  if (flags->distribution != "uniform" && flags->distribution != "zipf") {
+    return false;
+  }
+  for (int threads : flags->threads) {
+    if (threads <= 0) {
+      return false;
+    }
+  }
+  return flags->duration_ms > 0 && flags->signatures > 0 &&
+         flags->labels >= 0 && !flags->threads.empty();
+}
+
+// Picks signature indexes in [0, num_signatures) following the configured
+// distribution. Index 0 is the most popular one for zipf.
+class SignaturePicker {
+ public:
+  explicit SignaturePicker(const Flags& flags) {
+    cdf_.resize(flags.signatures);
+    double sum = 0;
+    for (int i = 0; i < flags.signatures; ++i) {
+      sum += flags.distribution == "zipf"
+                 ? 1.0 / std::pow(i + 1, flags.zipf_exponent)
+                 : 1.0;
+      cdf_[i] = sum;
+    }
+    for (double& value : cdf_) {
+      value /= sum;
+    }
+  }
+
+  // Returns the next index. Each thread must use its own generator.
+  int Pick(std::mt19937_64* generator) const {
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    double value = uniform(*generator);
+    auto it = std::lower_bound(cdf_.begin(), cdf_.end(), value);
+    return std::min(static_cast<int>(it - cdf_.begin()),
+                    static_cast<int>(cdf_.size()) - 1);
+  }
+
+ private:
+  // Cumulative probability of each index.
+  std::vector<double> cdf_;
+};
+
+// Builds an operation for the signature index with the configured number of
+// labels, carrying one quota metric value.
+Operation BuildOperation(const Flags& flags, int index) {
+  Operation operation;
+  operation.set_operation_id("operation-" + std::to_string(index));
+  operation.set_operation_name("benchmark-operation");
+  operation.set_consumer_id("project:consumer-" + std::to_string(index));
+  for (int i = 0; i < flags.labels; ++i) {
+    (*operation.mutable_labels())["/label-" + std::to_string(i)] =
+        "value-" + std::to_string(i);
+  }
+  MetricValueSet* metric_value_set = operation.add_metric_value_sets();
+  metric_value_set->set_metric_name(
+      "serviceruntime.googleapis.com/api/consumer/quota_used_count");
+  metric_value_set->add_metric_values()->set_int64_value(1);
+  return operation;
+}
+
+// Per-thread results.
+struct ThreadResult {
+  int64_t ops = 0;
+  std::vector<int64_t> samples;
+};
+
+// Runs op from num_threads threads for flags.duration_ms and prints the
+// aggregated results as one JSON line. op(thread, index) runs one operation
+// from the given thread on the request with the given signature index.
+void RunThreads(const Flags& flags, const string& benchmark, int num_threads,
+                const SignaturePicker& picker,
+                const std::function<void(int, int)>& op) {
+  std::atomic<bool> start(false);
+  std::atomic<bool> stop(false);
+  std::vector<ThreadResult> results(num_threads);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < num_threads; ++t) {
+    threads.emplace_back([&, t]() {
+      ThreadResult& result = results[t];
+      result.samples.reserve(kMaxSamplesPerThread);
+      std::mt19937_64 generator(t + 1);
+      while (!start.load()) {
+        std::this_thread::yield();
+      }
+      while (!stop.load(std::memory_order_relaxed)) {
+        int index = picker.Pick(&generator);
+        auto begin = std::chrono::steady_clock::now();
+        op(t, index);
+        auto end = std::chrono::steady_clock::now();
+        int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         end - begin)
+                         .count();
+        // Reservoir sampling keeps a uniform sample of the latencies.
+        ++result.ops;
+        if (result.samples.size() < kMaxSamplesPerThread) {
+          result.samples.push_back(ns);
+        } else {
+          uint64_t slot = generator() % result.ops;
+          if (slot < kMaxSamplesPerThread) {
+            result.samples[slot] = ns;
+          }
+        }
+      }
+    });
+  }
+
+  auto begin = std::chrono::steady_clock::now();
+  start.store(true);
+  std::this_thread::sleep_for(std::chrono::milliseconds(flags.duration_ms));
+  stop.store(true);
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  double seconds = std::chrono::duration_cast<std::chrono::duration<double>>(
+                       std::chrono::steady_clock::now() - begin)
+                       .count();
+
+  int64_t ops = 0;
+  std::vector<int64_t> samples;
+  for (const auto& result : results) {
+    ops += result.ops;
+    samples.insert(samples.end(), result.samples.begin(),
+                   result.samples.end());
+  }
+  std::sort(samples.begin(), samples.end());
+  auto percentile = [&samples](double p) -> int64_t {
+    if (samples.empty()) return 0;
+    size_t index = static_cast<size_t>(p * (samples.size() - 1));
+    return samples[index];
+  };
+
+  printf(
+      "{\"benchmark\": \"%s\", \"threads\": %d, \"duration_ms\": %d, "
+      "\"signatures\": %d, \"labels\": %d, \"distribution\": \"%s\", "
+      "\"zipf_exponent\": %g, \"cache_entries\": %d, \"check_shards\": %d, "
+      "\"ops\": %lld, \"ops_per_sec\": %g, \"p50_ns\": %lld, "
+      "\"p99_ns\": %lld, \"p999_ns\": %lld}\n",
+      benchmark.c_str(), num_threads, flags.duration_ms, flags.signatures,
+      flags.labels, flags.distribution.c_str(), flags.zipf_exponent,
+      flags.cache_entries, flags.check_shards, static_cast<long long>(ops),
+      ops / seconds, static_cast<long long>(percentile(0.5)),
+      static_cast<long long>(percentile(0.99)),
+      static_cast<long long>(percentile(0.999)));
+  fflush(stdout);
+}
+
+// Creates a client whose transports answer in place with OK. Cached check
+// responses are not refreshed or expired while a benchmark runs.
+std::unique_ptr<ServiceControlClient> CreateClient(const Flags& flags) {
+  ServiceControlClientOptions options(
+      CheckAggregationOptions(flags.cache_entries,
+                              10 * flags.duration_ms /*flush_interval_ms*/,
+                              20 * flags.duration_ms /*expiration_ms*/,
+                              flags.check_shards),
+      ReportAggregationOptions(flags.cache_entries,
+                               1000 /*flush_interval_ms*/));
+  options.check_transport = [](const CheckRequest& request,
+                               CheckResponse* response,
+                               TransportDoneFunc on_done) {
+    response->set_operation_id(request.operation().operation_id());
+    on_done(Status::OK);
+  };
+  options.report_transport = [](const ReportRequest& /* request */,
+                                ReportResponse* /* response */,
+                                TransportDoneFunc on_done) {
+    on_done(Status::OK);
+  };
+  return CreateServiceControlClient(kServiceName, kServiceConfigId, options);
+}
+
+void RunCheck(const Flags& flags, const string& benchmark, int num_threads,
+              const SignaturePicker& picker) {
+  std::vector<CheckRequest> requests(flags.signatures);
+  for (int i = 0; i < flags.signatures; ++i) {
+    requests[i].set_service_name(kServiceName);
+    requests[i].set_service_config_id(kServiceConfigId);
+    *requests[i].mutable_operation() = BuildOperation(flags, i);
+  }
+
+  std::unique_ptr<ServiceControlClient> client = CreateClient(flags);
+  ServiceControlClient* client_ptr = client.get();
+  if (benchmark == "check_hit") {
+    // Warms up the cache.
+    for (const auto& request : requests) {
+      CheckResponse response;
+      client->Check(request, &response);
+    }
+    RunThreads(flags, benchmark, num_threads, picker,
+               [client_ptr, &requests](int /* thread */, int index) {
+                 CheckResponse response;
+                 client_ptr->Check(requests[index], &response);
+               });
+    return;
+  }
+
+  // Every call misses the cache with a consumer id never used before, so it
+  // computes the signature, looks it up, and caches the response.
+  std::vector<std::vector<CheckRequest>> thread_requests(num_threads,
+                                                         requests);
+  RunThreads(flags, benchmark, num_threads, picker,
+             [client_ptr, &thread_requests](int thread, int index) {
+               static thread_local int64_t next_consumer = 0;
+               CheckRequest& request = thread_requests[thread][index];
+               request.mutable_operation()->set_consumer_id(
+                   "project:miss-" + std::to_string(thread) + "-" +
+                   std::to_string(next_consumer++));
+               CheckResponse response;
+               client_ptr->Check(request, &response);
+             });
+}
+
+void RunReport(const Flags& flags, int num_threads,
+               const SignaturePicker& picker) {
+  std::vector<ReportRequest> requests(flags.signatures);
+  for (int i = 0; i < flags.signatures; ++i) {
+    requests[i].set_service_name(kServiceName);
+    requests[i].set_service_config_id(kServiceConfigId);
+    *requests[i].add_operations() = BuildOperation(flags, i);
+  }
+
+  std::unique_ptr<ServiceControlClient> client = CreateClient(flags);
+  ServiceControlClient* client_ptr = client.get();
+  RunThreads(flags, "report", num_threads, picker,
+             [client_ptr, &requests](int /* thread */, int index) {
+               ReportResponse response;
+               client_ptr->Report(requests[index], &response);
+             });
+}
+
+}  // namespace
+}  // namespace service_control_client
+}  // namespace google
+
+int main(int argc, char** argv) {
+  using namespace ::google::service_control_client;
+  Flags flags;
+  if (!ParseFlags(argc, argv, &flags)) {
+    fprintf(stderr,
+            "Usage: %s [--benchmarks=check_hit,check_miss,report] "
+            "[--threads=1,2,4,8] [--duration_ms=N] [--signatures=N] "
+            "[--labels=N] [--distribution=uniform|zipf] "
+            "[--zipf_exponent=X] [--cache_entries=N] [--check_shards=N]\n",
+            argv[0]);
+    return 1;
+  }
+
+  SignaturePicker picker(flags);
+  for (const string& benchmark : flags.benchmarks) {
+    for (int num_threads : flags.threads) {
+      if (benchmark == "check_hit" || benchmark == "check_miss") {
+        RunCheck(flags, benchmark, num_threads, picker);
+      } else if (benchmark == "report") {
+        RunReport(flags, num_threads, picker);
+      } else {
+        fprintf(stderr, "Unknown benchmark: %s\n", benchmark.c_str());
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
@@ -15,11 +15,16 @@ limitations under the License.
 
 #include "src/service_control_client_impl.h"
 
+#include <limits>
+
 #include "google/protobuf/stubs/logging.h"
+#include "src/periodic_timer_impl.h"
+#include "src/signature.h"
 #include "utils/thread.h"
 
 using std::string;
 using ::google::api::servicecontrol::v1::CheckRequest;
+using ::google::api::servicecontrol::v1::Operation;
 using ::google::api::servicecontrol::v1::CheckResponse;
 using ::google::api::servicecontrol::v1::ReportRequest;
 using ::google::api::servicecontrol::v1::ReportResponse;
@@ -28,6 +33,44 @@ using ::google::protobuf::util::error::Code;
 
 namespace google {
 namespace service_control_client {
+namespace {
+
+// Returns a new copy of check_request, swapped out of movable_check_request
+// if not NULL.
+CheckRequest* NewCheckRequestCopy(const CheckRequest& check_request,
+                                  CheckRequest* movable_check_request) {
+  CheckRequest* copy = new CheckRequest;
+  if (movable_check_request) {
+    copy->Swap(movable_check_request);
+  } else {
+    *copy = check_request;
+  }
+  return copy;
+}
+
+// Sends a check request refreshing the response cached by check_aggregator.
+// Takes the ownership of check_request.
+void SendRefreshCheck(const std::shared_ptr<CheckAggregator>& check_aggregator,
+                      TransportCheckFunc check_transport,
+                      CheckRequest* check_request, const Signature& signature) {
+  CheckResponse* refresh_response = new CheckResponse;
+  std::shared_ptr<CheckAggregator> check_aggregator_copy = check_aggregator;
+  check_transport(*check_request, refresh_response,
+                  [check_aggregator_copy, check_request, signature,
+                   refresh_response](Status status) {
+                    if (status.ok()) {
+                      check_aggregator_copy->CacheResponse(
+                          *check_request, signature, *refresh_response);
+                    } else {
+                      GOOGLE_LOG(ERROR) << "Failed in Check call: "
+                                        << status.error_message();
+                    }
+                    delete check_request;
+                    delete refresh_response;
+                  });
+}
+
+}  // namespace
 
 ServiceControlClientImpl::ServiceControlClientImpl(
     const string& service_name, const std::string& service_config_id,
@@ -39,6 +82,12 @@ ServiceControlClientImpl::ServiceControlClientImpl(
       CreateReportAggregator(service_name, service_config_id,
                              options.report_options, options.metric_kinds);
 
+  if (options.check_options.num_entries > 0 &&
+      options.check_options.max_coalesced_checks > 0) {
+    in_flight_checks_.reset(
+        new InFlightChecks(options.check_options.max_coalesced_checks));
+  }
+
   check_transport_ = options.check_transport;
   report_transport_ = options.report_transport;
 
@@ -47,8 +96,9 @@ ServiceControlClientImpl::ServiceControlClientImpl(
   send_checks_in_flight_ = 0;
   total_called_reports_ = 0;
   send_reports_by_flush_ = 0;
-  send_reports_in_flight_ = 0;
-  send_report_operations_ = 0;
+  report_counters_ = std::make_shared<ReportCounters>();
+  report_counters_->send_reports_in_flight = 0;
+  report_counters_->send_report_operations = 0;
 
   check_aggregator_->SetFlushCallback(
       std::bind(&ServiceControlClientImpl::CheckFlushCallback, this,
@@ -57,14 +107,19 @@ ServiceControlClientImpl::ServiceControlClientImpl(
       std::bind(&ServiceControlClientImpl::ReportFlushCallback, this,
                 std::placeholders::_1));
 
+  PeriodicTimerCreateFunc create_timer = options.periodic_timer;
+  if (!create_timer) {
+    create_timer = CreateThreadPeriodicTimer;
+  }
+
   int flush_interval = GetNextFlushInterval();
-  if (options.periodic_timer && flush_interval > 0) {
+  if (flush_interval > 0) {
     // Class members cannot be captured in lambda. We need to make a copy to
     // support C++11.
     std::shared_ptr<CheckAggregator> check_aggregator_copy = check_aggregator_;
     std::shared_ptr<ReportAggregator> report_aggregator_copy =
         report_aggregator_;
-    flush_timer_ = options.periodic_timer(
+    flush_timer_ = create_timer(
         flush_interval, [check_aggregator_copy, report_aggregator_copy]() {
           Status status = check_aggregator_copy->Flush();
           if (!status.ok()) {
@@ -78,9 +133,39 @@ ServiceControlClientImpl::ServiceControlClientImpl(
           }
         });
   }
+
+  const ReportAggregationOptions& report_options = options.report_options;
+  if (report_options.num_entries > 0 &&
+      report_options.high_importance_batch_ms > 0) {
+    int max_operations = report_options.max_high_importance_batch_operations;
+    if (max_operations <= 0) {
+      max_operations = std::numeric_limits<int>::max();
+    }
+    // The batcher may send from batch_timer_ callback, so it is given copies
+    // of the members it uses rather than this.
+    TransportReportFunc report_transport_copy = report_transport_;
+    std::shared_ptr<ReportCounters> counters_copy = report_counters_;
+    report_batcher_.reset(new ReportBatcher(
+        max_operations, report_options.max_request_bytes,
+        [report_transport_copy, counters_copy](
+            const ReportRequest& report_request,
+            ReportResponse* report_response, TransportDoneFunc on_done) {
+          report_transport_copy(report_request, report_response, on_done);
+          ++counters_copy->send_reports_in_flight;
+          counters_copy->send_report_operations +=
+              report_request.operations_size();
+        }));
+    std::shared_ptr<ReportBatcher> report_batcher_copy = report_batcher_;
+    batch_timer_ = create_timer(
+        report_options.high_importance_batch_ms,
+        [report_batcher_copy]() { report_batcher_copy->Flush(); });
+  }
 }
 
 ServiceControlClientImpl::~ServiceControlClientImpl() {
+  if (batch_timer_) {
+    batch_timer_->Stop();
+  }
   // Flush out all cached data
   FlushAll();
   if (flush_timer_) {
@@ -98,6 +183,71 @@ ServiceControlClientImpl::~ServiceControlClientImpl() {
   report_aggregator_->SetFlushCallback(NULL);
 }
 
+ServiceControlClientImpl::InFlightChecks::JoinResult
+ServiceControlClientImpl::InFlightChecks::Join(
+    const Signature& signature, const CheckRequest& check_request,
+    CheckRequest* movable_check_request, CheckResponse* check_response,
+    DoneCallback on_check_done) {
+  MutexLock lock(mutex_);
+  auto it = waiters_.find(signature);
+  if (it == waiters_.end()) {
+    waiters_[signature];
+    return SEND_AND_COMPLETE;
+  }
+  if (it->second.size() >= static_cast<size_t>(max_waiters_)) {
+    return SEND;
+  }
+  Waiter waiter;
+  waiter.check_request.reset(new CheckRequest);
+  if (movable_check_request) {
+    waiter.check_request->Swap(movable_check_request);
+  } else {
+    *waiter.check_request = check_request;
+  }
+  waiter.check_response = check_response;
+  waiter.on_check_done = on_check_done;
+  it->second.push_back(std::move(waiter));
+  return PARKED;
+}
+
+void ServiceControlClientImpl::InFlightChecks::Complete(
+    const Signature& signature, const Status& status,
+    const CheckResponse& check_response,
+    const std::shared_ptr<CheckAggregator>& check_aggregator,
+    TransportCheckFunc check_transport) {
+  std::vector<Waiter> waiters;
+  {
+    MutexLock lock(mutex_);
+    auto it = waiters_.find(signature);
+    if (it == waiters_.end()) {
+      return;
+    }
+    waiters.swap(it->second);
+    waiters_.erase(it);
+  }
+
+  // Parked calls are finished without holding the mutex, so their callbacks
+  // can issue new check calls.
+  for (auto& waiter : waiters) {
+    bool refresh = false;
+    if (status.ok()) {
+      Status cache_status = check_aggregator->Check(
+          *waiter.check_request, signature, waiter.check_response);
+      // The cached response is served, but this call has to refresh it.
+      refresh = cache_status.error_code() == Code::ALREADY_EXISTS;
+      if (!cache_status.ok() && !refresh) {
+        // The response could not be cached, or it has been evicted since.
+        *waiter.check_response = check_response;
+      }
+    }
+    waiter.on_check_done(status);
+    if (refresh) {
+      SendRefreshCheck(check_aggregator, check_transport,
+                       waiter.check_request.release(), signature);
+    }
+  }
+}
+
 void ServiceControlClientImpl::CheckFlushCallback(
     const CheckRequest& check_request) {
   CheckResponse* check_response = new CheckResponse;
@@ -124,29 +274,87 @@ void ServiceControlClientImpl::ReportFlushCallback(
                       }
                     });
   ++send_reports_by_flush_;
-  send_report_operations_ += report_request.operations_size();
+  report_counters_->send_report_operations += report_request.operations_size();
 }
 
 void ServiceControlClientImpl::Check(const CheckRequest& check_request,
                                      CheckResponse* check_response,
                                      DoneCallback on_check_done,
                                      TransportCheckFunc check_transport) {
+  Check(check_request, nullptr, check_response, on_check_done,
+        check_transport);
+}
+
+void ServiceControlClientImpl::Check(CheckRequest&& check_request,
+                                     CheckResponse* check_response,
+                                     DoneCallback on_check_done,
+                                     TransportCheckFunc check_transport) {
+  Check(check_request, &check_request, check_response, on_check_done,
+        check_transport);
+}
+
+void ServiceControlClientImpl::Check(CheckRequest&& check_request,
+                                     CheckResponse* check_response,
+                                     DoneCallback on_check_done) {
+  Check(check_request, &check_request, check_response, on_check_done,
+        check_transport_);
+}
+
+void ServiceControlClientImpl::Check(const CheckRequest& check_request,
+                                     CheckRequest* movable_check_request,
+                                     CheckResponse* check_response,
+                                     DoneCallback on_check_done,
+                                     TransportCheckFunc check_transport) {
   ++total_called_checks_;
   if (check_transport == NULL) {
     on_check_done(Status(Code::INVALID_ARGUMENT, "transport is NULL."));
     return;
   }
 
-  Status status = check_aggregator_->Check(check_request, check_response);
+  // High important requests are never cached, so they are not coalesced
+  // either: a parked call could not be answered from the cache. Otherwise
+  // the signature is computed once, for the cache and the in-flight checks.
+  bool coalesce = in_flight_checks_ &&
+                  check_request.operation().importance() == Operation::LOW;
+  Signature signature;
+  Status status;
+  if (coalesce) {
+    signature = GenerateCheckRequestSignature(check_request);
+    status = check_aggregator_->Check(check_request, signature, check_response);
+  } else {
+    status = check_aggregator_->Check(check_request, check_response);
+  }
   if (status.error_code() == Code::NOT_FOUND) {
+    bool complete_in_flight = false;
+    if (coalesce) {
+      switch (in_flight_checks_->Join(signature, check_request,
+                                      movable_check_request, check_response,
+                                      on_check_done)) {
+        case InFlightChecks::PARKED:
+          return;
+        case InFlightChecks::SEND:
+          break;
+        case InFlightChecks::SEND_AND_COMPLETE:
+          complete_in_flight = true;
+          break;
+      }
+    }
+
     // Makes a copy of check_request so that on_done() callback can use
     // it to call CacheResponse.
-    CheckRequest* check_request_copy = new CheckRequest(check_request);
+    CheckRequest* check_request_copy = NewCheckRequestCopy(
+        check_request, movable_check_request);
     std::shared_ptr<CheckAggregator> check_aggregator_copy = check_aggregator_;
+    std::shared_ptr<InFlightChecks> in_flight_checks_copy = in_flight_checks_;
     check_transport(*check_request_copy, check_response,
-                    [check_aggregator_copy, check_request_copy, check_response,
+                    [check_aggregator_copy, in_flight_checks_copy, coalesce,
+                     signature, complete_in_flight, check_request_copy,
+                     check_response, check_transport,
                      on_check_done](Status status) {
-                      if (status.ok()) {
+                      if (status.ok() && coalesce) {
+                        check_aggregator_copy->CacheResponse(
+                            *check_request_copy, signature, *check_response);
+                      } else if (status.ok()) {
                         check_aggregator_copy->CacheResponse(
                             *check_request_copy, *check_response);
                       } else {
@@ -154,11 +362,32 @@ void ServiceControlClientImpl::Check(const CheckRequest& check_request,
                                           << status.error_message();
                       }
                       delete check_request_copy;
+                      // Parked calls copy check_response, so they have to be
+                      // finished before on_check_done() may free it.
+                      if (complete_in_flight) {
+                        in_flight_checks_copy->Complete(
+                            signature, status, *check_response,
+                            check_aggregator_copy, check_transport);
+                      }
                       on_check_done(status);
                     });
     ++send_checks_in_flight_;
     return;
   }
+  if (status.error_code() == Code::ALREADY_EXISTS) {
+    // The cached response is returned right away; the refresh request is
+    // sent after that and its response is only cached.
+    CheckRequest* check_request_copy = NewCheckRequestCopy(
+        check_request, movable_check_request);
+    if (!coalesce) {
+      signature = GenerateCheckRequestSignature(*check_request_copy);
+    }
+    ++send_checks_in_flight_;
+    on_check_done(Status::OK);
+    SendRefreshCheck(check_aggregator_, check_transport, check_request_copy,
+                     signature);
+    return;
+  }
   on_check_done(status);
 }
 
@@ -192,26 +421,81 @@ void ServiceControlClientImpl::Report(const ReportRequest& report_request,
                                       ReportResponse* report_response,
                                       DoneCallback on_report_done,
                                       TransportReportFunc report_transport) {
+  Report(report_request, nullptr, report_response, on_report_done,
+         report_transport, nullptr);
+}
+
+void ServiceControlClientImpl::Report(ReportRequest&& report_request,
+                                      ReportResponse* report_response,
+                                      DoneCallback on_report_done,
+                                      TransportReportFunc report_transport) {
+  Report(report_request, &report_request, report_response, on_report_done,
+         report_transport, nullptr);
+}
+
+void ServiceControlClientImpl::Report(ReportRequest&& report_request,
+                                      ReportResponse* report_response,
+                                      DoneCallback on_report_done) {
+  Report(report_request, &report_request, report_response, on_report_done,
+         report_transport_, report_batcher_.get());
+}
+
+void ServiceControlClientImpl::Report(const ReportRequest& report_request,
+                                      ReportRequest* movable_report_request,
+                                      ReportResponse* report_response,
+                                      DoneCallback on_report_done,
+                                      TransportReportFunc report_transport,
+                                      ReportBatcher* report_batcher) {
   ++total_called_reports_;
   if (report_transport == NULL) {
     on_report_done(Status(Code::INVALID_ARGUMENT, "transport is NULL."));
     return;
   }
 
-  Status status = report_aggregator_->Report(report_request);
+  // High important operations mixed with low important ones are not
+  // aggregated, but sent with this call.
+  ReportRequest high_request;
+  Status status = movable_report_request
+                      ? report_aggregator_->Report(
+                            std::move(*movable_report_request), &high_request)
+                      : report_aggregator_->Report(report_request,
+                                                   &high_request);
   if (status.error_code() == Code::NOT_FOUND) {
-    report_transport(report_request, report_response, on_report_done);
-    ++send_reports_in_flight_;
-    send_report_operations_ += report_request.operations_size();
+    SendReport(report_request, movable_report_request, report_response,
+               on_report_done, report_transport, report_batcher);
+    return;
+  }
+  if (status.ok() && high_request.operations_size() > 0) {
+    SendReport(high_request, &high_request, report_response, on_report_done,
+               report_transport, report_batcher);
     return;
   }
   on_report_done(status);
 }
 
+void ServiceControlClientImpl::SendReport(
+    const ReportRequest& report_request, ReportRequest* movable_report_request,
+    ReportResponse* report_response, DoneCallback on_report_done,
+    TransportReportFunc report_transport, ReportBatcher* report_batcher) {
+  if (report_batcher && movable_report_request) {
+    report_batcher->Add(std::move(*movable_report_request), report_response,
+                        on_report_done);
+    return;
+  }
+  if (report_batcher) {
+    report_batcher->Add(report_request, report_response, on_report_done);
+    return;
+  }
+  report_transport(report_request, report_response, on_report_done);
+  ++report_counters_->send_reports_in_flight;
+  report_counters_->send_report_operations += report_request.operations_size();
+}
+
 void ServiceControlClientImpl::Report(const ReportRequest& report_request,
                                       ReportResponse* report_response,
                                       DoneCallback on_report_done) {
-  Report(report_request, report_response, on_report_done, report_transport_);
+  Report(report_request, nullptr, report_response, on_report_done,
+         report_transport_, report_batcher_.get());
 }
 
 Status ServiceControlClientImpl::Report(const ReportRequest& report_request,
@@ -240,11 +524,19 @@ Status ServiceControlClientImpl::GetStatistics(Statistics* stat) const {
   stat->send_checks_in_flight = send_checks_in_flight_;
   stat->total_called_reports = total_called_reports_;
   stat->send_reports_by_flush = send_reports_by_flush_;
-  stat->send_reports_in_flight = send_reports_in_flight_;
-  stat->send_report_operations = send_report_operations_;
+  stat->send_reports_in_flight = report_counters_->send_reports_in_flight;
+  stat->send_report_operations = report_counters_->send_report_operations;
+  report_aggregator_->GetQueueStatistics(&stat->report_queue_depth,
+                                         &stat->dropped_reports);
   return Status::OK;
 }
 
+void ServiceControlClientImpl::SetMetricKinds(
+    std::shared_ptr<MetricKindMap> metric_kinds) {
+  check_aggregator_->SetMetricKinds(metric_kinds);
+  report_aggregator_->SetMetricKinds(metric_kinds);
+}
+
 int ServiceControlClientImpl::GetNextFlushInterval() {
   int check_interval = check_aggregator_->GetNextFlushInterval();
   int report_interval = report_aggregator_->GetNextFlushInterval();
@@ -268,6 +560,9 @@ Status ServiceControlClientImpl::Flush() {
 }
 
 Status ServiceControlClientImpl::FlushAll() {
+  if (report_batcher_) {
+    report_batcher_->Flush();
+  }
   Status check_status = check_aggregator_->FlushAll();
   Status report_status = report_aggregator_->FlushAll();
   if (!check_status.ok()) {
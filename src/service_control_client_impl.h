@@ -18,9 +18,14 @@ limitations under the License.
 
 #include "include/service_control_client.h"
 #include "src/aggregator_interface.h"
+#include "src/report_batcher.h"
+#include "src/signature.h"
 #include "utils/google_macros.h"
+#include "utils/thread.h"
 
 #include <atomic>
+#include <unordered_map>
+#include <vector>
 
 namespace google {
 namespace service_control_client {
@@ -54,6 +59,16 @@ class ServiceControlClientImpl : public ServiceControlClient {
       ::google::api::servicecontrol::v1::CheckResponse* check_response,
       DoneCallback on_check_done, TransportCheckFunc check_transport);
 
+  // Async check calls moving the check request instead of copying it.
+  virtual void Check(
+      ::google::api::servicecontrol::v1::CheckRequest&& check_request,
+      ::google::api::servicecontrol::v1::CheckResponse* check_response,
+      DoneCallback on_check_done);
+  virtual void Check(
+      ::google::api::servicecontrol::v1::CheckRequest&& check_request,
+      ::google::api::servicecontrol::v1::CheckResponse* check_response,
+      DoneCallback on_check_done, TransportCheckFunc check_transport);
+
   // An async report call.
   virtual void Report(
       const ::google::api::servicecontrol::v1::ReportRequest& report_request,
@@ -67,13 +82,113 @@ class ServiceControlClientImpl : public ServiceControlClient {
 
   virtual ::google::protobuf::util::Status GetStatistics(
       Statistics* stat) const;
+
+  // Replaces the metric kinds.
+  virtual void SetMetricKinds(std::shared_ptr<MetricKindMap> metric_kinds);
   // A report call with per_request transport.
   virtual void Report(
       const ::google::api::servicecontrol::v1::ReportRequest& report_request,
       ::google::api::servicecontrol::v1::ReportResponse* report_response,
       DoneCallback on_report_done, TransportReportFunc report_transport);
 
+  // Async report calls moving the operations instead of copying them.
+  virtual void Report(
+      ::google::api::servicecontrol::v1::ReportRequest&& report_request,
+      ::google::api::servicecontrol::v1::ReportResponse* report_response,
+      DoneCallback on_report_done);
+  virtual void Report(
+      ::google::api::servicecontrol::v1::ReportRequest&& report_request,
+      ::google::api::servicecontrol::v1::ReportResponse* report_response,
+      DoneCallback on_report_done, TransportReportFunc report_transport);
+
  private:
+  // Tracks check requests sent to the server because of a cache miss, keyed
+  // by request signature, together with the identical check calls parked on
+  // them. Thread safe.
+  class InFlightChecks {
+   public:
+    // What a cache missed check call should do.
+    enum JoinResult {
+      // No identical request is in flight. The caller sends its request and
+      // has to call Complete() with the signature once it is done.
+      SEND_AND_COMPLETE,
+      // An identical request is in flight. The call has been parked and will
+      // be finished by Complete().
+      PARKED,
+      // An identical request is in flight but too many calls are already
+      // parked on it. The caller sends its request without coalescing.
+      SEND,
+    };
+
+    explicit InFlightChecks(int max_waiters) : max_waiters_(max_waiters) {}
+
+    // Registers a cache missed check call. A parked call swaps its request
+    // out of movable_check_request if not NULL.
+    JoinResult Join(
+        const Signature& signature,
+        const ::google::api::servicecontrol::v1::CheckRequest& check_request,
+        ::google::api::servicecontrol::v1::CheckRequest* movable_check_request,
+        ::google::api::servicecontrol::v1::CheckResponse* check_response,
+        DoneCallback on_check_done);
+
+    // Finishes all calls parked on the in-flight request with the signature.
+    // If the request succeeded, its response has been cached already; each
+    // parked call is answered from check_aggregator so its own quota and
+    // metrics are aggregated, falling back to a copy of check_response. If
+    // the cached response is due for a refresh, the parked call sends it
+    // with check_transport.
+    void Complete(
+        const Signature& signature,
+        const ::google::protobuf::util::Status& status,
+        const ::google::api::servicecontrol::v1::CheckResponse& check_response,
+        const std::shared_ptr<CheckAggregator>& check_aggregator,
+        TransportCheckFunc check_transport);
+
+   private:
+    // A check call parked on an in-flight request.
+    struct Waiter {
+      std::unique_ptr<::google::api::servicecontrol::v1::CheckRequest>
+          check_request;
+      ::google::api::servicecontrol::v1::CheckResponse* check_response;
+      DoneCallback on_check_done;
+    };
+
+    // The maximum number of calls parked on one in-flight request.
+    const int max_waiters_;
+    // Mutex guarding waiters_.
+    Mutex mutex_;
+    // Maps the signature of each in-flight request to its parked calls.
+    std::unordered_map<Signature, std::vector<Waiter>> waiters_;
+  };
+
+  // A check call. If movable_check_request is not NULL, it is the same
+  // request and it is swapped out instead of copied.
+  void Check(
+      const ::google::api::servicecontrol::v1::CheckRequest& check_request,
+      ::google::api::servicecontrol::v1::CheckRequest* movable_check_request,
+      ::google::api::servicecontrol::v1::CheckResponse* check_response,
+      DoneCallback on_check_done, TransportCheckFunc check_transport);
+
+  // A report call sending its request through report_batcher if not NULL.
+  // If movable_report_request is not NULL, it is the same request and its
+  // operations are moved out instead of copied.
+  void Report(
+      const ::google::api::servicecontrol::v1::ReportRequest& report_request,
+      ::google::api::servicecontrol::v1::ReportRequest* movable_report_request,
+      ::google::api::servicecontrol::v1::ReportResponse* report_response,
+      DoneCallback on_report_done, TransportReportFunc report_transport,
+      ReportBatcher* report_batcher);
+
+  // Sends a report request to the server through report_batcher if not NULL,
+  // or report_transport. If movable_report_request is not NULL, it is the
+  // same request and it is moved into report_batcher instead of copied.
+  void SendReport(
+      const ::google::api::servicecontrol::v1::ReportRequest& report_request,
+      ::google::api::servicecontrol::v1::ReportRequest* movable_report_request,
+      ::google::api::servicecontrol::v1::ReportResponse* report_response,
+      DoneCallback on_report_done, TransportReportFunc report_transport,
+      ReportBatcher* report_batcher);
+
   // A flush callback for check.
   void CheckFlushCallback(
       const ::google::api::servicecontrol::v1::CheckRequest& check_request);
@@ -98,6 +213,8 @@ class ServiceControlClientImpl : public ServiceControlClient {
 
   // The Timer object.
   std::shared_ptr<PeriodicTimer> flush_timer_;
+  // The timer sending the batch of report_batcher_.
+  std::shared_ptr<PeriodicTimer> batch_timer_;
 
   // Atomic object to deal with multi-threads situation.
   std::atomic_int_fast64_t total_called_checks_;
@@ -105,8 +222,15 @@ class ServiceControlClientImpl : public ServiceControlClient {
   std::atomic_int_fast64_t send_checks_in_flight_;
   std::atomic_int_fast64_t total_called_reports_;
   std::atomic_int_fast64_t send_reports_by_flush_;
-  std::atomic_int_fast64_t send_reports_in_flight_;
-  std::atomic_int_fast64_t send_report_operations_;
+
+  // Counters of the report requests sent in flight and of the operations
+  // sent. Uses shared_ptr since they are also updated by the transport of
+  // report_batcher_, which is passed to batch_timer_ callback.
+  struct ReportCounters {
+    std::atomic_int_fast64_t send_reports_in_flight;
+    std::atomic_int_fast64_t send_report_operations;
+  };
+  std::shared_ptr<ReportCounters> report_counters_;
 
   // The check aggregator object. Uses shared_ptr for check_aggregator_.
   // Transport::on_check_done() callback needs to call check_aggregator_
@@ -114,10 +238,20 @@ class ServiceControlClientImpl : public ServiceControlClient {
   // of check_aggregator_ to make sure it is not freed.
   std::shared_ptr<CheckAggregator> check_aggregator_;
 
+  // The in-flight check requests that cache missed check calls coalesce on.
+  // NULL if coalescing is disabled. Uses shared_ptr for the same reason as
+  // check_aggregator_.
+  std::shared_ptr<InFlightChecks> in_flight_checks_;
+
   // The report aggregator object. report_aggregator_ has to be shared_ptr since
   // it will be passed to flush_timer callback.
   std::shared_ptr<ReportAggregator> report_aggregator_;
 
+  // Batches the report requests of high importance operations sent with
+  // report_transport_. NULL if they are not batched. Uses shared_ptr since it
+  // is passed to batch_timer_ callback.
+  std::shared_ptr<ReportBatcher> report_batcher_;
+
   GOOGLE_DISALLOW_EVIL_CONSTRUCTORS(ServiceControlClientImpl);
 };
 
@@ -1231,6 +1231,251 @@ TEST_F(ServiceControlClientImplTest, TestFailedNonCachedCheckUsingThread) {
   }
 }
 
+TEST_F(ServiceControlClientImplTest, TestCoalescedCheckWithStoredCallback) {
+  // Up to 2 identical cache missed checks wait for the in-flight one.
+  ServiceControlClientOptions options(
+      CheckAggregationOptions(10 /*entries */, 500 /* refresh_interval_ms */,
+                              1000 /* expiration_ms */, 1 /* shards */,
+                              2 /* coalesced_checks */),
+      ReportAggregationOptions(1 /* entries */, 500 /*flush_interval_ms*/));
+  options.check_transport = mock_check_transport_.GetFunc();
+  client_ = CreateServiceControlClient(kServiceName, kServiceConfigId, options);
+
+  // The first check and the one over the limit are sent to the server.
+  EXPECT_CALL(mock_check_transport_, Check(_, _, _))
+      .Times(2)
+      .WillRepeatedly(Invoke(&mock_check_transport_,
+                             &MockCheckTransport::CheckWithStoredCallback));
+  mock_check_transport_.check_response_ = &pass_check_response1_;
+
+  const int kNumChecks = 4;
+  CheckResponse check_responses[kNumChecks];
+  Status done_status[kNumChecks];
+  for (int i = 0; i < kNumChecks; i++) {
+    done_status[i] = Status::UNKNOWN;
+    Status* status_ptr = &done_status[i];
+    client_->Check(check_request1_, &check_responses[i],
+                   [status_ptr](Status status) { *status_ptr = status; });
+  }
+  EXPECT_TRUE(Mock::VerifyAndClearExpectations(&mock_check_transport_));
+  ASSERT_EQ(mock_check_transport_.on_done_vector_.size(), 2);
+  for (int i = 0; i < kNumChecks; i++) {
+    EXPECT_EQ(done_status[i], Status::UNKNOWN);
+  }
+
+  // Completing the first check finishes the parked ones from the cache.
+  mock_check_transport_.on_done_vector_[0](Status::OK);
+  for (int i = 0; i < 3; i++) {
+    EXPECT_OK(done_status[i]);
+    EXPECT_TRUE(MessageDifferencer::Equals(pass_check_response1_,
+                                           check_responses[i]));
+  }
+  EXPECT_EQ(done_status[3], Status::UNKNOWN);
+  mock_check_transport_.on_done_vector_[1](Status::OK);
+  EXPECT_OK(done_status[3]);
+
+  Statistics stat;
+  EXPECT_OK(client_->GetStatistics(&stat));
+  EXPECT_EQ(stat.total_called_checks, kNumChecks);
+  EXPECT_EQ(stat.send_checks_in_flight, 2);
+
+  // The quota of the parked checks was aggregated in the cache, so it is
+  // flushed out when the client is destroyed.
+  EXPECT_CALL(mock_check_transport_, Check(_, _, _))
+      .WillOnce(Invoke(&mock_check_transport_,
+                       &MockCheckTransport::CheckUsingThread));
+}
+
+TEST_F(ServiceControlClientImplTest, TestCoalescedCheckFailed) {
+  // Parked checks get the failure of the in-flight check.
+  ServiceControlClientOptions options(
+      CheckAggregationOptions(10 /*entries */, 500 /* refresh_interval_ms */,
+                              1000 /* expiration_ms */, 1 /* shards */,
+                              10 /* coalesced_checks */),
+      ReportAggregationOptions(1 /* entries */, 500 /*flush_interval_ms*/));
+  options.check_transport = mock_check_transport_.GetFunc();
+  client_ = CreateServiceControlClient(kServiceName, kServiceConfigId, options);
+
+  EXPECT_CALL(mock_check_transport_, Check(_, _, _))
+      .WillOnce(Invoke(&mock_check_transport_,
+                       &MockCheckTransport::CheckWithStoredCallback));
+
+  CheckResponse check_response1;
+  Status done_status1 = Status::UNKNOWN;
+  client_->Check(check_request1_, &check_response1,
+                 [&done_status1](Status status) { done_status1 = status; });
+  CheckResponse check_response2;
+  Status done_status2 = Status::UNKNOWN;
+  client_->Check(check_request1_, &check_response2,
+                 [&done_status2](Status status) { done_status2 = status; });
+  EXPECT_TRUE(Mock::VerifyAndClearExpectations(&mock_check_transport_));
+
+  mock_check_transport_.on_done_vector_[0](Status::CANCELLED);
+  EXPECT_EQ(done_status1, Status::CANCELLED);
+  EXPECT_EQ(done_status2, Status::CANCELLED);
+
+  // Nothing is in flight anymore, so the next check is sent again.
+  InternalTestNonCachedCheckWithStoredCallback(check_request1_, Status::OK,
+                                               &pass_check_response1_);
+}
+
+TEST_F(ServiceControlClientImplTest, TestCoalescedCheckRefreshesStaleResponse) {
+  // A parked check finding the cached response due for a refresh sends it.
+  ServiceControlClientOptions options(
+      CheckAggregationOptions(10 /*entries */, 10 /* refresh_interval_ms */,
+                              1000 /* expiration_ms */, 1 /* shards */,
+                              10 /* coalesced_checks */,
+                              1000 /* stale_response_ms */),
+      ReportAggregationOptions(1 /* entries */, 500 /*flush_interval_ms*/));
+  options.check_transport = mock_check_transport_.GetFunc();
+  client_ = CreateServiceControlClient(kServiceName, kServiceConfigId, options);
+
+  EXPECT_CALL(mock_check_transport_, Check(_, _, _))
+      .WillOnce(Invoke(&mock_check_transport_,
+                       &MockCheckTransport::CheckWithStoredCallback));
+  mock_check_transport_.check_response_ = &pass_check_response1_;
+
+  CheckResponse check_response1;
+  Status done_status1 = Status::UNKNOWN;
+  client_->Check(check_request1_, &check_response1,
+                 [&done_status1](Status status) { done_status1 = status; });
+  // The first parked check takes longer than the refresh interval to finish.
+  CheckResponse check_response2;
+  Status done_status2 = Status::UNKNOWN;
+  client_->Check(check_request1_, &check_response2,
+                 [&done_status2](Status status) {
+                   done_status2 = status;
+                   usleep(20000);
+                 });
+  CheckResponse check_response3;
+  Status done_status3 = Status::UNKNOWN;
+  client_->Check(check_request1_, &check_response3,
+                 [&done_status3](Status status) { done_status3 = status; });
+  EXPECT_TRUE(Mock::VerifyAndClearExpectations(&mock_check_transport_));
+
+  // The second parked check is answered with the cached response, and
+  // refreshes it.
+  EXPECT_CALL(mock_check_transport_, Check(_, _, _))
+      .WillOnce(Invoke(&mock_check_transport_,
+                       &MockCheckTransport::CheckWithStoredCallback));
+  mock_check_transport_.on_done_vector_[0](Status::OK);
+  EXPECT_TRUE(Mock::VerifyAndClearExpectations(&mock_check_transport_));
+  EXPECT_OK(done_status1);
+  EXPECT_OK(done_status2);
+  EXPECT_OK(done_status3);
+  EXPECT_TRUE(
+      MessageDifferencer::Equals(pass_check_response1_, check_response3));
+  ASSERT_EQ(mock_check_transport_.on_done_vector_.size(), 2);
+  EXPECT_TRUE(MessageDifferencer::Equals(mock_check_transport_.check_request_,
+                                         check_request1_));
+  mock_check_transport_.on_done_vector_[1](Status::OK);
+
+  // The quota aggregated by the parked checks is flushed out when the client
+  // is destroyed.
+  EXPECT_CALL(mock_check_transport_, Check(_, _, _))
+      .WillOnce(Invoke(&mock_check_transport_,
+                       &MockCheckTransport::CheckUsingThread));
+}
+
+TEST_F(ServiceControlClientImplTest, TestStaleCheckRefreshedInBackground) {
+  // Cached responses are served for up to 1 second while being refreshed.
+  ServiceControlClientOptions options(
+      CheckAggregationOptions(10 /*entries */, 100 /* refresh_interval_ms */,
+                              1000 /* expiration_ms */, 1 /* shards */,
+                              0 /* coalesced_checks */,
+                              1000 /* stale_response_ms */),
+      ReportAggregationOptions(1 /* entries */, 500 /*flush_interval_ms*/));
+  options.check_transport = mock_check_transport_.GetFunc();
+  client_ = CreateServiceControlClient(kServiceName, kServiceConfigId, options);
+
+  InternalTestNonCachedCheckWithStoredCallback(check_request1_, Status::OK,
+                                               &pass_check_response1_);
+  // sleep 0.12 second to pass the refresh interval.
+  usleep(120000);
+
+  // The refresh request is sent, but the check is done with the cached
+  // response right away.
+  EXPECT_CALL(mock_check_transport_, Check(_, _, _))
+      .WillOnce(Invoke(&mock_check_transport_,
+                       &MockCheckTransport::CheckWithStoredCallback));
+  mock_check_transport_.check_response_ = &error_check_response1_;
+  CheckResponse check_response;
+  Status done_status = Status::UNKNOWN;
+  client_->Check(check_request1_, &check_response,
+                 [&done_status](Status status) { done_status = status; });
+  EXPECT_TRUE(Mock::VerifyAndClearExpectations(&mock_check_transport_));
+  EXPECT_OK(done_status);
+  EXPECT_TRUE(
+      MessageDifferencer::Equals(pass_check_response1_, check_response));
+
+  // Once the refresh is done, its response is cached.
+  mock_check_transport_.on_done_vector_.back()(Status::OK);
+  InternalTestCachedCheck(check_request1_, error_check_response1_);
+
+  Statistics stat;
+  EXPECT_OK(client_->GetStatistics(&stat));
+  EXPECT_EQ(stat.total_called_checks, 3);
+  EXPECT_EQ(stat.send_checks_in_flight, 2);
+
+  // The quota aggregated before the refresh is flushed out when the client
+  // is destroyed.
+  EXPECT_CALL(mock_check_transport_, Check(_, _, _))
+      .WillOnce(Invoke(&mock_check_transport_,
+                       &MockCheckTransport::CheckUsingThread));
+}
+
+TEST_F(ServiceControlClientImplTest, TestMovedCheckRequestCached) {
+  // A moved check request is sent and its response cached as a copied one.
+  EXPECT_CALL(mock_check_transport_, Check(_, _, _))
+      .WillOnce(Invoke(&mock_check_transport_,
+                       &MockCheckTransport::CheckWithStoredCallback));
+  mock_check_transport_.check_response_ = &pass_check_response1_;
+
+  CheckRequest check_request = check_request1_;
+  CheckResponse check_response;
+  Status done_status = Status::UNKNOWN;
+  client_->Check(std::move(check_request), &check_response,
+                 [&done_status](Status status) { done_status = status; });
+  ASSERT_EQ(mock_check_transport_.on_done_vector_.size(), 1);
+  EXPECT_TRUE(MessageDifferencer::Equals(mock_check_transport_.check_request_,
+                                         check_request1_));
+  mock_check_transport_.on_done_vector_[0](Status::OK);
+  EXPECT_OK(done_status);
+  EXPECT_TRUE(Mock::VerifyAndClearExpectations(&mock_check_transport_));
+
+  InternalTestCachedCheck(check_request1_, pass_check_response1_);
+
+  // There is a cached check request in the cache. When client is destroyed,
+  // it will call Transport Check.
+  EXPECT_CALL(mock_check_transport_, Check(_, _, _))
+      .WillOnce(Invoke(&mock_check_transport_,
+                       &MockCheckTransport::CheckUsingThread));
+}
+
+TEST_F(ServiceControlClientImplTest, TestMovedReportRequestsCached) {
+  // Moved report requests are aggregated as copied ones.
+  ReportRequest report_request1 = report_request1_;
+  ReportRequest report_request2 = report_request2_;
+  ReportResponse report_response;
+  Status done_status1 = Status::UNKNOWN;
+  client_->Report(std::move(report_request1), &report_response,
+                  [&done_status1](Status status) { done_status1 = status; });
+  EXPECT_OK(done_status1);
+  Status done_status2 = Status::UNKNOWN;
+  client_->Report(std::move(report_request2), &report_response,
+                  [&done_status2](Status status) { done_status2 = status; });
+  EXPECT_OK(done_status2);
+
+  EXPECT_CALL(mock_report_transport_, Report(_, _, _))
+      .WillOnce(Invoke(&mock_report_transport_,
+                       &MockReportTransport::ReportWithStoredCallback));
+  client_.reset();
+  ASSERT_EQ(mock_report_transport_.on_done_vector_.size(), 1);
+  EXPECT_TRUE(MessageDifferencer::Equals(mock_report_transport_.report_request_,
+                                         merged_report_request_));
+  mock_report_transport_.on_done_vector_[0](Status::OK);
+}
+
 TEST_F(ServiceControlClientImplTest, TestCachedReportWithStoredCallback) {
   // Calls Client::Report() with request1, it should be cached.
   // Calls Client::Report() with request2, it should be cached.
@@ -1656,6 +1901,46 @@ TEST_F(ServiceControlClientImplTest,
   EXPECT_ERROR_CODE(Code::PERMISSION_DENIED, done_status);
 }
 
+TEST_F(ServiceControlClientImplTest,
+       TestMixedImportanceReportWithPerRequestTransport) {
+  // Calls Client::Report with a request mixing a high important operation
+  // with a low important one. Only the high important one is sent with the
+  // per request transport, and its status is passed to on_report_done.
+  MockReportTransport stack_mock_report_transport;
+  EXPECT_CALL(stack_mock_report_transport, Report(_, _, _))
+      .WillOnce(Invoke(&stack_mock_report_transport,
+                       &MockReportTransport::ReportWithStoredCallback));
+  // The low important operation is only flushed out at destruction.
+  EXPECT_CALL(mock_report_transport_, Report(_, _, _))
+      .WillOnce(Invoke(&mock_report_transport_,
+                       &MockReportTransport::ReportWithInplaceCallback));
+
+  ReportResponse report_response;
+  Status done_status = Status::UNKNOWN;
+  report_request1_.mutable_operations(0)->set_importance(Operation::HIGH);
+  ReportRequest mixed_request = report_request1_;
+  *mixed_request.add_operations() = report_request2_.operations(0);
+  client_->Report(mixed_request, &report_response,
+                  [&done_status](Status status) { done_status = status; },
+                  stack_mock_report_transport.GetFunc());
+  EXPECT_EQ(done_status, Status::UNKNOWN);
+
+  ASSERT_EQ(stack_mock_report_transport.on_done_vector_.size(), 1);
+  EXPECT_TRUE(MessageDifferencer::Equals(
+      stack_mock_report_transport.report_request_, report_request1_));
+
+  stack_mock_report_transport.on_done_vector_[0](
+      Status(Code::PERMISSION_DENIED, ""));
+  EXPECT_ERROR_CODE(Code::PERMISSION_DENIED, done_status);
+
+  // The low important operation is aggregated.
+  Statistics stat;
+  EXPECT_OK(client_->GetStatistics(&stat));
+  EXPECT_EQ(stat.total_called_reports, 1);
+  EXPECT_EQ(stat.send_reports_by_flush, 0);
+  EXPECT_EQ(stat.send_report_operations, 1);
+}
+
 TEST_F(ServiceControlClientImplTest, TestNonCachedReportWithInplaceCallback) {
   // Calls Client::Report with a high important request, it will not be cached.
   // Transport::Report() should be called.
@@ -1791,6 +2076,81 @@ TEST_F(ServiceControlClientImplTest, TestNonCachedBlockingReportUsingThread) {
   EXPECT_ERROR_CODE(Code::PERMISSION_DENIED, done_status);
 }
 
+TEST_F(ServiceControlClientImplTest, TestBatchedHighImportanceReports) {
+  // High important reports are batched for 10ms, or up to 2 operations.
+  ServiceControlClientOptions options(
+      CheckAggregationOptions(1 /*entries */, 500 /* refresh_interval_ms */,
+                              1000 /* expiration_ms */),
+      ReportAggregationOptions(1 /* entries */, 500 /*flush_interval_ms*/,
+                               512 * 1024 /* max_report_request_bytes */,
+                               10 /* high_importance_batch_window_ms */,
+                               2 /* high_importance_batch_operations */));
+
+  MockPeriodicTimer mock_timer;
+  options.report_transport = mock_report_transport_.GetFunc();
+  options.periodic_timer = mock_timer.GetFunc();
+  // The flush timer, then the batch timer.
+  EXPECT_CALL(mock_timer, StartTimer(_, _))
+      .Times(2)
+      .WillRepeatedly(Invoke(&mock_timer, &MockPeriodicTimer::MyStartTimer));
+
+  client_ = CreateServiceControlClient(kServiceName, kServiceConfigId, options);
+  ASSERT_EQ(mock_timer.interval_ms_, 10);
+
+  report_request1_.mutable_operations(0)->set_importance(Operation::HIGH);
+  report_request2_.mutable_operations(0)->set_importance(Operation::HIGH);
+  ReportResponse report_response1;
+  ReportResponse report_response2;
+  ReportResponse report_response3;
+  Status done_status1 = Status::UNKNOWN;
+  Status done_status2 = Status::UNKNOWN;
+  Status done_status3 = Status::UNKNOWN;
+
+  // The first report waits for the batch to fill up.
+  client_->Report(report_request1_, &report_response1,
+                  [&done_status1](Status status) { done_status1 = status; });
+  EXPECT_TRUE(mock_report_transport_.on_done_vector_.empty());
+
+  // The second one fills it up, so it is sent.
+  EXPECT_CALL(mock_report_transport_, Report(_, _, _))
+      .Times(2)
+      .WillRepeatedly(Invoke(&mock_report_transport_,
+                             &MockReportTransport::ReportWithStoredCallback));
+  client_->Report(report_request2_, &report_response2,
+                  [&done_status2](Status status) { done_status2 = status; });
+  ASSERT_EQ(mock_report_transport_.on_done_vector_.size(), 1);
+  ASSERT_EQ(mock_report_transport_.report_request_.operations_size(), 2);
+  EXPECT_TRUE(MessageDifferencer::Equals(
+      mock_report_transport_.report_request_.operations(0),
+      report_request1_.operations(0)));
+  EXPECT_TRUE(MessageDifferencer::Equals(
+      mock_report_transport_.report_request_.operations(1),
+      report_request2_.operations(0)));
+
+  // Both calls complete with the status of the batch.
+  mock_report_transport_.on_done_vector_[0](
+      Status(Code::PERMISSION_DENIED, ""));
+  EXPECT_ERROR_CODE(Code::PERMISSION_DENIED, done_status1);
+  EXPECT_ERROR_CODE(Code::PERMISSION_DENIED, done_status2);
+
+  // A partial batch is sent by the timer.
+  client_->Report(report_request1_, &report_response3,
+                  [&done_status3](Status status) { done_status3 = status; });
+  EXPECT_EQ(mock_report_transport_.on_done_vector_.size(), 1);
+  mock_timer.callback_();
+  ASSERT_EQ(mock_report_transport_.on_done_vector_.size(), 2);
+  EXPECT_TRUE(MessageDifferencer::Equals(mock_report_transport_.report_request_,
+                                         report_request1_));
+  mock_report_transport_.on_done_vector_[1](Status::OK);
+  EXPECT_OK(done_status3);
+
+  Statistics stat;
+  EXPECT_OK(client_->GetStatistics(&stat));
+  EXPECT_EQ(stat.total_called_reports, 3);
+  EXPECT_EQ(stat.send_reports_in_flight, 2);
+  EXPECT_EQ(stat.send_report_operations, 3);
+}
+
 TEST_F(ServiceControlClientImplTest, TestFlushIntervalReportNeverFlush) {
   // With periodic_timer, report flush interval is -1, Check flush interval is
   // 1000, so the overall flush interval is 1000
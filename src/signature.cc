@@ -14,7 +14,10 @@ limitations under the License.
 ==============================================================================*/
 
 #include "src/signature.h"
-#include "utils/md5.h"
+#include "utils/murmur3.h"
+
+#include <algorithm>
+#include <vector>
 
 using std::string;
 using google::api::servicecontrol::v1::CheckRequest;
@@ -27,11 +30,38 @@ namespace {
 const char kDelimiter[] = "\0";
 const int kDelimiterLength = 1;
 
+// Requests with up to this many labels in one map are hashed without heap
+// allocation.
+const int kMaxStackLabels = 32;
+
+typedef ::google::protobuf::MapPair<string, string> Label;
+
 // Updates the give hasher with the given labels.
+//
+// Labels are hashed in key order, so the signature does not depend on the
+// iteration order of the map. Sorting pointers to the labels hashes exactly
+// the same bytes as copying them into an ordered map did, so signatures, and
+// their collision resistance, are unchanged.
 void UpdateHashLabels(const ::google::protobuf::Map<string, string>& labels,
-                      MD5* hasher) {
-  std::map<string, string> ordered_labels(labels.begin(), labels.end());
-  for (const auto& label : ordered_labels) {
+                      Hasher128* hasher) {
+  const int num_labels = labels.size();
+  const Label* stack_labels[kMaxStackLabels];
+  std::vector<const Label*> heap_labels;
+  const Label** ordered_labels = stack_labels;
+  if (num_labels > kMaxStackLabels) {
+    heap_labels.resize(num_labels);
+    ordered_labels = heap_labels.data();
+  }
+
+  int i = 0;
+  for (const auto& label : labels) {
+    ordered_labels[i++] = &label;
+  }
+  std::sort(ordered_labels, ordered_labels + num_labels,
+            [](const Label* a, const Label* b) { return a->first < b->first; });
+
+  for (i = 0; i < num_labels; ++i) {
+    const Label& label = *ordered_labels[i];
     // Note we must use the Update(void const *data, int size) function here
     // for the delimiter instead of Update(StringPiece data), because
     // StringPiece would use strlen and gets zero length.
@@ -43,53 +73,71 @@ void UpdateHashLabels(const ::google::protobuf::Map<string, string>& labels,
 }
 
 // Updates the give hasher with the given metric value.
-void UpdateHashMetricValue(const MetricValue& metric_value, MD5* hasher) {
+void UpdateHashMetricValue(const MetricValue& metric_value,
+                           Hasher128* hasher) {
   UpdateHashLabels(metric_value.labels(), hasher);
+  if (metric_value.value_case() == MetricValue::kMoneyValue) {
+    hasher->Update(kDelimiter, kDelimiterLength);
+    hasher->Update(metric_value.money_value().currency_code());
+  }
 }
 }  // namespace
 
-string GenerateReportOperationSignature(const Operation& operation) {
-  MD5 hasher;
-  hasher.Update(operation.consumer_id());
-  hasher.Update(kDelimiter, kDelimiterLength);
-  hasher.Update(operation.operation_name());
+Signature GenerateReportOperationSignature(const Operation& operation) {
+  Murmur3Hasher128 hasher;
+  return GenerateReportOperationSignature(operation, &hasher);
+}
+
+Signature GenerateReportOperationSignature(const Operation& operation,
+                                           Hasher128* hasher) {
+  hasher->Update(operation.consumer_id());
+  hasher->Update(kDelimiter, kDelimiterLength);
+  hasher->Update(operation.operation_name());
 
-  UpdateHashLabels(operation.labels(), &hasher);
+  UpdateHashLabels(operation.labels(), hasher);
 
-  return hasher.Digest();
+  return hasher->Digest();
 }
 
-string GenerateReportMetricValueSignature(const MetricValue& metric_value) {
-  MD5 hasher;
+Signature GenerateReportMetricValueSignature(const MetricValue& metric_value) {
+  Murmur3Hasher128 hasher;
+  return GenerateReportMetricValueSignature(metric_value, &hasher);
+}
 
-  UpdateHashMetricValue(metric_value, &hasher);
-  return hasher.Digest();
+Signature GenerateReportMetricValueSignature(const MetricValue& metric_value,
+                                             Hasher128* hasher) {
+  UpdateHashMetricValue(metric_value, hasher);
+  return hasher->Digest();
 }
 
-string GenerateCheckRequestSignature(const CheckRequest& request) {
-  MD5 hasher;
+Signature GenerateCheckRequestSignature(const CheckRequest& request) {
+  Murmur3Hasher128 hasher;
+  return GenerateCheckRequestSignature(request, &hasher);
+}
 
+Signature GenerateCheckRequestSignature(const CheckRequest& request,
+                                        Hasher128* hasher) {
   const Operation& operation = request.operation();
-  hasher.Update(operation.operation_name());
+  hasher->Update(operation.operation_name());
 
-  hasher.Update(kDelimiter, kDelimiterLength);
-  hasher.Update(operation.consumer_id());
+  hasher->Update(kDelimiter, kDelimiterLength);
+  hasher->Update(operation.consumer_id());
 
-  hasher.Update(kDelimiter, kDelimiterLength);
-  UpdateHashLabels(operation.labels(), &hasher);
+  hasher->Update(kDelimiter, kDelimiterLength);
+  UpdateHashLabels(operation.labels(), hasher);
 
   for (const auto& metric_value_set : operation.metric_value_sets()) {
-    hasher.Update(kDelimiter, kDelimiterLength);
-    hasher.Update(metric_value_set.metric_name());
+    hasher->Update(kDelimiter, kDelimiterLength);
+    hasher->Update(metric_value_set.metric_name());
 
     for (const auto& metric_value : metric_value_set.metric_values()) {
-      UpdateHashMetricValue(metric_value, &hasher);
+      UpdateHashMetricValue(metric_value, hasher);
     }
   }
 
-  hasher.Update(kDelimiter, kDelimiterLength);
+  hasher->Update(kDelimiter, kDelimiterLength);
 
-  return hasher.Digest();
+  return hasher->Digest();
 }
 
 }  // namespace service_control_client
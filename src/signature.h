@@ -19,29 +19,41 @@ limitations under the License.
 #ifndef GOOGLE_SERVICE_CONTROL_CLIENT_SIGNATURE_H_
 #define GOOGLE_SERVICE_CONTROL_CLIENT_SIGNATURE_H_
 
-#include <string>
 #include "google/api/servicecontrol/v1/metric_value.pb.h"
 #include "google/api/servicecontrol/v1/operation.pb.h"
 #include "google/api/servicecontrol/v1/service_controller.pb.h"
+#include "utils/hasher128.h"
 
 namespace google {
 namespace service_control_client {
 
+// A signature is a 128-bit digest of the request fields it depends on. By
+// default it is computed by Murmur3Hasher128. Each function below also takes
+// an optional hasher to compute it with instead; such hasher must not have
+// been updated yet.
+typedef Digest128 Signature;
+
 // Generates signature for an operation based on operation name and operation
 // labels. Should be used only for report requests.
 //
 // Operations having the same signature can be aggregated or batched. Assuming
 // all operations belong to the same service.
-std::string GenerateReportOperationSignature(
+Signature GenerateReportOperationSignature(
     const ::google::api::servicecontrol::v1::Operation& operation);
+Signature GenerateReportOperationSignature(
+    const ::google::api::servicecontrol::v1::Operation& operation,
+    Hasher128* hasher);
 
 // Generates signature for a metric value based on metric value labels, and
 // currency code(For money value only). Should be used only for report requests.
 //
 // metric value with the same metric name and metric value signature can be
 // merged.
-std::string GenerateReportMetricValueSignature(
+Signature GenerateReportMetricValueSignature(
     const ::google::api::servicecontrol::v1::MetricValue& metric_value);
+Signature GenerateReportMetricValueSignature(
+    const ::google::api::servicecontrol::v1::MetricValue& metric_value,
+    Hasher128* hasher);
 
 // Generates signature for a check request. Operation name, consumer id,
 // operation labels, metric name, metric value labels, currency code(For money
@@ -50,8 +62,11 @@ std::string GenerateReportMetricValueSignature(
 //
 // Check request having the same signature can be aggregated. Assuming all
 // requests belong to the same service.
-std::string GenerateCheckRequestSignature(
+Signature GenerateCheckRequestSignature(
     const ::google::api::servicecontrol::v1::CheckRequest& request);
+Signature GenerateCheckRequestSignature(
+    const ::google::api::servicecontrol::v1::CheckRequest& request,
+    Hasher128* hasher);
 
 }  // namespace service_control_client
 }  // namespace google
@@ -0,0 +1,141 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Compares the cost of request signatures computed with MD5 and with the
+// default Murmur3 hasher.
+//
+// Usage: signature_benchmark [iterations]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <functional>
+#include <string>
+
+#include "google/protobuf/text_format.h"
+#include "src/signature.h"
+#include "utils/md5.h"
+#include "utils/murmur3.h"
+
+using std::string;
+using ::google::api::servicecontrol::v1::CheckRequest;
+using ::google::api::servicecontrol::v1::Operation;
+using ::google::protobuf::TextFormat;
+
+namespace google {
+namespace service_control_client {
+namespace {
+
+const char kCheckRequest[] = R"(
+service_name: "library.googleapis.com"
+operation {
+  operation_id: "operation-1"
+  operation_name: "check-quota"
+  consumer_id: "project:some-consumer"
+  labels {
+    key: "cloud.googleapis.com/location"
+    value: "us-central1"
+  }
+  labels {
+    key: "cloud.googleapis.com/resource_type"
+    value: "some-resource_type"
+  }
+  labels {
+    key: "serviceruntime.googleapis.com/api_method"
+    value: "google.example.library.v1.LibraryService.GetShelf"
+  }
+  metric_value_sets {
+    metric_name: "serviceruntime.googleapis.com/api/consumer/quota_used_count"
+    metric_values {
+      labels {
+        key: "/quota_group_name"
+        value: "ReadGroup"
+      }
+      int64_value: 1
+    }
+  }
+}
+)";
+
+// Runs func iterations times and prints its average cost.
+void Run(const char* name, int iterations, const std::function<void()>& func) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i) {
+    func();
+  }
+  auto end = std::chrono::steady_clock::now();
+  double ns =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+          .count();
+  printf("%-40s %10.1f ns/op\n", name, ns / iterations);
+}
+
+// Runs the benchmarks of the signatures computed by hasher type H.
+template <class H>
+void RunSignatures(const char* hasher_name, int iterations,
+                   const CheckRequest& request) {
+  // Accumulates the digests so the work is not optimized away.
+  uint64_t sink = 0;
+  string name;
+
+  name = string("CheckRequestSignature/") + hasher_name;
+  Run(name.c_str(), iterations, [&request, &sink]() {
+    H hasher;
+    sink += GenerateCheckRequestSignature(request, &hasher).low();
+  });
+
+  name = string("ReportOperationSignature/") + hasher_name;
+  const Operation& operation = request.operation();
+  Run(name.c_str(), iterations, [&operation, &sink]() {
+    H hasher;
+    sink += GenerateReportOperationSignature(operation, &hasher).low();
+  });
+
+  for (size_t size : {16, 64, 1024}) {
+    string data(size, 'x');
+    name = string("Bytes") + std::to_string(size) + "/" + hasher_name;
+    Run(name.c_str(), iterations, [&data, &sink]() {
+      H hasher;
+      sink += hasher.Update(data).Digest().low();
+    });
+  }
+
+  if (sink == 42) {
+    printf("\n");
+  }
+}
+
+}  // namespace
+}  // namespace service_control_client
+}  // namespace google
+
+int main(int argc, char** argv) {
+  using namespace ::google::service_control_client;
+  int iterations = argc > 1 ? atoi(argv[1]) : 1000000;
+  if (iterations <= 0) {
+    fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+    return 1;
+  }
+
+  CheckRequest request;
+  if (!TextFormat::ParseFromString(kCheckRequest, &request)) {
+    fprintf(stderr, "Failed to parse the check request.\n");
+    return 1;
+  }
+
+  RunSignatures<MD5Hasher128>("MD5", iterations, request);
+  RunSignatures<Murmur3Hasher128>("Murmur3", iterations, request);
+  return 0;
+}
@@ -15,11 +15,16 @@ limitations under the License.
 
 #include "src/signature.h"
 #include "utils/md5.h"
+#include "utils/murmur3.h"
 
 #include "google/protobuf/text_format.h"
 #include "google/type/money.pb.h"
 #include "gtest/gtest.h"
 
+#include <stdlib.h>
+#include <atomic>
+#include <new>
+
 using std::string;
 using ::google::api::servicecontrol::v1::CheckRequest;
 using ::google::api::servicecontrol::v1::MetricValue;
@@ -27,6 +32,20 @@ using ::google::api::servicecontrol::v1::Operation;
 using ::google::type::Money;
 using ::google::protobuf::TextFormat;
 
+// Counts the heap allocations of this test binary.
+static std::atomic<int> num_allocations(0);
+
+void* operator new(size_t size) {
+  ++num_allocations;
+  void* p = malloc(size);
+  if (p == NULL) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete(void* p) noexcept { free(p); }
+
 namespace google {
 namespace service_control_client {
 namespace {
@@ -105,11 +124,13 @@ class SignatureUtilTest : public ::testing::Test {
   Operation operation_;
 
   MetricValue metric_value_;
+
+  MD5Hasher128 md5_;
 };
 
 TEST_F(SignatureUtilTest, OperationWithNoLabel) {
   EXPECT_EQ("d056b16b88b914b40cd5a82470bc02a5",
-            MD5::DebugString(GenerateReportOperationSignature(operation_)));
+            GenerateReportOperationSignature(operation_, &md5_).DebugString());
 }
 
 TEST_F(SignatureUtilTest, OperationWithLabels) {
@@ -117,13 +138,14 @@ TEST_F(SignatureUtilTest, OperationWithLabels) {
   AddOperationLabel(kResourceTypeLabel, "instance", &operation_);
 
   EXPECT_EQ("93bc5c613fc4eabb2a40042f7f73f671",
-            MD5::DebugString(GenerateReportOperationSignature(operation_)));
+            GenerateReportOperationSignature(operation_, &md5_).DebugString());
 }
 
 TEST_F(SignatureUtilTest, MetricValueWithNoLabel) {
   EXPECT_EQ(
       "d41d8cd98f00b204e9800998ecf8427e",
-      MD5::DebugString(GenerateReportMetricValueSignature(metric_value_)));
+      GenerateReportMetricValueSignature(metric_value_, &md5_)
+          .DebugString());
 }
 
 TEST_F(SignatureUtilTest, MetricValueWithLabels) {
@@ -131,14 +153,79 @@ TEST_F(SignatureUtilTest, MetricValueWithLabels) {
 
   EXPECT_EQ(
       "3f6bc74c0a4be6b6eeaab1faac30a365",
-      MD5::DebugString(GenerateReportMetricValueSignature(metric_value_)));
+      GenerateReportMetricValueSignature(metric_value_, &md5_)
+          .DebugString());
 }
 
 TEST_F(SignatureUtilTest, CheckRequest) {
   CheckRequest request;
   ASSERT_TRUE(TextFormat::ParseFromString(kCheckRequest, &request));
   EXPECT_EQ("4deb431384f1dbb616b59e00db496347",
-            MD5::DebugString(GenerateCheckRequestSignature(request)));
+            GenerateCheckRequestSignature(request, &md5_).DebugString());
+}
+
+TEST_F(SignatureUtilTest, DefaultHasher) {
+  CheckRequest request;
+  ASSERT_TRUE(TextFormat::ParseFromString(kCheckRequest, &request));
+  Murmur3Hasher128 hasher;
+  EXPECT_EQ(GenerateCheckRequestSignature(request, &hasher),
+            GenerateCheckRequestSignature(request));
+  EXPECT_NE(GenerateCheckRequestSignature(request, &md5_),
+            GenerateCheckRequestSignature(request));
+}
+
+TEST_F(SignatureUtilTest, CheckRequestChanges) {
+  CheckRequest request;
+  ASSERT_TRUE(TextFormat::ParseFromString(kCheckRequest, &request));
+  Signature signature = GenerateCheckRequestSignature(request);
+
+  // Metric values are not part of the signature.
+  request.mutable_operation()
+      ->mutable_metric_value_sets(0)
+      ->mutable_metric_values(0)
+      ->set_int64_value(1000);
+  EXPECT_EQ(signature, GenerateCheckRequestSignature(request));
+
+  request.mutable_operation()->set_consumer_id("project:other");
+  EXPECT_NE(signature, GenerateCheckRequestSignature(request));
+}
+
+TEST_F(SignatureUtilTest, LabelOrder) {
+  // Enough labels to go past the labels sorted on the stack.
+  const int kNumLabels = 40;
+  Operation reversed(operation_);
+  for (int i = 0; i < kNumLabels; ++i) {
+    AddOperationLabel("key" + std::to_string(i), "value", &operation_);
+    AddOperationLabel("key" + std::to_string(kNumLabels - 1 - i), "value",
+                      &reversed);
+  }
+  EXPECT_EQ(GenerateReportOperationSignature(operation_),
+            GenerateReportOperationSignature(reversed));
+
+  (*reversed.mutable_labels())["key0"] = "other";
+  EXPECT_NE(GenerateReportOperationSignature(operation_),
+            GenerateReportOperationSignature(reversed));
+}
+
+TEST_F(SignatureUtilTest, NoHeapAllocation) {
+  CheckRequest request;
+  ASSERT_TRUE(TextFormat::ParseFromString(kCheckRequest, &request));
+  Operation* operation = request.mutable_operation();
+  MetricValue* metric_value =
+      operation->mutable_metric_value_sets(0)->mutable_metric_values(0);
+  // Fills both label maps up to 32 labels.
+  for (int i = operation->labels_size(); i < 32; ++i) {
+    AddOperationLabel("key" + std::to_string(i), "value", operation);
+  }
+  for (int i = metric_value->labels_size(); i < 32; ++i) {
+    AddMetricValueLabel("key" + std::to_string(i), "value", metric_value);
+  }
+
+  int allocations = num_allocations;
+  GenerateCheckRequestSignature(request);
+  GenerateReportOperationSignature(*operation);
+  GenerateReportMetricValueSignature(*metric_value);
+  EXPECT_EQ(allocations, num_allocations);
 }
 
 }  // namespace
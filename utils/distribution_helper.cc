@@ -15,12 +15,24 @@ limitations under the License.
 
 #include "distribution_helper.h"
 
+#include <string.h>
 #include <algorithm>
 #include <cmath>
 #include <iterator>
+#include <limits>
+#include <memory>
 #include <sstream>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 using ::google::api::servicecontrol::v1::Distribution;
+using ::google::protobuf::int64;
 using ::google::protobuf::util::Status;
 using ::google::protobuf::util::error::Code;
 
@@ -64,9 +76,93 @@ void UpdateGeneralStatictics(double value, Distribution* distribution) {
   }
 }
 
+// The relative difference of values close enough to be equal.
+const double kCloseEnoughEpsilon = 1e-5;
+
 inline bool IsCloseEnough(double x, double y) {
-  const double epsilon = 1e-5;
-  return std::abs(x - y) <= epsilon * std::abs(x);
+  return std::abs(x - y) <= kCloseEnoughEpsilon * std::abs(x);
+}
+
+// Returns whether each of the given first values is close enough to the
+// second value at the same index. Compares a vector of values at a time if
+// the target supports it.
+bool AllCloseEnough(const double* first, const double* second, size_t count) {
+  size_t i = 0;
+#if defined(__AVX2__)
+  const __m256d sign = _mm256_set1_pd(-0.0);
+  const __m256d epsilon = _mm256_set1_pd(kCloseEnoughEpsilon);
+  for (; i + 4 <= count; i += 4) {
+    __m256d x = _mm256_loadu_pd(first + i);
+    __m256d y = _mm256_loadu_pd(second + i);
+    __m256d difference = _mm256_andnot_pd(sign, _mm256_sub_pd(x, y));
+    __m256d limit = _mm256_mul_pd(epsilon, _mm256_andnot_pd(sign, x));
+    if (_mm256_movemask_pd(_mm256_cmp_pd(difference, limit, _CMP_LE_OQ)) !=
+        0xF) {
+      return false;
+    }
+  }
+#elif defined(__SSE2__)
+  const __m128d sign = _mm_set1_pd(-0.0);
+  const __m128d epsilon = _mm_set1_pd(kCloseEnoughEpsilon);
+  for (; i + 2 <= count; i += 2) {
+    __m128d x = _mm_loadu_pd(first + i);
+    __m128d y = _mm_loadu_pd(second + i);
+    __m128d difference = _mm_andnot_pd(sign, _mm_sub_pd(x, y));
+    __m128d limit = _mm_mul_pd(epsilon, _mm_andnot_pd(sign, x));
+    if (_mm_movemask_pd(_mm_cmple_pd(difference, limit)) != 0x3) {
+      return false;
+    }
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  const float64x2_t epsilon = vdupq_n_f64(kCloseEnoughEpsilon);
+  for (; i + 2 <= count; i += 2) {
+    float64x2_t x = vld1q_f64(first + i);
+    float64x2_t y = vld1q_f64(second + i);
+    float64x2_t difference = vabsq_f64(vsubq_f64(x, y));
+    float64x2_t limit = vmulq_f64(epsilon, vabsq_f64(x));
+    uint64x2_t close = vcleq_f64(difference, limit);
+    if ((vgetq_lane_u64(close, 0) & vgetq_lane_u64(close, 1)) != ~0ULL) {
+      return false;
+    }
+  }
+#endif
+  for (; i < count; ++i) {
+    if (!IsCloseEnough(first[i], second[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Adds each of the given bucket counts to the one at the same index in to.
+// Adds a vector of counts at a time if the target supports it.
+void AddBucketCounts(const int64* from, int64* to, size_t count) {
+  size_t i = 0;
+#if defined(__AVX2__)
+  for (; i + 4 <= count; i += 4) {
+    __m256i sum = _mm256_add_epi64(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(to + i)),
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(from + i)));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(to + i), sum);
+  }
+#elif defined(__SSE2__)
+  for (; i + 2 <= count; i += 2) {
+    __m128i sum = _mm_add_epi64(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(to + i)),
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(from + i)));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(to + i), sum);
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  for (; i + 2 <= count; i += 2) {
+    int64x2_t sum = vaddq_s64(vld1q_s64(reinterpret_cast<int64_t*>(to + i)),
+                              vld1q_s64(reinterpret_cast<const int64_t*>(
+                                  from + i)));
+    vst1q_s64(reinterpret_cast<int64_t*>(to + i), sum);
+  }
+#endif
+  for (; i < count; ++i) {
+    to[i] += from[i];
+  }
 }
 
 // Checks whether the bucket definitions in the two distributions are
@@ -116,11 +212,10 @@ bool BucketsApproximatelyEqual(const Distribution& first,
       if (first_explicit.bounds_size() != second_explicit.bounds_size()) {
         return false;
       }
-      for (int i = 0; i < first_explicit.bounds_size(); ++i) {
-        if (!IsCloseEnough(first_explicit.bounds(i),
-                           second_explicit.bounds(i))) {
-          return false;
-        }
+      if (!AllCloseEnough(first_explicit.bounds().data(),
+                          second_explicit.bounds().data(),
+                          first_explicit.bounds_size())) {
+        return false;
       }
       break;
     }
@@ -130,23 +225,75 @@ bool BucketsApproximatelyEqual(const Distribution& first,
   return true;
 }
 
-void UpdateExponentialBucketCount(double value, Distribution* distribution) {
-  const auto& exponential = distribution->exponential_buckets();
-  int bucket_index = 0;
-  if (value >= exponential.scale()) {
-    // Should be put into bucket bucket_index, starting from 0.
-    bucket_index = 1 + static_cast<int>(log2(value / exponential.scale()) /
-                                        log2(exponential.growth_factor()));
-    if (bucket_index > exponential.num_finite_buckets() + 1) {
-      bucket_index = exponential.num_finite_buckets() + 1;
+// The maximum number of bucket indexes cached per thread.
+const size_t kMaxCachedBucketIndexes = 8;
+
+// Once the cache is full, the number of misses between two bucket index
+// builds. Building an index costs about as much as a few thousand log2
+// lookups, so this bounds its amortized cost when more bucket options than
+// the cache holds are used in turn.
+const int kMissesPerBucketIndexBuild = 4096;
+
+// A bucket index cached for the current thread.
+struct CachedBucketIndex {
+  // The bucket options, kept inline to look them up quickly.
+  int num_finite_buckets;
+  double growth_factor;
+  double scale;
+  std::shared_ptr<const ExponentialBucketIndex> index;
+  // When it was last used, in cache lookups.
+  uint64_t last_used;
+};
+
+// Returns the bucket index of the given exponential buckets, cached for the
+// current thread. The least recently used index is evicted when the cache is
+// full. Returns NULL on some misses, when the index is not built; buckets
+// have to be found with ExponentialBucketIndex::FindWithLog2() then. The
+// returned reference is valid until the next call.
+const std::shared_ptr<const ExponentialBucketIndex>& GetExponentialBucketIndex(
+    const Distribution::ExponentialBuckets& exponential) {
+  static const std::shared_ptr<const ExponentialBucketIndex> kNoIndex;
+  static thread_local std::vector<CachedBucketIndex> cache;
+  static thread_local uint64_t lookups = 0;
+  static thread_local int misses = 0;
+  ++lookups;
+  int num_finite_buckets = exponential.num_finite_buckets();
+  double growth_factor = exponential.growth_factor();
+  double scale = exponential.scale();
+  for (auto& cached : cache) {
+    if (cached.num_finite_buckets == num_finite_buckets &&
+        cached.growth_factor == growth_factor && cached.scale == scale) {
+      cached.last_used = lookups;
+      return cached.index;
     }
   }
-  distribution->set_bucket_counts(
-      bucket_index, distribution->bucket_counts(bucket_index) + 1);
+
+  auto slot = cache.end();
+  if (cache.size() >= kMaxCachedBucketIndexes) {
+    if (++misses < kMissesPerBucketIndexBuild) {
+      return kNoIndex;
+    }
+    misses = 0;
+    slot = std::min_element(cache.begin(), cache.end(),
+                            [](const CachedBucketIndex& a,
+                               const CachedBucketIndex& b) {
+                              return a.last_used < b.last_used;
+                            });
+  } else {
+    slot = cache.insert(cache.end(), CachedBucketIndex());
+  }
+  slot->num_finite_buckets = num_finite_buckets;
+  slot->growth_factor = growth_factor;
+  slot->scale = scale;
+  slot->index = std::make_shared<const ExponentialBucketIndex>(
+      num_finite_buckets, growth_factor, scale);
+  slot->last_used = lookups;
+  return slot->index;
 }
 
-void UpdateLinearBucketCount(double value, Distribution* distribution) {
-  const auto& linear = distribution->linear_buckets();
+// Returns the bucket index of the given value in the given linear buckets.
+int GetLinearBucketIndex(double value,
+                         const Distribution::LinearBuckets& linear) {
   double upper_bound =
       linear.offset() + linear.num_finite_buckets() * linear.width();
   double lower_bound = linear.offset();
@@ -159,27 +306,160 @@ void UpdateLinearBucketCount(double value, Distribution* distribution) {
   } else {
     bucket_index = 1 + static_cast<int>((value - lower_bound) / linear.width());
   }
-
-  distribution->set_bucket_counts(
-      bucket_index, distribution->bucket_counts(bucket_index) + 1);
+  return bucket_index;
 }
 
-void UpdateExplicitBucketCount(double value, Distribution* distribution) {
-  const auto& bounds = distribution->explicit_buckets().bounds();
+// Returns the bucket index of the given value in the given explicit buckets.
+int GetExplicitBucketIndex(
+    double value, const Distribution::ExplicitBuckets& explicit_buckets) {
+  const auto& bounds = explicit_buckets.bounds();
   int bucket_index = 0;
-  if (value >= bounds.Get(0)) {
+  if (bounds.size() > 0 && value >= bounds.Get(0)) {
     // -inf <  b0 <  b1 <  b2 <  b3 < +inf     (4 values in "bounds")
     //   |  0  |  1  |  2  |  3  |  4  |       (5 buckets)
     // std::upper_bound returns the first value that is greater than given one.
     bucket_index = std::distance(
         bounds.begin(), std::upper_bound(bounds.begin(), bounds.end(), value));
   }
+  return bucket_index;
+}
+
+void UpdateExponentialBucketCount(double value, Distribution* distribution) {
+  const auto& exponential = distribution->exponential_buckets();
+  const auto& index = GetExponentialBucketIndex(exponential);
+  int bucket_index =
+      index ? index->Find(value)
+            : ExponentialBucketIndex::FindWithLog2(
+                  exponential.num_finite_buckets(),
+                  exponential.growth_factor(), exponential.scale(), value);
+  distribution->set_bucket_counts(
+      bucket_index, distribution->bucket_counts(bucket_index) + 1);
+}
+
+void UpdateLinearBucketCount(double value, Distribution* distribution) {
+  int bucket_index = GetLinearBucketIndex(value, distribution->linear_buckets());
   distribution->set_bucket_counts(
       bucket_index, distribution->bucket_counts(bucket_index) + 1);
 }
 
+void UpdateExplicitBucketCount(double value, Distribution* distribution) {
+  int bucket_index =
+      GetExplicitBucketIndex(value, distribution->explicit_buckets());
+  distribution->set_bucket_counts(
+      bucket_index, distribution->bucket_counts(bucket_index) + 1);
+}
+
+// Returns the bits of a double. They are ordered like the doubles for non
+// negative doubles.
+uint64_t DoubleToBits(double value) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+double BitsToDouble(uint64_t bits) {
+  double value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+// Returns whether the bucket options of the given distributions are
+// bitwise identical, and set.
+bool BucketOptionsIdentical(const Distribution& first,
+                            const Distribution& second) {
+  if (first.bucket_option_case() != second.bucket_option_case()) {
+    return false;
+  }
+  switch (first.bucket_option_case()) {
+    case Distribution::kExponentialBuckets: {
+      const auto& a = first.exponential_buckets();
+      const auto& b = second.exponential_buckets();
+      return a.num_finite_buckets() == b.num_finite_buckets() &&
+             DoubleToBits(a.growth_factor()) ==
+                 DoubleToBits(b.growth_factor()) &&
+             DoubleToBits(a.scale()) == DoubleToBits(b.scale());
+    }
+    case Distribution::kLinearBuckets: {
+      const auto& a = first.linear_buckets();
+      const auto& b = second.linear_buckets();
+      return a.num_finite_buckets() == b.num_finite_buckets() &&
+             DoubleToBits(a.width()) == DoubleToBits(b.width()) &&
+             DoubleToBits(a.offset()) == DoubleToBits(b.offset());
+    }
+    case Distribution::kExplicitBuckets: {
+      const auto& a = first.explicit_buckets().bounds();
+      const auto& b = second.explicit_buckets().bounds();
+      return a.size() == b.size() &&
+             memcmp(a.data(), b.data(), a.size() * sizeof(double)) == 0;
+    }
+    default:
+      return false;
+  }
+}
+
+// Checks whether the bucket options of the two distributions match. Options
+// copied from the same source, the common case, are equal bitwise, which is
+// cheaper to check than approximate equality.
+bool BucketOptionsMatch(const Distribution& first,
+                        const Distribution& second) {
+  return BucketOptionsIdentical(first, second) ||
+         BucketsApproximatelyEqual(first, second);
+}
+
 }  // namespace
 
+ExponentialBucketIndex::ExponentialBucketIndex(int num_finite_buckets,
+                                               double growth_factor,
+                                               double scale)
+    : num_finite_buckets_(num_finite_buckets),
+      growth_factor_(growth_factor),
+      scale_(scale) {
+  const double kInfinity = std::numeric_limits<double>::infinity();
+  size_t size = 1;
+  while (size < static_cast<size_t>(num_finite_buckets)) {
+    size *= 2;
+  }
+  bounds_.assign(size, kInfinity);
+
+  // The log2 formula is monotonic, so the smallest value of each bucket is
+  // found by bisection over the ordered bits of the doubles above scale. All
+  // values from scale up are in bucket 1 or above.
+  uint64_t below = DoubleToBits(scale);
+  const uint64_t max_bits =
+      DoubleToBits(std::numeric_limits<double>::max());
+  for (int bucket = 2; bucket <= num_finite_buckets + 1; ++bucket) {
+    if (FindWithLog2(num_finite_buckets, growth_factor, scale,
+                     BitsToDouble(max_bits)) < bucket) {
+      break;
+    }
+    // The value of bits below is in a lower bucket, the one of above is not.
+    uint64_t above = max_bits;
+    while (above - below > 1) {
+      uint64_t middle = below + (above - below) / 2;
+      if (FindWithLog2(num_finite_buckets, growth_factor, scale,
+                       BitsToDouble(middle)) < bucket) {
+        below = middle;
+      } else {
+        above = middle;
+      }
+    }
+    bounds_[bucket - 2] = BitsToDouble(above);
+  }
+}
+
+int ExponentialBucketIndex::FindWithLog2(int num_finite_buckets,
+                                         double growth_factor, double scale,
+                                         double value) {
+  if (!(value >= scale)) {
+    return 0;
+  }
+  double exponent = log2(value / scale) / log2(growth_factor);
+  if (exponent >= num_finite_buckets) {
+    return num_finite_buckets + 1;
+  }
+  return 1 + static_cast<int>(exponent);
+}
+
 Status DistributionHelper::InitExponential(int num_finite_buckets,
                                            double growth_factor, double scale,
                                            Distribution* distribution) {
@@ -269,7 +549,7 @@ Status DistributionHelper::AddSample(double value, Distribution* distribution) {
 }
 
 Status DistributionHelper::Merge(const Distribution& from, Distribution* to) {
-  if (!BucketsApproximatelyEqual(from, *to)) {
+  if (!BucketOptionsMatch(from, *to)) {
     return Status(Code::INVALID_ARGUMENT,
                   std::string("Bucket options don't match. From: ") +
                       from.DebugString() + " to: " + to->DebugString());
@@ -299,11 +579,182 @@ Status DistributionHelper::Merge(const Distribution& from, Distribution* to) {
       count * (to->mean() - mean) * (to->mean() - mean) +
       from.count() * (to->mean() - from.mean()) * (to->mean() - from.mean()));
 
-  for (int i = 0; i < from.bucket_counts_size(); i++) {
-    to->set_bucket_counts(i, to->bucket_counts(i) + from.bucket_counts(i));
+  AddBucketCounts(from.bucket_counts().data(),
+                  to->mutable_bucket_counts()->mutable_data(),
+                  from.bucket_counts_size());
+  return Status::OK;
+}
+
+DistributionAccumulator::DistributionAccumulator(
+    const Distribution& distribution)
+    : count_(distribution.count()),
+      mean_(distribution.mean()),
+      minimum_(distribution.minimum()),
+      maximum_(distribution.maximum()),
+      sum_of_squared_deviation_(distribution.sum_of_squared_deviation()),
+      bucket_counts_(distribution.bucket_counts().begin(),
+                     distribution.bucket_counts().end()) {
+  switch (distribution.bucket_option_case()) {
+    case Distribution::kExponentialBuckets:
+      *options_.mutable_exponential_buckets() =
+          distribution.exponential_buckets();
+      break;
+    case Distribution::kLinearBuckets:
+      *options_.mutable_linear_buckets() = distribution.linear_buckets();
+      break;
+    case Distribution::kExplicitBuckets:
+      *options_.mutable_explicit_buckets() = distribution.explicit_buckets();
+      break;
+    default:
+      break;
+  }
+}
+
+Status DistributionAccumulator::AddSample(double value) {
+  return AddSamples(&value, 1);
+}
+
+Status DistributionAccumulator::AddSamples(const double* values,
+                                           size_t count) {
+  Status status = PrepareBuckets();
+  if (!status.ok()) {
+    return status;
+  }
+  for (size_t i = 0; i < count; ++i) {
+    size_t bucket_index = FindBucket(values[i]);
+    if (bucket_index >= bucket_counts_.size()) {
+      return Status(Code::INVALID_ARGUMENT,
+                    "Bucket counts size don't match bucket options.");
+    }
+    UpdateStatistics(values[i]);
+    ++bucket_counts_[bucket_index];
   }
   return Status::OK;
 }
 
+Status DistributionAccumulator::Merge(const Distribution& from) {
+  if (!BucketOptionsMatch(from, options_)) {
+    return Status(Code::INVALID_ARGUMENT, "Bucket options don't match.");
+  }
+  if (static_cast<size_t>(from.bucket_counts_size()) != bucket_counts_.size()) {
+    return Status(Code::INVALID_ARGUMENT, "Bucket counts size don't match.");
+  }
+
+  if (from.count() <= 0) return Status::OK;
+  if (count_ <= 0) {
+    *this = DistributionAccumulator(from);
+    return Status::OK;
+  }
+
+  MergeStatistics(from.count(), from.mean(), from.minimum(), from.maximum(),
+                  from.sum_of_squared_deviation());
+  AddBucketCounts(from.bucket_counts().data(), bucket_counts_.data(),
+                  bucket_counts_.size());
+  return Status::OK;
+}
+
+Status DistributionAccumulator::Merge(const DistributionAccumulator& from) {
+  if (!BucketOptionsMatch(from.options_, options_)) {
+    return Status(Code::INVALID_ARGUMENT, "Bucket options don't match.");
+  }
+  if (from.bucket_counts_.size() != bucket_counts_.size()) {
+    return Status(Code::INVALID_ARGUMENT, "Bucket counts size don't match.");
+  }
+
+  if (from.count_ <= 0) return Status::OK;
+  if (count_ <= 0) {
+    *this = from;
+    return Status::OK;
+  }
+
+  MergeStatistics(from.count_, from.mean_, from.minimum_, from.maximum_,
+                  from.sum_of_squared_deviation_);
+  AddBucketCounts(from.bucket_counts_.data(), bucket_counts_.data(),
+                  bucket_counts_.size());
+  return Status::OK;
+}
+
+void DistributionAccumulator::ToProto(Distribution* distribution) const {
+  *distribution = options_;
+  distribution->set_count(count_);
+  distribution->set_mean(mean_);
+  distribution->set_minimum(minimum_);
+  distribution->set_maximum(maximum_);
+  distribution->set_sum_of_squared_deviation(sum_of_squared_deviation_);
+  auto* bucket_counts = distribution->mutable_bucket_counts();
+  bucket_counts->Resize(bucket_counts_.size(), 0);
+  std::copy(bucket_counts_.begin(), bucket_counts_.end(),
+            bucket_counts->mutable_data());
+}
+
+Status DistributionAccumulator::PrepareBuckets() {
+  switch (options_.bucket_option_case()) {
+    case Distribution::kExponentialBuckets:
+      if (!exponential_index_) {
+        exponential_index_ =
+            GetExponentialBucketIndex(options_.exponential_buckets());
+      }
+      return Status::OK;
+    case Distribution::kLinearBuckets:
+    case Distribution::kExplicitBuckets:
+      return Status::OK;
+    default:
+      return Status(Code::INVALID_ARGUMENT,
+                    StrCat("Unknown bucket option case: ",
+                           options_.bucket_option_case()));
+  }
+}
+
+int DistributionAccumulator::FindBucket(double value) const {
+  switch (options_.bucket_option_case()) {
+    case Distribution::kExponentialBuckets:
+      if (exponential_index_) {
+        return exponential_index_->Find(value);
+      }
+      return ExponentialBucketIndex::FindWithLog2(
+          options_.exponential_buckets().num_finite_buckets(),
+          options_.exponential_buckets().growth_factor(),
+          options_.exponential_buckets().scale(), value);
+    case Distribution::kLinearBuckets:
+      return GetLinearBucketIndex(value, options_.linear_buckets());
+    default:
+      return GetExplicitBucketIndex(value, options_.explicit_buckets());
+  }
+}
+
+// Same as UpdateGeneralStatictics.
+void DistributionAccumulator::UpdateStatistics(double value) {
+  if (count_ == 0) {
+    count_ = 1;
+    maximum_ = value;
+    minimum_ = value;
+    mean_ = value;
+    sum_of_squared_deviation_ = 0;
+  } else {
+    double new_mean = (count_ * mean_ + value) / (count_ + 1);
+    sum_of_squared_deviation_ += (value - mean_) * (value - new_mean);
+    ++count_;
+    minimum_ = std::min(value, minimum_);
+    maximum_ = std::max(value, maximum_);
+    mean_ = new_mean;
+  }
+}
+
+// Same as DistributionHelper::Merge.
+void DistributionAccumulator::MergeStatistics(
+    int64_t count, double mean, double minimum, double maximum,
+    double sum_of_squared_deviation) {
+  int64_t old_count = count_;
+  double old_mean = mean_;
+  count_ += count;
+  minimum_ = std::min(minimum, minimum_);
+  maximum_ = std::max(maximum, maximum_);
+  mean_ = (old_count * old_mean + count * mean) / count_;
+  sum_of_squared_deviation_ =
+      sum_of_squared_deviation_ + sum_of_squared_deviation +
+      old_count * (mean_ - old_mean) * (mean_ - old_mean) +
+      count * (mean_ - mean) * (mean_ - mean);
+}
+
 }  // namespace service_control_client
 }  // namespace google
@@ -16,12 +16,67 @@ limitations under the License.
 #ifndef GOOGLE_SERVICE_CONTROL_CLIENT_UTILS_DISTRIBUTION_HELPER_H_
 #define GOOGLE_SERVICE_CONTROL_CLIENT_UTILS_DISTRIBUTION_HELPER_H_
 
+#include <stddef.h>
+#include <algorithm>
+#include <memory>
+#include <vector>
+
 #include "google/api/servicecontrol/v1/distribution.pb.h"
 #include "google/protobuf/stubs/status.h"
 
 namespace google {
 namespace service_control_client {
 
+// Finds the buckets of values in exponential buckets.
+//
+// The bucket of a value is defined by the log2 formula of FindWithLog2().
+// Bucket bounds are computed once from that formula, so Find() returns
+// exactly the same indexes with a branchless binary search over the bounds,
+// without computing any log2 or division.
+// Thread compatible.
+class ExponentialBucketIndex final {
+ public:
+  // The bucket options must be valid, see DistributionHelper::InitExponential.
+  ExponentialBucketIndex(int num_finite_buckets, double growth_factor,
+                         double scale);
+
+  // Returns whether this instance was built for the given bucket options.
+  bool Matches(int num_finite_buckets, double growth_factor,
+               double scale) const {
+    return num_finite_buckets == num_finite_buckets_ &&
+           growth_factor == growth_factor_ && scale == scale_;
+  }
+
+  // Returns the bucket index of the given value, from 0 for the underflow
+  // bucket to num_finite_buckets + 1 for the overflow bucket.
+  int Find(double value) const {
+    if (!(value >= scale_)) {
+      return 0;
+    }
+    // Counts the bounds not greater than value.
+    const double* bounds = bounds_.data();
+    size_t index = 0;
+    for (size_t step = bounds_.size() / 2; step > 0; step /= 2) {
+      index += bounds[index + step - 1] <= value ? step : 0;
+    }
+    index += bounds[index] <= value ? 1 : 0;
+    return std::min(1 + static_cast<int>(index), num_finite_buckets_ + 1);
+  }
+
+  // Returns the bucket index of the given value, computed with log2.
+  static int FindWithLog2(int num_finite_buckets, double growth_factor,
+                          double scale, double value);
+
+ private:
+  int num_finite_buckets_;
+  double growth_factor_;
+  double scale_;
+
+  // bounds_[i] is the smallest value in bucket i + 2 or above, or infinity if
+  // there is none. Padded with infinity to a power of 2 size.
+  std::vector<double> bounds_;
+};
+
 // A helper class for handling Distribution proto message.
 // Thread safe.
 class DistributionHelper final {
@@ -42,7 +97,9 @@ class DistributionHelper final {
       const std::vector<double>& bounds,
       ::google::api::servicecontrol::v1::Distribution* distribution);
 
-  // Adds one more sample to the given distribution.
+  // Adds one more sample to the given distribution. The bucket indexes of
+  // exponential buckets are cached per thread, for a few bucket options;
+  // other options use the log2 formula.
   static ::google::protobuf::util::Status AddSample(
       double value,
       ::google::api::servicecontrol::v1::Distribution* distribution);
@@ -54,6 +111,71 @@ class DistributionHelper final {
       ::google::api::servicecontrol::v1::Distribution* to);
 };
 
+// Accumulates samples and distributions with the bucket options of a
+// distribution, like DistributionHelper does, with the same results.
+//
+// Bucket counts are kept in a contiguous array and statistics in plain
+// fields, so adding samples and merging does not go through proto
+// accessors. The accumulated distribution turns into a proto only when
+// written out.
+// Thread compatible.
+class DistributionAccumulator final {
+ public:
+  // Starts from the given distribution, its bucket options and values.
+  explicit DistributionAccumulator(
+      const ::google::api::servicecontrol::v1::Distribution& distribution);
+
+  // Adds one more sample. Returns INVALID_ARGUMENT if the bucket options are
+  // unknown, or do not match the number of bucket counts.
+  ::google::protobuf::util::Status AddSample(double value);
+
+  // Adds the given samples, in order. Same as calling AddSample() for each
+  // of them, but stops at the first error.
+  ::google::protobuf::util::Status AddSamples(const double* values,
+                                              size_t count);
+
+  // Merges the given distribution into this one. No change if the bucket
+  // options do not match, and INVALID_ARGUMENT is returned. Bucket options
+  // equal bitwise are not compared approximately.
+  ::google::protobuf::util::Status Merge(
+      const ::google::api::servicecontrol::v1::Distribution& from);
+  ::google::protobuf::util::Status Merge(const DistributionAccumulator& from);
+
+  // Writes the accumulated distribution into the given proto, replacing its
+  // content.
+  void ToProto(::google::api::servicecontrol::v1::Distribution* distribution)
+      const;
+
+ private:
+  // Checks the bucket options, and prepares finding buckets.
+  ::google::protobuf::util::Status PrepareBuckets();
+
+  // Returns the bucket index of the given value. PrepareBuckets() must have
+  // succeeded.
+  int FindBucket(double value) const;
+
+  // Updates statistics other than bucket counts with one more sample.
+  void UpdateStatistics(double value);
+
+  // Merges statistics other than bucket counts.
+  void MergeStatistics(int64_t count, double mean, double minimum,
+                       double maximum, double sum_of_squared_deviation);
+
+  // Holds the bucket options only.
+  ::google::api::servicecontrol::v1::Distribution options_;
+
+  // Finds exponential buckets. Taken from the per-thread cache when samples
+  // are added; while it is NULL, buckets are found with log2.
+  std::shared_ptr<const ExponentialBucketIndex> exponential_index_;
+
+  int64_t count_;
+  double mean_;
+  double minimum_;
+  double maximum_;
+  double sum_of_squared_deviation_;
+  std::vector<::google::protobuf::int64> bucket_counts_;
+};
+
 }  // namespace service_control_client
 }  // namespace google
 
@@ -0,0 +1,120 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Compares the cost of finding the exponential bucket of a sample with the
+// precomputed bucket bounds and with the log2 formula.
+//
+// Usage: distribution_helper_benchmark [iterations]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <random>
+#include <vector>
+
+#include "utils/distribution_helper.h"
+
+using ::google::api::servicecontrol::v1::Distribution;
+
+namespace google {
+namespace service_control_client {
+namespace {
+
+// The bucket options of latency distributions, from 1 microsecond.
+const int kNumFiniteBuckets = 29;
+const double kGrowthFactor = 2;
+const double kScale = 1e-6;
+
+// The number of distinct samples, cycled through.
+const int kNumSamples = 4096;
+
+// Runs func iterations times and prints its average cost.
+void Run(const char* name, int iterations, const std::function<void()>& func) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i) {
+    func();
+  }
+  auto end = std::chrono::steady_clock::now();
+  double ns =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+          .count();
+  printf("%-40s %10.1f ns/op\n", name, ns / iterations);
+}
+
+}  // namespace
+}  // namespace service_control_client
+}  // namespace google
+
+int main(int argc, char** argv) {
+  using namespace ::google::service_control_client;
+  int iterations = argc > 1 ? atoi(argv[1]) : 10000000;
+  if (iterations <= 0) {
+    fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+    return 1;
+  }
+
+  // Latencies between 10 microseconds and 10 seconds.
+  std::mt19937_64 random(1);
+  std::uniform_real_distribution<double> exponents(-5, 1);
+  std::vector<double> samples;
+  for (int i = 0; i < kNumSamples; ++i) {
+    samples.push_back(std::pow(10, exponents(random)));
+  }
+
+  // Accumulates the bucket indexes so the work is not optimized away.
+  int64_t sink = 0;
+  int i = 0;
+
+  Run("FindWithLog2", iterations, [&samples, &sink, &i]() {
+    sink += ExponentialBucketIndex::FindWithLog2(
+        kNumFiniteBuckets, kGrowthFactor, kScale,
+        samples[i++ & (kNumSamples - 1)]);
+  });
+
+  ExponentialBucketIndex index(kNumFiniteBuckets, kGrowthFactor, kScale);
+  Run("Find", iterations, [&samples, &sink, &i, &index]() {
+    sink += index.Find(samples[i++ & (kNumSamples - 1)]);
+  });
+
+  Distribution distribution;
+  DistributionHelper::InitExponential(kNumFiniteBuckets, kGrowthFactor, kScale,
+                                      &distribution);
+  Run("AddSample", iterations, [&samples, &i, &distribution]() {
+    DistributionHelper::AddSample(samples[i++ & (kNumSamples - 1)],
+                                  &distribution);
+  });
+
+  // More bucket options than the per-thread cache of bucket indexes holds,
+  // used in turn.
+  const int kNumOptions = 16;
+  std::vector<Distribution> distributions(kNumOptions);
+  for (int j = 0; j < kNumOptions; ++j) {
+    DistributionHelper::InitExponential(kNumFiniteBuckets + j, kGrowthFactor,
+                                        kScale, &distributions[j]);
+  }
+  Run("AddSample/16BucketOptions", iterations,
+      [&samples, &i, &distributions]() {
+        DistributionHelper::AddSample(samples[i & (kNumSamples - 1)],
+                                      &distributions[i % kNumOptions]);
+        ++i;
+      });
+
+  if (sink == 42 || distribution.count() == 42) {
+    printf("\n");
+  }
+  return 0;
+}
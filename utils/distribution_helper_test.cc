@@ -15,7 +15,11 @@ limitations under the License.
 
 #include "distribution_helper.h"
 
+#include <string.h>
+#include <cmath>
 #include <limits>
+#include <random>
+#include <vector>
 
 #include "gmock/gmock.h"
 #include "google/protobuf/text_format.h"
@@ -881,6 +885,247 @@ TEST_F(DistributionHelperTest, Merge_ZeroCount) {
   EXPECT_TRUE(MessageDifferencer::ApproximatelyEquals(to, distribution));
 }
 
+TEST_F(DistributionHelperTest, Accumulator_AddSamples) {
+  // Same results as DistributionHelper, for all bucket options.
+  Distribution* distributions[] = {&exponential_distribution_,
+                                   &linear_distribution_,
+                                   &explicit_distribution_};
+  for (Distribution* distribution : distributions) {
+    DistributionAccumulator accumulator(*distribution);
+    DistributionAccumulator bulk_accumulator(*distribution);
+    for (double value : kMultipleValuesLinear) {
+      ASSERT_TRUE(accumulator.AddSample(value).ok());
+      helper_.AddSample(value, distribution);
+    }
+    ASSERT_TRUE(bulk_accumulator
+                    .AddSamples(kMultipleValuesLinear,
+                                sizeof(kMultipleValuesLinear) / sizeof(double))
+                    .ok());
+
+    Distribution accumulated;
+    accumulator.ToProto(&accumulated);
+    EXPECT_TRUE(MessageDifferencer::Equals(accumulated, *distribution));
+    Distribution bulk_accumulated;
+    bulk_accumulator.ToProto(&bulk_accumulated);
+    EXPECT_TRUE(MessageDifferencer::Equals(bulk_accumulated, *distribution));
+  }
+}
+
+TEST_F(DistributionHelperTest, Accumulator_Merge) {
+  int total_values = sizeof(kMultipleValuesExponential) / sizeof(double);
+  for (int i = 0; i < total_values / 2; ++i) {
+    helper_.AddSample(kMultipleValuesExponential[i],
+                      &exponential_distribution_);
+  }
+  for (int i = total_values / 2; i < total_values; ++i) {
+    helper_.AddSample(kMultipleValuesExponential[i],
+                      &other_exponential_distribution_);
+  }
+
+  DistributionAccumulator accumulator(exponential_distribution_);
+  ASSERT_TRUE(accumulator.Merge(other_exponential_distribution_).ok());
+  DistributionAccumulator other_accumulator(exponential_distribution_);
+  ASSERT_TRUE(
+      other_accumulator
+          .Merge(DistributionAccumulator(other_exponential_distribution_))
+          .ok());
+
+  helper_.Merge(other_exponential_distribution_, &exponential_distribution_);
+  Distribution merged;
+  accumulator.ToProto(&merged);
+  EXPECT_TRUE(MessageDifferencer::Equals(merged, exponential_distribution_));
+  other_accumulator.ToProto(&merged);
+  EXPECT_TRUE(MessageDifferencer::Equals(merged, exponential_distribution_));
+}
+
+TEST_F(DistributionHelperTest, Accumulator_MergeToEmpty) {
+  for (double value : kMultipleValuesExponential) {
+    helper_.AddSample(value, &other_exponential_distribution_);
+  }
+  DistributionAccumulator accumulator(exponential_distribution_);
+  ASSERT_TRUE(accumulator.Merge(other_exponential_distribution_).ok());
+  Distribution merged;
+  accumulator.ToProto(&merged);
+  EXPECT_TRUE(
+      MessageDifferencer::Equals(merged, other_exponential_distribution_));
+}
+
+TEST_F(DistributionHelperTest, Accumulator_BucketNotMatch) {
+  helper_.AddSample(2, &linear_distribution_);
+  helper_.AddSample(2, &explicit_distribution_);
+  DistributionAccumulator accumulator(linear_distribution_);
+  EXPECT_FALSE(accumulator.Merge(explicit_distribution_).ok());
+  EXPECT_FALSE(
+      accumulator.Merge(DistributionAccumulator(explicit_distribution_)).ok());
+
+  Distribution merged;
+  accumulator.ToProto(&merged);
+  EXPECT_TRUE(MessageDifferencer::Equals(merged, linear_distribution_));
+}
+
+TEST_F(DistributionHelperTest, Accumulator_UnknownDistribution) {
+  DistributionAccumulator accumulator((Distribution()));
+  EXPECT_FALSE(accumulator.AddSample(1).ok());
+
+  Distribution expected;
+  Distribution accumulated;
+  accumulator.ToProto(&accumulated);
+  EXPECT_TRUE(MessageDifferencer::Equals(accumulated, expected));
+}
+
+TEST_F(DistributionHelperTest, Merge_ExplicitBuckets_AllSizes) {
+  // Covers the vectorized comparison and addition, and their remainders.
+  for (int size = 1; size <= 40; ++size) {
+    std::vector<double> bounds;
+    for (int i = 0; i < size; ++i) {
+      bounds.push_back(i + 1);
+    }
+    Distribution from;
+    ASSERT_TRUE(helper_.InitExplicit(bounds, &from).ok());
+    Distribution to = from;
+    for (int i = 0; i <= size + 1; ++i) {
+      helper_.AddSample(i, &from);
+      helper_.AddSample(i, &from);
+      helper_.AddSample(i, &to);
+    }
+
+    for (int i = 0; i < size; ++i) {
+      // A bound close enough to match, then a different one.
+      Distribution close = from;
+      close.mutable_explicit_buckets()->set_bounds(i, (i + 1) * (1 + 1e-6));
+      Distribution different = from;
+      different.mutable_explicit_buckets()->set_bounds(i, i + 1.5);
+
+      Distribution merged = to;
+      EXPECT_TRUE(helper_.Merge(close, &merged).ok());
+      Distribution not_merged = to;
+      EXPECT_FALSE(helper_.Merge(different, &not_merged).ok());
+      EXPECT_TRUE(MessageDifferencer::Equals(not_merged, to));
+      DistributionAccumulator accumulator(to);
+      EXPECT_FALSE(accumulator.Merge(different).ok());
+      EXPECT_FALSE(accumulator.Merge(DistributionAccumulator(different)).ok());
+    }
+
+    Distribution merged = to;
+    ASSERT_TRUE(helper_.Merge(from, &merged).ok());
+    DistributionAccumulator accumulator(to);
+    ASSERT_TRUE(accumulator.Merge(DistributionAccumulator(from)).ok());
+    Distribution accumulated;
+    accumulator.ToProto(&accumulated);
+    EXPECT_TRUE(MessageDifferencer::Equals(accumulated, merged));
+    ASSERT_EQ(merged.bucket_counts_size(), size + 1);
+    for (int i = 0; i <= size; ++i) {
+      EXPECT_EQ(merged.bucket_counts(i), 3 * (to.bucket_counts(i)));
+    }
+  }
+}
+
+TEST_F(DistributionHelperTest, Merge_ApproximatelyEqualBuckets) {
+  // Bounds off by less than the tolerance are not equal bitwise, and are
+  // compared approximately.
+  Distribution to;
+  ASSERT_TRUE(helper_.InitExplicit({1, 2}, &to).ok());
+  helper_.AddSample(1.5, &to);
+  Distribution from = to;
+  from.mutable_explicit_buckets()->set_bounds(1, 2 + 1e-12);
+
+  Distribution merged = to;
+  ASSERT_TRUE(helper_.Merge(from, &merged).ok());
+  EXPECT_EQ(2, merged.bucket_counts(1));
+
+  DistributionAccumulator accumulator(to);
+  ASSERT_TRUE(accumulator.Merge(from).ok());
+  ASSERT_TRUE(accumulator.Merge(DistributionAccumulator(from)).ok());
+  accumulator.ToProto(&merged);
+  EXPECT_EQ(3, merged.bucket_counts(1));
+}
+
+TEST(ExponentialBucketIndexTest, SameIndexesAsLog2) {
+  struct BucketOptions {
+    int num_finite_buckets;
+    double growth_factor;
+    double scale;
+  };
+  const BucketOptions kBucketOptions[] = {
+      {2, 2, 0.001}, {29, 2, 1e-6}, {8, 10, 1}, {40, 1.5, 0.1}, {300, 1.05, 3},
+  };
+  std::mt19937_64 random(1);
+  for (const auto& options : kBucketOptions) {
+    ExponentialBucketIndex index(options.num_finite_buckets,
+                                 options.growth_factor, options.scale);
+    EXPECT_TRUE(index.Matches(options.num_finite_buckets,
+                              options.growth_factor, options.scale));
+    EXPECT_FALSE(index.Matches(options.num_finite_buckets + 1,
+                               options.growth_factor, options.scale));
+
+    std::vector<double> values = {
+        0,
+        -1,
+        std::numeric_limits<double>::max(),
+        std::numeric_limits<double>::infinity(),
+        -std::numeric_limits<double>::infinity(),
+        std::numeric_limits<double>::quiet_NaN(),
+    };
+    // Values around the bucket bounds, where rounding matters.
+    double bound = options.scale;
+    for (int i = 0; i <= options.num_finite_buckets + 1; ++i) {
+      double value = bound;
+      for (int j = 0; j < 4; ++j) {
+        value = std::nextafter(value, 0.0);
+      }
+      for (int j = 0; j < 8; ++j) {
+        values.push_back(value);
+        value = std::nextafter(value, std::numeric_limits<double>::max());
+      }
+      bound *= options.growth_factor;
+    }
+    // Random values over the whole range of the buckets.
+    std::uniform_real_distribution<double> exponents(
+        -1, options.num_finite_buckets + 1);
+    for (int i = 0; i < 10000; ++i) {
+      values.push_back(options.scale *
+                       std::pow(options.growth_factor, exponents(random)));
+    }
+
+    for (double value : values) {
+      EXPECT_EQ(index.Find(value), ExponentialBucketIndex::FindWithLog2(
+                                       options.num_finite_buckets,
+                                       options.growth_factor, options.scale,
+                                       value))
+          << "value: " << value;
+    }
+  }
+}
+
+TEST(ExponentialBucketIndexTest, MoreBucketOptionsThanCached) {
+  // More bucket options than the per-thread cache holds, used in turn.
+  const int kNumOptions = 20;
+  std::vector<Distribution> distributions(kNumOptions);
+  std::vector<std::vector<int64_t>> expected(kNumOptions);
+  for (int i = 0; i < kNumOptions; ++i) {
+    ASSERT_TRUE(DistributionHelper::InitExponential(10 + i, 2, 0.001,
+                                                    &distributions[i])
+                    .ok());
+    expected[i].resize(12 + i);
+  }
+  std::mt19937_64 random(1);
+  std::uniform_real_distribution<double> exponents(-2, 25);
+  for (int round = 0; round < 1000; ++round) {
+    for (int i = 0; i < kNumOptions; ++i) {
+      double value = 0.001 * std::pow(2, exponents(random));
+      ASSERT_TRUE(DistributionHelper::AddSample(value, &distributions[i]).ok());
+      ++expected[i][ExponentialBucketIndex::FindWithLog2(10 + i, 2, 0.001,
+                                                         value)];
+    }
+  }
+  for (int i = 0; i < kNumOptions; ++i) {
+    std::vector<int64_t> bucket_counts(
+        distributions[i].bucket_counts().begin(),
+        distributions[i].bucket_counts().end());
+    EXPECT_EQ(bucket_counts, expected[i]);
+  }
+}
+
 }  // namespace
 }  // namespace service_control_client
 }  // namespace google
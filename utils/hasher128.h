@@ -0,0 +1,114 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef GOOGLE_SERVICE_CONTROL_CLIENT_UTILS_HASHER128_H_
+#define GOOGLE_SERVICE_CONTROL_CLIENT_UTILS_HASHER128_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <functional>
+#include <string>
+
+namespace google {
+namespace service_control_client {
+
+// A 128-bit digest. It is a plain value type, cheap to copy and compare.
+class Digest128 {
+ public:
+  // The digest is always 128 bits = 16 bytes.
+  static const int kDigestLength = 16;
+
+  Digest128() : low_(0), high_(0) {}
+  Digest128(uint64_t low, uint64_t high) : low_(low), high_(high) {}
+
+  // Builds a digest from kDigestLength bytes.
+  static Digest128 FromBytes(const void* bytes) {
+    uint64_t words[2];
+    memcpy(words, bytes, kDigestLength);
+    return Digest128(words[0], words[1]);
+  }
+
+  // Copies the kDigestLength bytes of the digest to bytes.
+  void ToBytes(void* bytes) const {
+    uint64_t words[2] = {low_, high_};
+    memcpy(bytes, words, kDigestLength);
+  }
+
+  // The low and high 64 bits of the digest.
+  uint64_t low() const { return low_; }
+  uint64_t high() const { return high_; }
+
+  // Returns a hash value of the digest, for hash tables. The digest bits are
+  // already well mixed, so its low bits are used as they are.
+  size_t hash() const { return static_cast<size_t>(low_); }
+
+  bool operator==(const Digest128& other) const {
+    return low_ == other.low_ && high_ == other.high_;
+  }
+  bool operator!=(const Digest128& other) const { return !(*this == other); }
+
+  // Converts the digest to a printable string.
+  // It is for debugging and unit-test only.
+  std::string DebugString() const {
+    unsigned char bytes[kDigestLength];
+    ToBytes(bytes);
+    static const char kHexDigits[] = "0123456789abcdef";
+    std::string result(kDigestLength * 2, '0');
+    for (int i = 0; i < kDigestLength; i++) {
+      result[2 * i] = kHexDigits[bytes[i] >> 4];
+      result[2 * i + 1] = kHexDigits[bytes[i] & 0xf];
+    }
+    return result;
+  }
+
+ private:
+  uint64_t low_;
+  uint64_t high_;
+};
+
+// Interface of incremental hashers producing a 128-bit digest. A hasher
+// computes one digest: Update() may not be called after Digest().
+class Hasher128 {
+ public:
+  virtual ~Hasher128() {}
+
+  // Updates the hash with data.
+  virtual Hasher128& Update(const void* data, size_t size) = 0;
+
+  // A helper function for const string
+  Hasher128& Update(const std::string& str) {
+    return Update(str.data(), str.size());
+  }
+
+  // Returns the digest of all the data.
+  virtual Digest128 Digest() = 0;
+};
+
+}  // namespace service_control_client
+}  // namespace google
+
+namespace std {
+
+template <>
+struct hash<::google::service_control_client::Digest128> {
+  size_t operator()(
+      const ::google::service_control_client::Digest128& digest) const {
+    return digest.hash();
+  }
+};
+
+}  // namespace std
+
+#endif  // GOOGLE_SERVICE_CONTROL_CLIENT_UTILS_HASHER128_H_
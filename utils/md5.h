@@ -19,6 +19,7 @@ limitations under the License.
 #include <string>
 #include <string.h>
 #include "openssl/md5.h"
+#include "utils/hasher128.h"
 
 namespace google {
 namespace service_control_client {
@@ -68,6 +69,26 @@ class MD5 {
   bool finalized_;
 };
 
+// A Hasher128 computing MD5 digests.
+class MD5Hasher128 : public Hasher128 {
+ public:
+  using Hasher128::Update;
+
+  // Updates the context with data.
+  Hasher128& Update(const void* data, size_t size) override {
+    md5_.Update(data, size);
+    return *this;
+  }
+
+  // Returns the MD5 digest.
+  Digest128 Digest() override {
+    return Digest128::FromBytes(md5_.Digest().data());
+  }
+
+ private:
+  MD5 md5_;
+};
+
 }  // namespace service_control_client
 }  // namespace google
 
@@ -0,0 +1,130 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// A bounded lock-free multi-producer single-consumer queue.
+
+#ifndef GOOGLE_SERVICE_CONTROL_CLIENT_UTILS_MPSC_QUEUE_H_
+#define GOOGLE_SERVICE_CONTROL_CLIENT_UTILS_MPSC_QUEUE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+#include "utils/google_macros.h"
+
+namespace google {
+namespace service_control_client {
+
+// Push() can be called from any thread. Pop() and Empty() must only be called
+// from one thread at a time, the consumer. None of them takes a lock: each
+// slot has a sequence number telling whether it is ready to be written or
+// read, as in Dmitry Vyukov's bounded MPMC queue.
+template <typename T>
+class BoundedMpscQueue {
+ public:
+  // The capacity is rounded up to a power of 2, at least 2 as a single slot
+  // could not tell a full queue from an empty one.
+  explicit BoundedMpscQueue(size_t capacity)
+      : mask_(RoundUpToPowerOf2(capacity) - 1),
+        cells_(new Cell[mask_ + 1]),
+        enqueue_pos_(0),
+        dequeue_pos_(0) {
+    for (size_t i = 0; i <= mask_; ++i) {
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  // Pushes an item. Returns false if the queue is full, item is not moved
+  // from then.
+  bool Push(T&& item) {
+    Cell* cell;
+    size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    for (;;) {
+      cell = &cells_[pos & mask_];
+      size_t sequence = cell->sequence.load(std::memory_order_acquire);
+      intptr_t diff =
+          static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+      if (diff == 0) {
+        if (enqueue_pos_.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = enqueue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+    cell->data = std::move(item);
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Pops the oldest item. Returns false if the queue is empty. Consumer only.
+  bool Pop(T* item) {
+    Cell* cell = &cells_[dequeue_pos_ & mask_];
+    if (cell->sequence.load(std::memory_order_acquire) != dequeue_pos_ + 1) {
+      return false;
+    }
+    *item = std::move(cell->data);
+    cell->sequence.store(dequeue_pos_ + mask_ + 1, std::memory_order_release);
+    ++dequeue_pos_;
+    return true;
+  }
+
+  // Returns whether the queue is empty, or its oldest item is still being
+  // pushed. Consumer only.
+  bool Empty() const {
+    const Cell& cell = cells_[dequeue_pos_ & mask_];
+    return cell.sequence.load(std::memory_order_acquire) != dequeue_pos_ + 1;
+  }
+
+  // Returns the maximum number of items in the queue.
+  size_t capacity() const { return mask_ + 1; }
+
+ private:
+  // A slot of the queue. Its item can be read when sequence is the position
+  // to read plus 1, and written when sequence is the position to write.
+  struct Cell {
+    std::atomic<size_t> sequence;
+    T data;
+  };
+
+  static size_t RoundUpToPowerOf2(size_t n) {
+    size_t power = 2;
+    while (power < n) {
+      power <<= 1;
+    }
+    return power;
+  }
+
+  // The capacity minus 1, to get the slot of a position.
+  const size_t mask_;
+  // The slots.
+  std::unique_ptr<Cell[]> cells_;
+  // The position of the next push.
+  std::atomic<size_t> enqueue_pos_;
+  // The position of the next pop. Only accessed by the consumer.
+  size_t dequeue_pos_;
+
+  GOOGLE_DISALLOW_EVIL_CONSTRUCTORS(BoundedMpscQueue);
+};
+
+}  // namespace service_control_client
+}  // namespace google
+
+#endif  // GOOGLE_SERVICE_CONTROL_CLIENT_UTILS_MPSC_QUEUE_H_
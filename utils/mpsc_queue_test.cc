@@ -0,0 +1,102 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "utils/mpsc_queue.h"
+
+#include <memory>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "utils/thread.h"
+
+namespace google {
+namespace service_control_client {
+namespace {
+
+TEST(BoundedMpscQueueTest, TestCapacityRoundedUp) {
+  EXPECT_EQ(2, BoundedMpscQueue<int>(0).capacity());
+  EXPECT_EQ(4, BoundedMpscQueue<int>(3).capacity());
+  EXPECT_EQ(8, BoundedMpscQueue<int>(8).capacity());
+}
+
+TEST(BoundedMpscQueueTest, TestFifo) {
+  BoundedMpscQueue<int> queue(4);
+  int item = 0;
+  EXPECT_TRUE(queue.Empty());
+  EXPECT_FALSE(queue.Pop(&item));
+
+  // Wraps around the slots a few times.
+  for (int round = 0; round < 3; ++round) {
+    for (int i = 0; i < 4; ++i) {
+      EXPECT_TRUE(queue.Push(round * 10 + i));
+    }
+    EXPECT_FALSE(queue.Push(100));
+    EXPECT_FALSE(queue.Empty());
+    for (int i = 0; i < 4; ++i) {
+      ASSERT_TRUE(queue.Pop(&item));
+      EXPECT_EQ(round * 10 + i, item);
+    }
+    EXPECT_TRUE(queue.Empty());
+  }
+}
+
+TEST(BoundedMpscQueueTest, TestFullQueueDoesNotMoveItem) {
+  BoundedMpscQueue<std::unique_ptr<int>> queue(2);
+  EXPECT_TRUE(queue.Push(std::unique_ptr<int>(new int(1))));
+  EXPECT_TRUE(queue.Push(std::unique_ptr<int>(new int(1))));
+  std::unique_ptr<int> item(new int(2));
+  EXPECT_FALSE(queue.Push(std::move(item)));
+  ASSERT_TRUE((bool)item);
+  EXPECT_EQ(2, *item);
+}
+
+TEST(BoundedMpscQueueTest, TestMultipleProducers) {
+  const int kProducers = 4;
+  const int kItemsPerProducer = 10000;
+  BoundedMpscQueue<int> queue(64);
+
+  std::vector<std::unique_ptr<Thread>> producers;
+  for (int p = 0; p < kProducers; ++p) {
+    producers.emplace_back(new Thread([&queue, p]() {
+      for (int i = 0; i < kItemsPerProducer; ++i) {
+        while (!queue.Push(p * kItemsPerProducer + i)) {
+          std::this_thread::yield();
+        }
+      }
+    }));
+  }
+
+  // Items of each producer are popped in the order they were pushed.
+  std::vector<int> next(kProducers, 0);
+  for (int popped = 0; popped < kProducers * kItemsPerProducer;) {
+    int item;
+    if (!queue.Pop(&item)) {
+      std::this_thread::yield();
+      continue;
+    }
+    int producer = item / kItemsPerProducer;
+    EXPECT_EQ(next[producer], item % kItemsPerProducer);
+    next[producer] = item % kItemsPerProducer + 1;
+    ++popped;
+  }
+  for (auto& producer : producers) {
+    producer->join();
+  }
+  EXPECT_TRUE(queue.Empty());
+}
+
+}  // namespace
+}  // namespace service_control_client
+}  // namespace google
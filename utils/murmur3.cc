@@ -0,0 +1,138 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "utils/murmur3.h"
+
+#include <algorithm>
+
+namespace google {
+namespace service_control_client {
+namespace {
+
+const uint64_t kC1 = 0x87c37b91114253d5ULL;
+const uint64_t kC2 = 0x4cf5ad432745937fULL;
+
+inline uint64_t Rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+inline uint64_t Load64(const unsigned char* p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+// Finalization mix: forces all bits of a hash block to avalanche.
+inline uint64_t FMix64(uint64_t k) {
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+}  // namespace
+
+Murmur3Hasher128::Murmur3Hasher128(uint64_t seed)
+    : h1_(seed), h2_(seed), tail_size_(0), length_(0) {}
+
+void Murmur3Hasher128::ProcessBlock(const unsigned char* block) {
+  uint64_t k1 = Load64(block);
+  uint64_t k2 = Load64(block + 8);
+
+  k1 *= kC1;
+  k1 = Rotl64(k1, 31);
+  k1 *= kC2;
+  h1_ ^= k1;
+
+  h1_ = Rotl64(h1_, 27);
+  h1_ += h2_;
+  h1_ = h1_ * 5 + 0x52dce729;
+
+  k2 *= kC2;
+  k2 = Rotl64(k2, 33);
+  k2 *= kC1;
+  h2_ ^= k2;
+
+  h2_ = Rotl64(h2_, 31);
+  h2_ += h1_;
+  h2_ = h2_ * 5 + 0x38495ab5;
+}
+
+Hasher128& Murmur3Hasher128::Update(const void* data, size_t size) {
+  const unsigned char* p = static_cast<const unsigned char*>(data);
+  length_ += size;
+
+  if (tail_size_ > 0) {
+    size_t n = std::min(size, kBlockSize - tail_size_);
+    memcpy(tail_ + tail_size_, p, n);
+    tail_size_ += n;
+    p += n;
+    size -= n;
+    if (tail_size_ < kBlockSize) {
+      return *this;
+    }
+    ProcessBlock(tail_);
+    tail_size_ = 0;
+  }
+
+  for (; size >= kBlockSize; p += kBlockSize, size -= kBlockSize) {
+    ProcessBlock(p);
+  }
+
+  memcpy(tail_, p, size);
+  tail_size_ = size;
+  return *this;
+}
+
+Digest128 Murmur3Hasher128::Digest() {
+  uint64_t h1 = h1_;
+  uint64_t h2 = h2_;
+
+  // The tail is zero padded, which gives the same k1 and k2 as the byte by
+  // byte tail handling of the reference implementation.
+  if (tail_size_ > 0) {
+    unsigned char block[kBlockSize] = {0};
+    memcpy(block, tail_, tail_size_);
+    uint64_t k1 = Load64(block);
+    uint64_t k2 = Load64(block + 8);
+    if (tail_size_ > 8) {
+      k2 *= kC2;
+      k2 = Rotl64(k2, 33);
+      k2 *= kC1;
+      h2 ^= k2;
+    }
+    k1 *= kC1;
+    k1 = Rotl64(k1, 31);
+    k1 *= kC2;
+    h1 ^= k1;
+  }
+
+  h1 ^= length_;
+  h2 ^= length_;
+
+  h1 += h2;
+  h2 += h1;
+
+  h1 = FMix64(h1);
+  h2 = FMix64(h2);
+
+  h1 += h2;
+  h2 += h1;
+
+  return Digest128(h1, h2);
+}
+
+}  // namespace service_control_client
+}  // namespace google
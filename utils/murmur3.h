@@ -0,0 +1,60 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef GOOGLE_SERVICE_CONTROL_CLIENT_UTILS_MURMUR3_H_
+#define GOOGLE_SERVICE_CONTROL_CLIENT_UTILS_MURMUR3_H_
+
+#include "utils/hasher128.h"
+
+namespace google {
+namespace service_control_client {
+
+// An incremental MurmurHash3_x64_128 hasher. It is a fast non-cryptographic
+// hash: it processes 16 bytes per round with a few 64-bit multiplies, and
+// needs no heap allocation. Its digest equals the one of the reference
+// implementation on little-endian machines.
+class Murmur3Hasher128 : public Hasher128 {
+ public:
+  explicit Murmur3Hasher128(uint64_t seed = 0);
+
+  using Hasher128::Update;
+
+  // Updates the hash with data.
+  Hasher128& Update(const void* data, size_t size) override;
+
+  // Returns the digest of all the data.
+  Digest128 Digest() override;
+
+ private:
+  // The hash is computed over blocks of kBlockSize bytes.
+  static const size_t kBlockSize = 16;
+
+  // Mixes one block into the hash state.
+  void ProcessBlock(const unsigned char* block);
+
+  // The hash state.
+  uint64_t h1_;
+  uint64_t h2_;
+  // Bytes that do not fill a block yet.
+  unsigned char tail_[kBlockSize];
+  size_t tail_size_;
+  // Total number of bytes hashed.
+  uint64_t length_;
+};
+
+}  // namespace service_control_client
+}  // namespace google
+
+#endif  // GOOGLE_SERVICE_CONTROL_CLIENT_UTILS_MURMUR3_H_
@@ -0,0 +1,68 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "utils/murmur3.h"
+#include "gtest/gtest.h"
+
+namespace google {
+namespace service_control_client {
+namespace {
+
+TEST(Murmur3Test, TestEmptyDigest) {
+  EXPECT_EQ("00000000000000000000000000000000",
+            Murmur3Hasher128().Digest().DebugString());
+}
+
+TEST(Murmur3Test, TestReferenceDigest) {
+  static const char data[] = "The quick brown fox jumps over the lazy dog";
+  Murmur3Hasher128 hasher;
+  hasher.Update(data, strlen(data));
+  EXPECT_EQ("6c1b07bc7bbc4be347939ac4a93c437a",
+            hasher.Digest().DebugString());
+}
+
+TEST(Murmur3Test, TestIncrementalUpdates) {
+  static const char data[] = "The quick brown fox jumps over the lazy dog";
+  const size_t size = strlen(data);
+  Murmur3Hasher128 whole;
+  Digest128 expected = whole.Update(data, size).Digest();
+
+  // Splits the data at every position, across and within blocks.
+  for (size_t i = 0; i <= size; ++i) {
+    for (size_t j = i; j <= size; ++j) {
+      Murmur3Hasher128 hasher;
+      hasher.Update(data, i);
+      hasher.Update(data + i, j - i);
+      hasher.Update(data + j, size - j);
+      EXPECT_EQ(expected, hasher.Digest()) << i << " " << j;
+    }
+  }
+}
+
+TEST(Murmur3Test, TestDigestEqual) {
+  static const char data1[] = "Test Data1";
+  static const char data2[] = "Test Data2";
+  Murmur3Hasher128 h1, h11, h2;
+  Digest128 d1 = h1.Update(data1, sizeof(data1)).Digest();
+  Digest128 d11 = h11.Update(data1, sizeof(data1)).Digest();
+  Digest128 d2 = h2.Update(data2, sizeof(data2)).Digest();
+  EXPECT_EQ(d11, d1);
+  EXPECT_NE(d1, d2);
+  EXPECT_EQ(d1, Digest128::FromBytes(&d1));
+}
+
+}  // namespace
+}  // namespace service_control_client
+}  // namespace google
@@ -18,6 +18,7 @@ limitations under the License.
 
 #include "google/protobuf/stubs/status.h"
 
+#include <condition_variable>
 #include <future>
 #include <mutex>
 #include <thread>
@@ -29,6 +30,7 @@ namespace service_control_client {
 // So they can be switched to use different packages.
 typedef std::mutex Mutex;
 typedef std::unique_lock<Mutex> MutexLock;
+typedef std::condition_variable CondVar;
 
 typedef std::future<::google::protobuf::util::Status> StatusFuture;
 typedef std::promise<::google::protobuf::util::Status> StatusPromise;